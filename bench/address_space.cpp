@@ -0,0 +1,246 @@
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "address_space.hpp"
+
+using namespace vmmu;
+using bench::address_space_spec;
+using bench::synthetic_address_space;
+using internal::paging_mode;
+
+namespace
+{
+constexpr uint64_t TABLE_FLAGS = PTE_P | PTE_W | PTE_U | PTE_A;
+constexpr uint64_t LEAF_FLAGS = TABLE_FLAGS | PTE_D;
+
+[[noreturn]] void fail(char const *msg)
+{
+  fprintf(stderr, "synthetic_address_space: %s\n", msg);
+  abort();
+}
+
+// The page table format of a paging mode. Levels are listed from the root
+// down by the lowest linear address bit that indexes them.
+struct format {
+  unsigned word_size;
+  std::vector<unsigned> orders;
+
+  // The number of index bits of the root table. Lower levels fill a page.
+  unsigned root_bits;
+
+  uint64_t address_space_size;
+};
+
+format format_of(paging_mode mode)
+{
+  switch (mode) {
+  case paging_mode::PM32:
+    return {4, {22, 12}, 10, uint64_t(1) << 32};
+  case paging_mode::PM32_PAE:
+    // The root is the PDPT, whose entries are loaded into the paging state.
+    return {8, {30, 21, 12}, 2, uint64_t(1) << 32};
+  case paging_mode::PM64_4LEVEL:
+    // Only the lower canonical half is used.
+    return {8, {39, 30, 21, 12}, 9, uint64_t(1) << 47};
+  case paging_mode::PHYS:
+    break;
+  }
+
+  fail("paging must be enabled");
+}
+
+class builder
+{
+  format const format_;
+
+  std::vector<uint64_t> ram_;
+
+  uint64_t read(uint64_t phys_addr) const
+  {
+    if (format_.word_size == 4)
+      return reinterpret_cast<uint32_t const *>(ram_.data())[phys_addr / 4];
+
+    return ram_[phys_addr / 8];
+  }
+
+  void write(uint64_t phys_addr, uint64_t value)
+  {
+    if (format_.word_size == 4)
+      reinterpret_cast<uint32_t *>(ram_.data())[phys_addr / 4] = uint32_t(value);
+    else
+      ram_[phys_addr / 8] = value;
+  }
+
+  uint64_t allocate_table()
+  {
+    uint64_t const phys_addr = ram_.size() * sizeof(uint64_t);
+
+    ram_.resize(ram_.size() + 512);
+    return phys_addr;
+  }
+
+  unsigned index_bits(unsigned level) const
+  {
+    if (level == 0)
+      return format_.root_bits;
+
+    return format_.word_size == 4 ? 10 : 9;
+  }
+
+public:
+  uint64_t const root;
+
+  std::vector<uint64_t> take_ram() { return std::move(ram_); }
+
+  // Map a page whose size is 2^order bytes at its identical physical address.
+  void map(uint64_t linear_addr, unsigned order)
+  {
+    uint64_t table = root;
+
+    for (unsigned level = 0; level < format_.orders.size(); level++) {
+      unsigned const level_order = format_.orders[level];
+      uint64_t const index = (linear_addr >> level_order) & ((1U << index_bits(level)) - 1);
+      uint64_t const entry_addr = table + index * format_.word_size;
+
+      if (level_order == order) {
+        if (read(entry_addr) & PTE_P)
+          fail("mappings overlap");
+
+        write(entry_addr, linear_addr | LEAF_FLAGS | (order > 12 ? PTE_PS : uint64_t(0)));
+        return;
+      }
+
+      uint64_t entry = read(entry_addr);
+
+      if (not(entry & PTE_P)) {
+        entry = allocate_table() | TABLE_FLAGS;
+        write(entry_addr, entry);
+      } else if (entry & PTE_PS) {
+        fail("mappings overlap");
+      }
+
+      table = entry & ~uint64_t(0xFFF) & ((uint64_t(1) << 52) - 1);
+    }
+
+    fail("page size doesn't exist in this paging mode");
+  }
+
+  // Create another root table with the same entries.
+  uint64_t copy_root()
+  {
+    uint64_t const copy = allocate_table();
+
+    for (uint64_t i = 0; i < (uint64_t(1) << format_.root_bits); i++)
+      write(copy + i * format_.word_size, read(root + i * format_.word_size));
+
+    return copy;
+  }
+
+  std::array<uint64_t, 4> pdptes(uint64_t pdpt) const
+  {
+    std::array<uint64_t, 4> result {};
+
+    for (size_t i = 0; i < result.size(); i++)
+      result[i] = read(pdpt + i * 8) & ~uint64_t(PTE_W | PTE_U | PTE_A);
+
+    return result;
+  }
+
+  explicit builder(address_space_spec const &spec)
+      : format_(format_of(spec.mode)), root(allocate_table())
+  {
+  }
+};
+
+}  // namespace
+
+synthetic_address_space::layout synthetic_address_space::build(address_space_spec const &spec)
+{
+  format const fmt = format_of(spec.mode);
+  builder b {spec};
+
+  unsigned const large_order = spec.mode == paging_mode::PM32 ? 22 : 21;
+  unsigned const largest_order = spec.mode == paging_mode::PM64_4LEVEL ? 30 : large_order;
+  unsigned const total_weight = spec.weight_4k + spec.weight_large + spec.weight_1g;
+
+  if (total_weight == 0 or spec.regions == 0 or spec.stride == 0 or spec.address_spaces == 0)
+    fail("invalid specification");
+
+  if (spec.weight_1g != 0 and spec.mode != paging_mode::PM64_4LEVEL)
+    fail("1GB pages need 4-level paging");
+
+  // Regions are aligned to the largest page size.
+  uint64_t const region_size =
+      (fmt.address_space_size / spec.regions) & ~((uint64_t(1) << largest_order) - 1);
+
+  if (region_size == 0)
+    fail("too many regions");
+
+  std::vector<uint64_t> cursors;
+
+  for (unsigned r = 0; r < spec.regions; r++)
+    cursors.push_back(r * region_size);
+
+  std::mt19937_64 rng {spec.seed};
+  std::vector<mapping> mappings;
+
+  mappings.reserve(spec.mappings);
+
+  for (size_t i = 0; i < spec.mappings; i++) {
+    uint64_t const choice = rng() % total_weight;
+    unsigned const order = choice < spec.weight_4k                      ? 12
+                           : choice < spec.weight_4k + spec.weight_large ? large_order
+                                                                         : 30;
+    uint64_t const size = uint64_t(1) << order;
+    uint64_t &cursor = cursors[i % spec.regions];
+    uint64_t const linear_addr = (cursor + size - 1) & ~(size - 1);
+
+    if (linear_addr + size > (i % spec.regions + 1) * region_size)
+      fail("region is full");
+
+    b.map(linear_addr, order);
+    mappings.push_back({linear_addr, size});
+
+    cursor = linear_addr + size * spec.stride;
+  }
+
+  std::vector<uint64_t> roots {b.root};
+
+  for (unsigned i = 1; i < spec.address_spaces; i++)
+    roots.push_back(b.copy_root());
+
+  std::vector<paging_state> states;
+
+  for (uint64_t root : roots) {
+    switch (spec.mode) {
+    case paging_mode::PM32:
+      states.push_back({RFLAGS_RSVD, CR0_PG, root, CR4_PSE, 0, 0});
+      break;
+    case paging_mode::PM32_PAE:
+      states.push_back({RFLAGS_RSVD, CR0_PG, root, CR4_PAE, 0, 0, b.pdptes(root)});
+      break;
+    case paging_mode::PM64_4LEVEL:
+      states.push_back({RFLAGS_RSVD, CR0_PG, root, CR4_PAE, EFER_LME, 0});
+      break;
+    case paging_mode::PHYS:
+      break;
+    }
+  }
+
+  return {b.take_ram(), std::move(states), std::move(mappings)};
+}
+
+synthetic_address_space::synthetic_address_space(layout &&l)
+    : ram_(std::move(l.ram)),
+      memory({{0, ram_.size() * sizeof(uint64_t), ram_.data()}}),
+      states(std::move(l.states)),
+      mappings(std::move(l.mappings))
+{
+}
+
+synthetic_address_space::synthetic_address_space(address_space_spec const &spec)
+    : synthetic_address_space(build(spec))
+{
+}
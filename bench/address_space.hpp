@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+
+namespace bench
+{
+// A declarative description of a synthetic address space.
+struct address_space_spec {
+  vmmu::internal::paging_mode mode = vmmu::internal::paging_mode::PM64_4LEVEL;
+
+  // The number of leaf mappings.
+  size_t mappings = 1;
+
+  // The relative frequencies of page sizes. Large pages are 4MB with 32-bit
+  // paging and 2MB otherwise. 1GB pages only exist with 4-level paging.
+  unsigned weight_4k = 1;
+  unsigned weight_large = 0;
+  unsigned weight_1g = 0;
+
+  // Consecutive mappings in a region are this many pages of their size apart.
+  // With 1, mappings are dense. Larger values leave holes, so the same number
+  // of mappings needs more page tables.
+  unsigned stride = 1;
+
+  // Mappings are distributed round-robin over this many regions that are
+  // spread evenly across the address space. Mappings in different regions
+  // don't share any page tables below the root.
+  unsigned regions = 1;
+
+  // The number of address spaces, i.e. CR3 values. They have separate root
+  // tables, but share all page tables below, like the kernel half of
+  // processes.
+  unsigned address_spaces = 1;
+
+  // Seeds the choice of page sizes.
+  uint64_t seed = 0;
+};
+
+// A leaf mapping in a synthetic address space. Mappings are identity mapped.
+struct mapping {
+  uint64_t linear_addr;
+  uint64_t size;
+};
+
+// Page tables that are generated from an address_space_spec in flat memory.
+//
+// Page tables are allocated from physical address 0 upwards. All entries are
+// present, writable, user-accessible, accessed and dirty, so walks don't
+// write. Generating an address space with millions of mappings takes well
+// below a second.
+class synthetic_address_space
+{
+  struct layout {
+    std::vector<uint64_t> ram;
+    std::vector<vmmu::paging_state> states;
+    std::vector<mapping> mappings;
+  };
+
+  static layout build(address_space_spec const &spec);
+
+  std::vector<uint64_t> ram_;
+
+  explicit synthetic_address_space(layout &&l);
+
+public:
+  vmmu::flat_memory memory;
+
+  // One paging state for each address space.
+  std::vector<vmmu::paging_state> states;
+
+  // All mappings in the order they were generated.
+  std::vector<mapping> mappings;
+
+  // The amount of memory used by page tables.
+  uint64_t page_table_bytes() const { return ram_.size() * sizeof(uint64_t); }
+
+  explicit synthetic_address_space(address_space_spec const &spec);
+
+  synthetic_address_space(synthetic_address_space const &) = delete;
+  synthetic_address_space &operator=(synthetic_address_space const &) = delete;
+};
+
+}  // namespace bench
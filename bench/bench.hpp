@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A minimal benchmark harness.
+//
+// A benchmark is a function that runs the measured operation a given number of
+// times. The harness increases the number of iterations until a run takes long
+// enough to be timed reliably and reports the time per iteration.
+namespace bench
+{
+using benchmark_fn = void (*)(uint64_t iterations);
+
+struct benchmark {
+  char const *name;
+  benchmark_fn fn;
+};
+
+std::vector<benchmark> &registry();
+
+struct registration {
+  registration(char const *name, benchmark_fn fn) { registry().push_back({name, fn}); }
+};
+
+// Prevent the compiler from optimizing away the computation of value.
+template <typename T>
+inline void do_not_optimize(T const &value)
+{
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+}  // namespace bench
+
+#define BENCHMARK(name)                                                 \
+  static void name(uint64_t iterations);                                \
+  static ::bench::registration const name##_registration {#name, name}; \
+  static void name(uint64_t iterations)
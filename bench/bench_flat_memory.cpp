@@ -0,0 +1,108 @@
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+
+#include "bench.hpp"
+#include "fixture.hpp"
+
+using namespace vmmu;
+using bench::fixture;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+}  // namespace
+
+BENCHMARK(flat_memory_read_64)
+{
+  auto &mem = fixture().memory;
+
+  for (uint64_t i = 0; i < iterations; i++)
+    bench::do_not_optimize(mem.read(0x4000 + (i % 512) * 8, uint64_t {}));
+}
+
+BENCHMARK(flat_memory_cmpxchg_64)
+{
+  auto &mem = fixture().memory;
+  uint64_t value = mem.read(0x8000, uint64_t {});
+
+  for (uint64_t i = 0; i < iterations; i++, value++)
+    bench::do_not_optimize(mem.cmpxchg(0x8000, value, value + 1));
+}
+
+BENCHMARK(flat_memory_walk_4level_4k)
+{
+  auto &f = fixture();
+
+  for (uint64_t i = 0; i < iterations; i++)
+    bench::do_not_optimize(translate({(i % 512) << 12, access_type::READ}, f.state, &f.memory));
+}
+
+BENCHMARK(flat_memory_walk_4level_4k_virtual)
+{
+  auto &f = fixture();
+  abstract_memory *memory = &f.memory;
+
+  for (uint64_t i = 0; i < iterations; i++)
+    bench::do_not_optimize(translate({(i % 512) << 12, access_type::READ}, f.state, memory));
+}
+
+namespace
+{
+// Operations that touch 16 neighboring pages eight times each, as in a string
+// instruction or a gather.
+std::vector<linear_memory_op> const &batch_ops()
+{
+  static std::vector<linear_memory_op> ops = []() {
+    std::vector<linear_memory_op> v;
+
+    for (uint64_t i = 0; i < 128; i++)
+      v.push_back({(i / 8) << 12 | (i % 8) * 8, access_type::READ});
+
+    return v;
+  }();
+
+  return ops;
+}
+}  // namespace
+
+BENCHMARK(flat_memory_walk_128_ops_single)
+{
+  auto &f = fixture();
+  auto const &ops = batch_ops();
+
+  for (uint64_t i = 0; i < iterations; i++)
+    for (auto const &op : ops)
+      bench::do_not_optimize(translate(op, f.state, &f.memory));
+}
+
+BENCHMARK(flat_memory_walk_128_ops_batch)
+{
+  auto &f = fixture();
+  auto const &ops = batch_ops();
+  std::vector<translate_result> results(ops.size());
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    translate_batch(ops.data(), ops.size(), f.state, &f.memory, results.data());
+    bench::do_not_optimize(results);
+  }
+}
+
+BENCHMARK(flat_memory_range_64k_per_page)
+{
+  auto &f = fixture();
+
+  for (uint64_t i = 0; i < iterations; i++)
+    for (uint64_t page = 0; page < 16; page++)
+      bench::do_not_optimize(translate({page << 12, access_type::READ}, f.state, &f.memory));
+}
+
+BENCHMARK(flat_memory_range_64k)
+{
+  auto &f = fixture();
+  std::vector<phys_segment> segments;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    translate_range({0, access_type::READ}, 0x10000, f.state, &f.memory, segments);
+    bench::do_not_optimize(segments);
+  }
+}
@@ -0,0 +1,94 @@
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+#include <vmmu/nested.hpp>
+
+#include "bench.hpp"
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+
+// The guest page tables of the flat fixture, but in guest-physical memory
+// that an identity EPT maps to host-physical memory at GUEST_BASE. The EPT
+// maps the first 2MB with 4KB pages.
+class nested_fixture
+{
+  static constexpr uint64_t GUEST_BASE = 0x200000;
+
+  std::vector<uint64_t> ram_;
+
+  uint64_t &entry(uint64_t hpa) { return ram_[hpa / sizeof(uint64_t)]; }
+
+public:
+  flat_memory memory;
+  paging_state const state {RFLAGS_RSVD, CR0_PG, 0x1000, CR4_PAE, EFER_LME, 0};
+  ept_state const ept {EPTP_WALK_LENGTH_4};
+
+  nested_fixture()
+      : ram_(0x400000 / sizeof(uint64_t)), memory({{0, 0x400000, ram_.data()}})
+  {
+    uint64_t const flags = PTE_P | PTE_W | PTE_A | PTE_D;
+
+    entry(0x0000) = 0x1000 | EPT_RWX;
+    entry(0x1000) = 0x2000 | EPT_RWX;
+    entry(0x2000) = 0x3000 | EPT_RWX;
+
+    for (uint64_t page = 0; page < 512; page++)
+      entry(0x3000 + page * 8) = (GUEST_BASE + (page << 12)) | EPT_RWX;
+
+    entry(GUEST_BASE + 0x1000) = 0x2000 | flags;
+    entry(GUEST_BASE + 0x2000) = 0x3000 | flags;
+    entry(GUEST_BASE + 0x3000) = 0x4000 | flags;
+
+    for (uint64_t pte = 0; pte < 512; pte++)
+      entry(GUEST_BASE + 0x4000 + pte * 8) = (pte << 12) | flags;
+  }
+};
+
+nested_fixture &fixture()
+{
+  static nested_fixture f;
+  return f;
+}
+
+}  // namespace
+
+// A full two-dimensional walk without any caches.
+BENCHMARK(nested_walk)
+{
+  auto &f = fixture();
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t const page = (i * 37) % 512;
+    bench::do_not_optimize(
+        translate_nested({page << 12, access_type::READ}, f.state, f.ept, &f.memory));
+  }
+}
+
+// Guest walks where all guest-physical translations hit the EPT cache.
+BENCHMARK(nested_walk_ept_cache)
+{
+  auto &f = fixture();
+  ept_cache cache;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t const page = (i * 37) % 8;
+    bench::do_not_optimize(
+        translate_nested({page << 12, access_type::READ}, f.state, f.ept, &f.memory, &cache));
+  }
+}
+
+BENCHMARK(nested_tlb_hit)
+{
+  static nested_tlb<64, 4> tlb;
+
+  auto &f = fixture();
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t const page = (i * 37) % 64;
+    bench::do_not_optimize(
+        tlb.translate({page << 12, access_type::READ}, f.state, f.ept, &f.memory));
+  }
+}
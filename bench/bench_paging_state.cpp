@@ -0,0 +1,39 @@
+#include <vmmu/vmmu.hpp>
+
+#include "bench.hpp"
+#include "fixture.hpp"
+
+using namespace vmmu;
+using bench::fixture;
+
+// Toggle RFLAGS.AC like a guest that executes STAC and CLAC around user
+// memory accesses.
+BENCHMARK(paging_state_stac_clac)
+{
+  paging_state state = fixture().state;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    state.set_rflags(RFLAGS_RSVD | (i & 1 ? RFLAGS_AC : uint64_t(0)));
+    bench::do_not_optimize(state);
+  }
+}
+
+// Switch between user and kernel mode.
+BENCHMARK(paging_state_set_cpl)
+{
+  paging_state state = fixture().state;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    state.set_cpl(i & 1 ? 3 : 0);
+    bench::do_not_optimize(state);
+  }
+}
+
+// Toggle CR0.WP, which recomputes the access rights.
+BENCHMARK(paging_state_set_cr0_wp)
+{
+  paging_state state = fixture().state;
+
+  for (uint64_t i = 0; i < iterations; i++)
+    bench::do_not_optimize(state.set_cr0(CR0_PG | (i & 1 ? CR0_WP : uint64_t(0))));
+}
@@ -0,0 +1,101 @@
+#include <vmmu/vmmu.hpp>
+
+#include "address_space.hpp"
+#include "bench.hpp"
+
+using namespace vmmu;
+using bench::address_space_spec;
+using bench::synthetic_address_space;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+using internal::paging_mode;
+
+// Pick a pseudo-random element for each iteration. The cost doesn't depend on
+// the number of elements.
+size_t pick(uint64_t i, size_t count)
+{
+  return size_t(((i * 0x9E3779B97F4A7C15ULL) >> 32) % count);
+}
+
+// Access random mappings of an address space through a TLB.
+template <typename TLB>
+void tlb_working_set(synthetic_address_space &as, uint64_t iterations)
+{
+  static TLB tlb;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t const linear_addr = as.mappings[pick(i, as.mappings.size())].linear_addr;
+    bench::do_not_optimize(tlb.translate({linear_addr, access_type::READ}, as.states[0], &as.memory));
+  }
+}
+
+// An address space with the given number of 4KB pages.
+template <size_t MAPPINGS>
+synthetic_address_space &pages_4k()
+{
+  static synthetic_address_space as {address_space_spec {paging_mode::PM64_4LEVEL, MAPPINGS}};
+  return as;
+}
+
+// The same number of mappings, but with one 2MB page for every three 4KB
+// pages.
+template <size_t MAPPINGS>
+synthetic_address_space &pages_mixed()
+{
+  static synthetic_address_space as {address_space_spec {paging_mode::PM64_4LEVEL, MAPPINGS, 3, 1}};
+  return as;
+}
+
+// 4096 4KB pages that each have their own page table, spread over the given
+// number of regions. With more regions, fewer walks share upper levels.
+template <unsigned REGIONS>
+void walk_regions(uint64_t iterations)
+{
+  static synthetic_address_space as {address_space_spec {
+      paging_mode::PM64_4LEVEL, 4096, 1, 0, 0, /* stride */ 512, REGIONS}};
+  static paging_structure_cache psc;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t const linear_addr = as.mappings[pick(i, as.mappings.size())].linear_addr;
+    bench::do_not_optimize(
+        translate({linear_addr, access_type::READ}, as.states[0], &as.memory, &psc));
+  }
+}
+
+}  // namespace
+
+BENCHMARK(scaling_set_assoc_64x4_256_pages)
+{
+  tlb_working_set<set_assoc_tlb<64, 4>>(pages_4k<256>(), iterations);
+}
+
+BENCHMARK(scaling_set_assoc_64x4_4k_pages)
+{
+  tlb_working_set<set_assoc_tlb<64, 4>>(pages_4k<4096>(), iterations);
+}
+
+BENCHMARK(scaling_set_assoc_64x4_64k_pages)
+{
+  tlb_working_set<set_assoc_tlb<64, 4>>(pages_4k<65536>(), iterations);
+}
+
+BENCHMARK(scaling_set_assoc_64x4_1m_pages)
+{
+  tlb_working_set<set_assoc_tlb<64, 4>>(pages_4k<1048576>(), iterations);
+}
+
+BENCHMARK(scaling_split_64x4_4k_mixed_pages)
+{
+  tlb_working_set<split_tlb<64, 4>>(pages_mixed<4096>(), iterations);
+}
+
+BENCHMARK(scaling_split_64x4_64k_mixed_pages)
+{
+  tlb_working_set<split_tlb<64, 4>>(pages_mixed<65536>(), iterations);
+}
+
+BENCHMARK(scaling_walk_psc_1_region) { walk_regions<1>(iterations); }
+BENCHMARK(scaling_walk_psc_64_regions) { walk_regions<64>(iterations); }
+BENCHMARK(scaling_walk_psc_4096_regions) { walk_regions<4096>(iterations); }
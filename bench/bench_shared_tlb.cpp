@@ -0,0 +1,45 @@
+#include <thread>
+#include <vector>
+#include <vmmu/shared_tlb.hpp>
+
+#include "bench.hpp"
+#include "fixture.hpp"
+
+using namespace vmmu;
+using bench::fixture;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+
+// Split the iterations across THREADS threads that all translate the same 64
+// pages with one shared TLB. The result is the time per translation of all
+// threads together, so it goes down as long as lookups scale.
+template <unsigned THREADS>
+void shared_tlb_hits(uint64_t iterations)
+{
+  static shared_tlb<256, 4> tlb;
+
+  auto &f = fixture();
+  std::vector<std::thread> threads;
+
+  for (unsigned t = 0; t < THREADS; t++)
+    threads.emplace_back([&f, iterations, t]() {
+      paging_state const state = f.state;
+
+      for (uint64_t i = t; i < iterations; i += THREADS) {
+        uint64_t const page = (i * 37) % 64;
+        bench::do_not_optimize(tlb.translate({page << 12, access_type::READ}, state, &f.memory));
+      }
+    });
+
+  for (auto &t : threads)
+    t.join();
+}
+
+}  // namespace
+
+BENCHMARK(shared_tlb_hit_1_thread) { shared_tlb_hits<1>(iterations); }
+BENCHMARK(shared_tlb_hit_2_threads) { shared_tlb_hits<2>(iterations); }
+BENCHMARK(shared_tlb_hit_4_threads) { shared_tlb_hits<4>(iterations); }
+BENCHMARK(shared_tlb_hit_8_threads) { shared_tlb_hits<8>(iterations); }
@@ -0,0 +1,40 @@
+#include <vmmu/simd_tlb.hpp>
+#include <vmmu/stats.hpp>
+#include <vmmu/vmmu.hpp>
+
+#include "bench.hpp"
+#include "fixture.hpp"
+
+using namespace vmmu;
+using bench::fixture;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+
+// Translate addresses in PAGES different pages that all fit into the TLB, so
+// everything but the first access to each page hits.
+template <typename TLB, uint64_t PAGES>
+void tlb_hits(uint64_t iterations)
+{
+  auto &f = fixture();
+  TLB tlb;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t const page = (i * 37) % PAGES;
+    bench::do_not_optimize(tlb.translate({page << 12, access_type::READ}, f.state, &f.memory));
+  }
+}
+
+}  // namespace
+
+BENCHMARK(tlb_hit_fully_assoc_8) { tlb_hits<tlb<8>, 8>(iterations); }
+BENCHMARK(tlb_hit_fully_assoc_16) { tlb_hits<tlb<16>, 16>(iterations); }
+BENCHMARK(tlb_hit_fully_assoc_32) { tlb_hits<tlb<32>, 32>(iterations); }
+BENCHMARK(tlb_hit_fully_assoc_64) { tlb_hits<tlb<64>, 64>(iterations); }
+BENCHMARK(tlb_hit_fully_assoc_64_stats) { tlb_hits<tlb<64, translation_stats>, 64>(iterations); }
+BENCHMARK(tlb_hit_simd_64) { tlb_hits<simd_tlb<64>, 64>(iterations); }
+BENCHMARK(tlb_hit_simd_128) { tlb_hits<simd_tlb<128>, 128>(iterations); }
+BENCHMARK(tlb_hit_set_assoc_16x4) { tlb_hits<set_assoc_tlb<16, 4>, 64>(iterations); }
+BENCHMARK(tlb_hit_set_assoc_64x4) { tlb_hits<set_assoc_tlb<64, 4>, 256>(iterations); }
+BENCHMARK(tlb_hit_split_16x4) { tlb_hits<split_tlb<16, 4>, 64>(iterations); }
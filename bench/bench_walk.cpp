@@ -0,0 +1,83 @@
+#include <vmmu/vmmu.hpp>
+
+#include "bench.hpp"
+#include "fixture.hpp"
+
+using namespace vmmu;
+using bench::fixture;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+
+// Walk the page table of the given state for 512 consecutive pages starting
+// at base, so accesses to the page table entries don't all hit the same
+// cache line. Large pages are walked at different offsets.
+void walk(paging_state const &state, uint64_t base, uint64_t iterations)
+{
+  auto &f = fixture();
+
+  for (uint64_t i = 0; i < iterations; i++)
+    bench::do_not_optimize(
+        translate({base + ((i % 512) << 12), access_type::READ}, state, &f.memory));
+}
+
+}  // namespace
+
+BENCHMARK(walk_pm32_4k) { walk(fixture().state_pm32, 0, iterations); }
+BENCHMARK(walk_pm32_4m) { walk(fixture().state_pm32, 0x400000, iterations); }
+BENCHMARK(walk_pae_4k) { walk(fixture().state_pae, 0, iterations); }
+BENCHMARK(walk_pae_2m) { walk(fixture().state_pae, 0x200000, iterations); }
+BENCHMARK(walk_4level_4k) { walk(fixture().state, 0, iterations); }
+BENCHMARK(walk_4level_2m) { walk(fixture().state, 0x200000, iterations); }
+BENCHMARK(walk_4level_1g) { walk(fixture().state, 0x40000000, iterations); }
+
+// Every walk has to set the accessed and dirty flags in the page table entry,
+// because they are cleared before each iteration.
+BENCHMARK(walk_4level_4k_ad_update)
+{
+  auto &f = fixture();
+  uint64_t &pte = f.entry(0x4000);
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    pte &= ~uint64_t(PTE_A | PTE_D);
+    bench::do_not_optimize(translate({0, access_type::WRITE}, f.state, &f.memory));
+  }
+}
+
+// The same without the accessed/dirty updates, for comparison.
+BENCHMARK(walk_4level_4k_write)
+{
+  auto &f = fixture();
+  uint64_t &pte = f.entry(0x4000);
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    pte |= PTE_A | PTE_D;
+    bench::do_not_optimize(translate({0, access_type::WRITE}, f.state, &f.memory));
+  }
+}
+
+// Check the access rights of a TLB entry for all combinations of access type,
+// implicit supervisor access and page attributes.
+BENCHMARK(tlb_entry_allows)
+{
+  using sv_type = linear_memory_op::supervisor_type;
+
+  auto const &state = fixture().state;
+
+  linear_memory_op const ops[] {
+      {0, access_type::READ, sv_type::EXPLICIT},  {0, access_type::WRITE, sv_type::EXPLICIT},
+      {0, access_type::EXECUTE, sv_type::EXPLICIT}, {0, access_type::READ, sv_type::IMPLICIT},
+      {0, access_type::WRITE, sv_type::IMPLICIT},
+  };
+
+  uint64_t allowed = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    tlb_entry const entry {0, 0, 12, tlb_attr {bool(i & 1), bool(i & 2), bool(i & 4), true}};
+
+    allowed += entry.allows(ops[i % 5], state);
+  }
+
+  bench::do_not_optimize(allowed);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+
+namespace bench
+{
+// Guest RAM with page tables for all paging modes. All accessed and dirty
+// bits are already set, so walks don't write.
+//
+// The 4-level page table maps the first 2MB with 4KB pages, the next 2MB with
+// a 2MB page and the second GB with a 1GB page. The PAE page table does the
+// same for the first 4MB. The 32-bit page table maps the first 4MB with 4KB
+// pages and the next 4MB with a 4MB page.
+class flat_fixture
+{
+  std::vector<uint64_t> ram_;
+
+public:
+  vmmu::flat_memory memory;
+  vmmu::paging_state const state {vmmu::RFLAGS_RSVD, vmmu::CR0_PG, 0x1000, vmmu::CR4_PAE,
+                                 vmmu::EFER_LME, 0};
+  vmmu::paging_state const state_pae {vmmu::RFLAGS_RSVD, vmmu::CR0_PG, 0x8000, vmmu::CR4_PAE, 0, 0,
+                                     {0x7000 | vmmu::PTE_P}};
+  vmmu::paging_state const state_pm32 {vmmu::RFLAGS_RSVD, vmmu::CR0_PG, 0x5000, vmmu::CR4_PSE,
+                                      0, 0};
+
+  uint64_t &entry(uint64_t phys_addr) { return ram_[phys_addr / sizeof(uint64_t)]; }
+
+  uint32_t &entry32(uint64_t phys_addr)
+  {
+    return reinterpret_cast<uint32_t *>(ram_.data())[phys_addr / sizeof(uint32_t)];
+  }
+
+  flat_fixture() : ram_(0x10000 / sizeof(uint64_t)), memory({{0, 0x10000, ram_.data()}})
+  {
+    using namespace vmmu;
+
+    uint64_t const flags = PTE_P | PTE_W | PTE_A | PTE_D;
+
+    // 4-level paging
+    entry(0x1000) = 0x2000 | flags;
+    entry(0x2000) = 0x3000 | flags;
+    entry(0x2008) = 0x40000000 | PTE_PS | flags;
+    entry(0x3000) = 0x4000 | flags;
+    entry(0x3008) = 0x200000 | PTE_PS | flags;
+
+    for (uint64_t pte = 0; pte < 512; pte++)
+      entry(0x4000 + pte * 8) = (0x100000 + (pte << 12)) | flags;
+
+    // 32-bit paging
+    entry32(0x5000) = 0x6000 | flags;
+    entry32(0x5004) = 0x400000 | PTE_PS | flags;
+
+    for (uint64_t pte = 0; pte < 1024; pte++)
+      entry32(0x6000 + pte * 4) = uint32_t(0x100000 + (pte << 12)) | flags;
+
+    // PAE paging shares the page table with 4-level paging. The PDPTEs are
+    // loaded into the paging state.
+    entry(0x8000) = 0x7000 | PTE_P;
+    entry(0x7000) = 0x4000 | flags;
+    entry(0x7008) = 0x200000 | PTE_PS | flags;
+  }
+};
+
+inline flat_fixture &fixture()
+{
+  static flat_fixture f;
+  return f;
+}
+
+}  // namespace bench
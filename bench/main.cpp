@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench.hpp"
+
+std::vector<bench::benchmark> &bench::registry()
+{
+  static std::vector<benchmark> benchmarks;
+  return benchmarks;
+}
+
+namespace
+{
+using clock = std::chrono::steady_clock;
+
+// The minimum duration of a timed run.
+constexpr std::chrono::milliseconds min_run_time {100};
+
+struct result {
+  uint64_t iterations;
+
+  // Nanoseconds per iteration of the fastest and the median run.
+  double min;
+  double median;
+};
+
+double time_run(bench::benchmark const &b, uint64_t iterations)
+{
+  auto const start = clock::now();
+  b.fn(iterations);
+  auto const elapsed = clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count();
+}
+
+// Find the number of iterations that takes long enough and then repeat runs
+// with the same number of iterations. The first runs also warm up caches.
+result run(bench::benchmark const &b, unsigned repetitions)
+{
+  uint64_t iterations = 1;
+
+  // Benchmarks set up their fixtures in the first run. Don't let this count.
+  b.fn(1);
+
+  while (time_run(b, iterations) < std::chrono::nanoseconds(min_run_time).count())
+    iterations *= 2;
+
+  std::vector<double> times;
+
+  for (unsigned i = 0; i < repetitions; i++)
+    times.push_back(time_run(b, iterations) / double(iterations));
+
+  std::sort(times.begin(), times.end());
+
+  return {iterations, times.front(), times[times.size() / 2]};
+}
+
+}  // namespace
+
+// Usage: bench [--json] [--repetitions N] [FILTER]
+//
+// Runs all benchmarks whose name contains FILTER. With --json, the results are
+// written as a JSON array that can be compared across builds.
+int main(int argc, char **argv)
+{
+  char const *filter = "";
+  bool json = false;
+  unsigned repetitions = 5;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--repetitions") == 0 and i + 1 < argc) {
+      repetitions = std::max(1, atoi(argv[++i]));
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Usage: %s [--json] [--repetitions N] [FILTER]\n", argv[0]);
+      return 1;
+    } else {
+      filter = argv[i];
+    }
+  }
+
+  bool first = true;
+
+  if (json)
+    printf("[\n");
+
+  for (auto const &b : bench::registry()) {
+    if (not strstr(b.name, filter))
+      continue;
+
+    result const r = run(b, repetitions);
+
+    if (json)
+      printf("%s  {\"name\": \"%s\", \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f, "
+             "\"iterations\": %llu, \"repetitions\": %u}",
+             first ? "" : ",\n", b.name, r.median, r.min, (unsigned long long)r.iterations,
+             repetitions);
+    else
+      printf("%-40s %10.2f ns/op (min %.2f)\n", b.name, r.median, r.min);
+
+    fflush(stdout);
+    first = false;
+  }
+
+  if (json)
+    printf("%s]\n", first ? "" : "\n");
+
+  return 0;
+}
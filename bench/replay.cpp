@@ -0,0 +1,224 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <vmmu/simd_tlb.hpp>
+#include <vmmu/translation_trace.hpp>
+
+using namespace vmmu;
+
+namespace
+{
+// Translations without a TLB as the baseline.
+struct no_tlb {
+  void clear() {}
+
+  template <typename MEMORY>
+  translate_result translate(linear_memory_op const &op, paging_state const &state, MEMORY *memory)
+  {
+    return ::vmmu::translate(op, state, memory);
+  }
+};
+
+template <typename TLB, typename = void>
+struct has_mov_to_cr3 : std::false_type {
+};
+
+template <typename TLB>
+struct has_mov_to_cr3<TLB,
+                      std::void_t<decltype(std::declval<TLB &>().mov_to_cr3(
+                          0, std::declval<paging_state const &>()))>> : std::true_type {
+};
+
+// Invalidate the TLB like a guest would after the given paging state changes.
+// TLBs that don't track PCIDs are cleared when CR3 changes.
+template <typename TLB>
+void invalidate(TLB *tlb, unsigned changes, paging_state const &state)
+{
+  if (changes & (paging_state::CHANGE_MODE | paging_state::CHANGE_TRANSLATION)) {
+    tlb->clear();
+  } else if (changes & paging_state::CHANGE_CR3) {
+    if constexpr (has_mov_to_cr3<TLB>::value)
+      tlb->mov_to_cr3(state.get_cr3(), state);
+    else
+      tlb->clear();
+  }
+}
+
+// Invalidate the TLB like a guest would after writing value to CR3. TLBs that
+// don't track PCIDs can only keep their translations, if CR3 stays the same
+// and the guest asked to keep the translations of its PCID.
+template <typename TLB>
+void invalidate_mov_to_cr3(TLB *tlb, uint64_t value, unsigned changes, paging_state const &state)
+{
+  if constexpr (has_mov_to_cr3<TLB>::value) {
+    tlb->mov_to_cr3(value, state);
+  } else if (changes or not state.get_cr4_pcide() or not(value & CR3_NOFLUSH)) {
+    tlb->clear();
+  }
+}
+
+struct result {
+  bool ok;
+
+  // The trace switches PCIDs without recording the CR3 writes. Whether the
+  // guest kept the translations of the new PCID is unknown.
+  bool unrecorded_cr3_write;
+
+  uint64_t translations;
+  uint64_t page_faults;
+
+  // Translations that read page table entries, i.e. that missed the TLB.
+  uint64_t walks;
+  uint64_t entry_reads;
+
+  double seconds;
+};
+
+// Stream the trace through a TLB. The time includes decoding the trace.
+template <typename TLB>
+result replay(uint8_t const *data, size_t size)
+{
+  auto const tlb = std::make_unique<TLB>();
+  trace_memory memory;
+  trace_reader reader {data, size};
+  std::optional<paging_state> state;
+  result r {};
+
+  auto const start = std::chrono::steady_clock::now();
+
+  while (auto const event = reader.next()) {
+    if (auto const *op = std::get_if<linear_memory_op>(&*event)) {
+      if (not state)
+        return {};
+
+      uint64_t const reads = memory.reads();
+      auto const res = tlb->translate(*op, *state, &memory);
+
+      r.translations++;
+      r.page_faults += std::holds_alternative<page_fault_info>(res);
+      r.walks += memory.reads() != reads;
+    } else if (auto const *regs = std::get_if<trace_state>(&*event)) {
+      if (not state) {
+        state = regs->to_paging_state();
+        continue;
+      }
+
+      unsigned const changes = regs->apply(&*state);
+
+      bool const flushed =
+          changes & (paging_state::CHANGE_MODE | paging_state::CHANGE_TRANSLATION);
+
+      if ((changes & paging_state::CHANGE_CR3) and not flushed and state->get_cr4_pcide()) {
+        r.unrecorded_cr3_write = true;
+        return r;
+      }
+
+      invalidate(tlb.get(), changes, *state);
+    } else if (auto const *write = std::get_if<trace_cr3_write>(&*event)) {
+      if (state)
+        invalidate_mov_to_cr3(tlb.get(), write->value, state->set_cr3(write->value), *state);
+    } else {
+      memory.apply(std::get<trace_entry>(*event));
+    }
+  }
+
+  r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  r.entry_reads = memory.reads();
+  r.ok = not reader.error();
+
+  return r;
+}
+
+struct configuration {
+  char const *name;
+  result (*fn)(uint8_t const *data, size_t size);
+};
+
+configuration const configurations[] {
+    {"no_tlb", replay<no_tlb>},
+    {"tlb_16", replay<tlb<16>>},
+    {"tlb_64", replay<tlb<64>>},
+    {"simd_tlb_64", replay<simd_tlb<64>>},
+    {"set_assoc_16x4", replay<set_assoc_tlb<16, 4>>},
+    {"set_assoc_64x4", replay<set_assoc_tlb<64, 4>>},
+    {"set_assoc_256x8", replay<set_assoc_tlb<256, 8>>},
+    {"split_16x4", replay<split_tlb<16, 4>>},
+    {"split_64x4", replay<split_tlb<64, 4>>},
+};
+
+}  // namespace
+
+// Usage: replay TRACE [FILTER]
+//
+// Replays a translation trace (see vmmu/translation_trace.hpp) through all TLB
+// configurations whose name contains FILTER. The trace is mapped and read
+// sequentially, so it doesn't have to fit into memory.
+int main(int argc, char **argv)
+{
+  if (argc < 2 or argc > 3) {
+    fprintf(stderr, "Usage: %s TRACE [FILTER]\n", argv[0]);
+    return 1;
+  }
+
+  char const *filter = argc == 3 ? argv[2] : "";
+  int const fd = open(argv[1], O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 or fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  size_t const size = size_t(st.st_size);
+  void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  close(fd);
+
+  if (data)
+    madvise(data, size, MADV_SEQUENTIAL);
+
+  printf("%-20s %14s %9s %14s %14s %12s %10s\n", "tlb", "translations", "hit rate", "walks",
+         "entry reads", "page faults", "ns/op");
+
+  for (auto const &c : configurations) {
+    if (not strstr(c.name, filter))
+      continue;
+
+    result const r = c.fn(static_cast<uint8_t const *>(data), size);
+
+    if (r.unrecorded_cr3_write) {
+      fprintf(stderr,
+              "%s: the trace switches PCIDs without recording CR3 writes, "
+              "record them with trace_recorder::record_cr3_write\n",
+              argv[1]);
+      return 1;
+    }
+
+    if (not r.ok) {
+      fprintf(stderr, "%s: invalid trace\n", argv[1]);
+      return 1;
+    }
+
+    double const hit_rate =
+        r.translations ? 100.0 * double(r.translations - r.walks) / double(r.translations) : 0;
+
+    printf("%-20s %14llu %8.2f%% %14llu %14llu %12llu %10.2f\n", c.name,
+           (unsigned long long)r.translations, hit_rate, (unsigned long long)r.walks,
+           (unsigned long long)r.entry_reads, (unsigned long long)r.page_faults,
+           r.translations ? r.seconds * 1e9 / double(r.translations) : 0);
+    fflush(stdout);
+  }
+
+  return 0;
+}
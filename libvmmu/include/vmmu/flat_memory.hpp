@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include <vmmu/internal/compiler.hpp>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+// A range of guest-physical memory that is backed by host memory, for example
+// by memory that was mapped with mmap. Both addresses must be 8-byte aligned.
+struct memslot {
+  uint64_t phys_addr;
+  uint64_t size;
+  void *host_addr;
+};
+
+// A memory backend for guest RAM that is mapped into the host address space.
+//
+// All accesses are bounds-checked against the memslots. Like on real hardware,
+// reads from physical memory that is not backed return all ones and writes to
+// it are dropped. Compare-exchange uses host atomic operations, so multiple
+// threads can walk and update shared page tables concurrently.
+//
+// The memslots are fixed at construction time and must not overlap.
+//
+// All accessors are defined inline, so the templated translate can inline them
+// into the page table walk.
+class flat_memory final : public abstract_memory
+{
+  // Sorted by physical address.
+  std::vector<memslot> slots_;
+
+  // Return a pointer to the host memory that backs the size bytes at phys_addr
+  // or nullptr, if they are not backed.
+  void *host_pointer(uint64_t phys_addr, uint64_t size) const
+  {
+    // Find the last slot that starts at or below the address.
+    auto it = std::upper_bound(
+        slots_.begin(), slots_.end(), phys_addr,
+        [](uint64_t addr, memslot const &slot) { return addr < slot.phys_addr; });
+
+    if (internal::unlikely(it == slots_.begin()))
+      return nullptr;
+
+    memslot const &slot = *--it;
+    uint64_t const offset = phys_addr - slot.phys_addr;
+
+    if (internal::unlikely(offset >= slot.size or slot.size - offset < size))
+      return nullptr;
+
+    return static_cast<char *>(slot.host_addr) + offset;
+  }
+
+  template <typename WORD>
+  WORD *word_pointer(uint64_t phys_addr) const
+  {
+    assert(phys_addr % sizeof(WORD) == 0);
+    return static_cast<WORD *>(host_pointer(phys_addr, sizeof(WORD)));
+  }
+
+  template <typename WORD>
+  WORD read_word(uint64_t phys_addr) const
+  {
+    WORD const *p = word_pointer<WORD>(phys_addr);
+
+    return p ? internal::atomic_load(p) : ~WORD(0);
+  }
+
+  template <typename WORD>
+  bool cmpxchg_word(uint64_t phys_addr, WORD expected, WORD new_value)
+  {
+    WORD *p = word_pointer<WORD>(phys_addr);
+
+    return p ? internal::atomic_cmpxchg(p, expected, new_value) : true;
+  }
+
+public:
+  uint64_t read(uint64_t phys_addr, uint64_t) override { return read_word<uint64_t>(phys_addr); }
+  uint32_t read(uint64_t phys_addr, uint32_t) override { return read_word<uint32_t>(phys_addr); }
+
+  bool cmpxchg(uint64_t phys_addr, uint32_t expected, uint32_t new_value) override
+  {
+    return cmpxchg_word(phys_addr, expected, new_value);
+  }
+
+  bool cmpxchg(uint64_t phys_addr, uint64_t expected, uint64_t new_value) override
+  {
+    return cmpxchg_word(phys_addr, expected, new_value);
+  }
+
+  uint64_t *entry_pointer(uint64_t phys_addr, uint64_t) override
+  {
+    return word_pointer<uint64_t>(phys_addr);
+  }
+
+  uint32_t *entry_pointer(uint64_t phys_addr, uint32_t) override
+  {
+    return word_pointer<uint32_t>(phys_addr);
+  }
+
+  flat_memory() = delete;
+  explicit flat_memory(std::vector<memslot> slots);
+};
+
+}  // namespace vmmu
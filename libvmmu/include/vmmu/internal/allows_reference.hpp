@@ -0,0 +1,15 @@
+#pragma once
+
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu::internal
+{
+// Decide whether a translation with the given attributes allows the operation
+// by following Intel SDM Vol 3 4.6.1 "Determination of Access Rights" step by
+// step. This is slow and only serves as a reference to check the permissions
+// that paging_state precomputes for tlb_entry::allows.
+bool allows_reference(tlb_attr const &attr,
+                      linear_memory_op const &op,
+                      paging_state const &state);
+
+}  // namespace vmmu::internal
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace vmmu::internal
+{
+
+inline bool likely(bool c)
+{
+  return __builtin_expect(c, true);
+}
+
+inline bool unlikely(bool c)
+{
+  return __builtin_expect(c, false);
+}
+
+[[noreturn]] inline void unreachable()
+{
+  __builtin_unreachable();
+}
+
+// Tell the CPU that we are spinning on a lock.
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// A cheap timestamp for latency measurements. This is the TSC on x86. On
+// other architectures, it counts nanoseconds instead of cycles.
+inline uint64_t read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count());
+#endif
+}
+
+// Atomic accesses to memory that is shared with other CPUs, such as page
+// tables in guest memory.
+
+template <typename T>
+inline T atomic_load(T const *p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+inline bool atomic_cmpxchg(T *p, T expected, T new_value)
+{
+  return __atomic_compare_exchange_n(p, &expected, new_value, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE);
+}
+
+}  // namespace vmmu
@@ -0,0 +1,539 @@
+#pragma once
+
+// The page table walker. This is included at the end of vmmu.hpp, because
+// translate() is a template over the memory backend.
+
+#include <cassert>
+#include <type_traits>
+#include <vmmu/internal/bit_range.hpp>
+#include <vmmu/internal/compiler.hpp>
+#include <vmmu/vmmu.hpp>
+
+// TODO
+// - Reserved bits checking
+
+namespace vmmu::internal
+{
+// Page table level definitions
+
+enum {
+  IS_TERMINAL = 1 << 0,
+  HAS_PS = 1 << 1,
+  RESPECTS_CR4_PSE = 1 << 2,
+};
+
+template <typename WORD, typename TABLE_INDEX, typename NEXT_TABLE, typename FRAME_BITS, int FLAGS>
+struct level {
+  // Given a linear address return the index into this level of the page table.
+  static uint64_t get_table_index(uint64_t linear_addr)
+  {
+    return TABLE_INDEX::extract(linear_addr);
+  }
+
+  // Given a page table entry of this level, return the base of the next level.
+  static WORD get_next_table_base(WORD pte)
+  {
+    assert(not(FLAGS & IS_TERMINAL));
+    return NEXT_TABLE::extract_no_shift(pte);
+  }
+
+  static uint64_t get_page_frame(WORD pte) { return FRAME_BITS::extract_no_shift(pte); }
+
+  static uint8_t get_page_frame_order() { return uint8_t(FRAME_BITS::lo); }
+
+  // The lowest linear address bit that is used to index this level.
+  static unsigned get_table_index_order() { return TABLE_INDEX::lo; }
+
+  // The number of this level as in the SDM: 1 for page tables, 2 for page
+  // directories and so on.
+  static unsigned get_level() { return (TABLE_INDEX::lo - 12) / 9 + 1; }
+
+  static bool is_leaf(WORD pte, paging_state const &state)
+  {
+    if (FLAGS & IS_TERMINAL)
+      return true;
+
+    if (not(FLAGS & HAS_PS))
+      return false;
+
+    return (not(FLAGS & RESPECTS_CR4_PSE) or state.get_cr4_pse()) and (pte & PTE_PS);
+  }
+
+  // The same for page table formats whose large pages don't depend on the
+  // paging state, such as EPT.
+  static bool is_leaf(WORD pte)
+  {
+    static_assert(not(FLAGS & RESPECTS_CR4_PSE));
+
+    return (FLAGS & IS_TERMINAL) or ((FLAGS & HAS_PS) and (pte & PTE_PS));
+  }
+
+  static bool has_reserved_bits_set([[maybe_unused]] WORD pte,
+                                    [[maybe_unused]] paging_state const &state)
+  {
+    // TODO Implement me
+    return false;
+  }
+};
+
+// clang-format off
+//                      WORD      INDEX              NEXT TABLE         FRAME              FLAGS
+using pm32_pd   = level<uint32_t, bit_range<31, 22>, bit_range<31, 12>, bit_range<31, 22>, HAS_PS | RESPECTS_CR4_PSE>;
+using pm32_pt   = level<uint32_t, bit_range<21, 12>, bit_range<31, 12>, bit_range<31, 12>, IS_TERMINAL>;
+
+using pm64_pml4 = level<uint64_t, bit_range<47, 39>, bit_range<51, 12>, bit_range< 0,  0>, 0>;
+using pm64_pdpt = level<uint64_t, bit_range<38, 30>, bit_range<51, 12>, bit_range<51, 30>, HAS_PS>;
+using pm64_pd   = level<uint64_t, bit_range<29, 21>, bit_range<51, 12>, bit_range<51, 21>, HAS_PS>;
+using pm64_pt   = level<uint64_t, bit_range<20, 12>, bit_range<51, 12>, bit_range<51, 12>, IS_TERMINAL>;
+// clang-format off
+
+// Compute page fault information according to Intel SDM Vol 3 4.7 "Page-fault
+// Exceptions".
+inline page_fault_info get_pf_info(linear_memory_op const &op,
+                                   paging_state const &state,
+                                   bool present,
+                                   bool reserved_bits_set)
+{
+  uint32_t error = 0;
+
+  if (present)
+    error |= EC_P;
+
+  if (op.is_write())
+    error |= EC_W;
+
+  if (not(op.is_implicit_supervisor() or state.is_supervisor()))
+    error |= EC_U;
+
+  if (present and reserved_bits_set)
+    error |= EC_RSVD;
+
+  if (op.is_instruction_fetch() and
+      (state.get_cr4_smep() or (state.get_cr4_pae() and state.get_efer_nxe())))
+    error |= EC_I;
+
+  return {op.linear_addr, error};
+}
+
+// Memory backends only need to provide entry_pointer, if they can hand out host
+// pointers to page table entries.
+template <typename MEMORY, typename WORD, typename = void>
+struct has_entry_pointer : std::false_type {
+};
+
+// The return type is checked as well, because a backend that only overrides
+// one of the overloads of abstract_memory hides the other one.
+template <typename MEMORY, typename WORD>
+struct has_entry_pointer<
+    MEMORY,
+    WORD,
+    std::void_t<decltype(std::declval<MEMORY &>().entry_pointer(uint64_t {}, WORD {}))>>
+    : std::is_same<decltype(std::declval<MEMORY &>().entry_pointer(uint64_t {}, WORD {})),
+                   WORD *> {
+};
+
+// A page table entry in memory.
+//
+// If the memory backend provides a host pointer to the entry, it is accessed
+// directly with atomic operations. Otherwise, all accesses go through the
+// read and cmpxchg methods of the backend.
+template <typename WORD, typename MEMORY>
+class table_entry_ref
+{
+  MEMORY *memory_;
+  uint64_t phys_addr_;
+  WORD *host_ptr_ = nullptr;
+
+public:
+  WORD read() const
+  {
+    return host_ptr_ ? atomic_load(host_ptr_) : memory_->read(phys_addr_, WORD {});
+  }
+
+  bool cmpxchg(WORD expected, WORD new_value)
+  {
+    return host_ptr_ ? atomic_cmpxchg(host_ptr_, expected, new_value)
+                     : memory_->cmpxchg(phys_addr_, expected, new_value);
+  }
+
+  table_entry_ref(MEMORY *memory, uint64_t phys_addr) : memory_(memory), phys_addr_(phys_addr)
+  {
+    if constexpr (has_entry_pointer<MEMORY, WORD>::value)
+      host_ptr_ = memory->entry_pointer(phys_addr, WORD {});
+  }
+};
+
+// The main page table walking logic.
+//
+// Non-leaf entries are recorded in the paging-structure cache, if one is
+// given. PSC is paging_structure_cache or another type with the same insert
+// method. The observer is told about every entry read and accessed/dirty
+// update.
+template <typename WORD,
+          typename MEMORY,
+          typename PSC,
+          typename OBSERVER,
+          typename LEVEL,
+          typename... REST>
+translate_result walk(linear_memory_op const &op,
+                      paging_state const &state,
+                      MEMORY *memory,
+                      PSC *psc,
+                      OBSERVER &observer,
+                      uint64_t table_base,
+                      tlb_attr attr = {})
+{
+  table_entry_ref<WORD, MEMORY> entry_ref {
+      memory, table_base + sizeof(WORD) * LEVEL::get_table_index(op.linear_addr)};
+
+  observer.entry_read_start(op, state, LEVEL::get_level());
+
+  WORD const table_entry = entry_ref.read();
+  WORD updated_entry = table_entry | PTE_A;
+
+  observer.entry_read(op, state, LEVEL::get_level(), table_entry);
+
+  // Write back the accessed and dirty flags. This fails, if the entry was
+  // changed concurrently.
+  auto const update_entry = [&] {
+    if (likely(table_entry == updated_entry))
+      return true;
+
+    observer.ad_update_start(op, state, LEVEL::get_level());
+
+    bool const success = entry_ref.cmpxchg(table_entry, updated_entry);
+
+    observer.ad_update(op, state, LEVEL::get_level(), success);
+    return success;
+  };
+
+  bool is_present = table_entry & PTE_P;
+  bool is_rsvd = LEVEL::has_reserved_bits_set(table_entry, state);
+  bool is_leaf = LEVEL::is_leaf(table_entry, state);
+
+  if (unlikely(not is_present or is_rsvd))
+    return get_pf_info(op, state, is_present, is_rsvd);
+
+  // Dirty and global flags only exist in leaf page table entries. The global
+  // flag is ignored without CR4.PGE.
+  WORD const ignored = (is_leaf ? WORD(0) : WORD(PTE_D | PTE_G)) |
+                       (state.get_cr4_pge() ? WORD(0) : WORD(PTE_G));
+
+  attr = tlb_attr::combine(attr, tlb_attr {table_entry & ~ignored});
+
+  if (is_leaf) {
+    uint64_t mask = (uint64_t(1) << LEVEL::get_page_frame_order()) - 1;
+    auto tlbe = tlb_entry {op.linear_addr & ~mask, LEVEL::get_page_frame(table_entry),
+                           LEVEL::get_page_frame_order(), attr};
+
+    if (unlikely(not tlbe.allows(op, state)))
+      return get_pf_info(op, state, true, false);
+
+    if (op.is_write()) {
+      updated_entry |= PTE_D;
+      tlbe.attr().set_d();
+    }
+
+    if (not update_entry())
+      return /* retry */ {};
+
+    return tlbe;
+  } else {
+    assert(not is_leaf);
+
+    if (not update_entry())
+      return /* retry */ {};
+
+    uint64_t const next_table = LEVEL::get_next_table_base(table_entry);
+
+    if (psc)
+      psc->insert(LEVEL::get_table_index_order(), op.linear_addr, state.get_pcid(),
+                  {next_table, attr});
+
+    // Continue page table walk with next level.
+    if constexpr (sizeof...(REST) != 0)
+      return walk<WORD, MEMORY, PSC, OBSERVER, REST...>(op, state, memory, psc, observer,
+                                                        next_table, attr);
+
+    __builtin_trap();
+  }
+}
+
+// Special case of translate() for the PAE PDPTE lookup. We could possibly
+// squeeze it in the above scheme, but it's easier to just spell out directly
+// what happens for PDPTEs.
+template <typename MEMORY, typename PSC, typename OBSERVER>
+translate_result pae_walk(linear_memory_op const &op,
+                          paging_state const &state,
+                          MEMORY *memory,
+                          PSC *psc,
+                          OBSERVER &observer)
+{
+  uint64_t pdpte = state.get_pdpte(bit_range<31, 30>::extract(op.linear_addr));
+  uint32_t next_table = bit_range<51, 12>::extract_no_shift(pdpte);
+
+  if (not(pdpte & PTE_P))
+    return get_pf_info(op, state, true, false);
+
+  // Reserved bits cannot be set, because that would trigger a #GP on PDPTE
+  // load.
+
+  return walk<uint64_t, MEMORY, PSC, OBSERVER, pm64_pd, pm64_pt>(op, state, memory, psc, observer,
+                                                                 next_table);
+}
+
+// 4-level page table walk that starts at the lowest level that is found in the
+// paging-structure cache.
+template <typename MEMORY, typename PSC, typename OBSERVER>
+translate_result pm64_walk(linear_memory_op const &op,
+                           paging_state const &state,
+                           MEMORY *memory,
+                           PSC *psc,
+                           OBSERVER &observer)
+{
+  // Only paging-structure caches can be looked up.
+  if constexpr (std::is_same_v<PSC, paging_structure_cache>) {
+    if (psc) {
+      if (auto pde = psc->lookup_pde(op.linear_addr, state.get_pcid()))
+        return walk<uint64_t, MEMORY, PSC, OBSERVER, pm64_pt>(op, state, memory, psc, observer,
+                                                              pde->next_table, pde->attr);
+
+      if (auto pdpte = psc->lookup_pdpte(op.linear_addr, state.get_pcid()))
+        return walk<uint64_t, MEMORY, PSC, OBSERVER, pm64_pd, pm64_pt>(
+            op, state, memory, psc, observer, pdpte->next_table, pdpte->attr);
+
+      if (auto pml4e = psc->lookup_pml4e(op.linear_addr, state.get_pcid()))
+        return walk<uint64_t, MEMORY, PSC, OBSERVER, pm64_pdpt, pm64_pd, pm64_pt>(
+            op, state, memory, psc, observer, pml4e->next_table, pml4e->attr);
+    }
+  }
+
+  return walk<uint64_t, MEMORY, PSC, OBSERVER, pm64_pml4, pm64_pdpt, pm64_pd, pm64_pt>(
+      op, state, memory, psc, observer, state.get_cr3() & ~0xFFFULL);
+}
+
+// Translate an operation in a paging mode that is known at compile time.
+// Walks are retried until they don't race with concurrent page table updates.
+//
+// The paging-structure cache is only used for 4-level paging.
+template <paging_mode MODE, typename MEMORY, typename OBSERVER>
+translate_result translate_in_mode(linear_memory_op const &op,
+                                   paging_state const &state,
+                                   MEMORY *memory,
+                                   paging_structure_cache *psc,
+                                   OBSERVER &observer)
+{
+  using PSC = paging_structure_cache;
+
+  translate_result result;
+
+  assert(memory);
+
+  observer.walk_start(op, state);
+
+  do {
+    if constexpr (MODE == paging_mode::PHYS)
+      result = tlb_entry::no_paging(op.linear_addr);
+    else if constexpr (MODE == paging_mode::PM32)
+      result = walk<uint32_t, MEMORY, PSC, OBSERVER, pm32_pd, pm32_pt>(
+          op, state, memory, nullptr, observer, state.get_cr3() & 0xFFFFF000UL);
+    else if constexpr (MODE == paging_mode::PM32_PAE)
+      result = pae_walk(op, state, memory, static_cast<PSC *>(nullptr), observer);
+    else if constexpr (MODE == paging_mode::PM64_4LEVEL)
+      result = pm64_walk(op, state, memory, psc, observer);
+  } while (std::holds_alternative<std::monostate>(result));
+
+  observer.walk_end(op, state, result);
+
+  return result;
+}
+
+template <paging_mode MODE, typename MEMORY>
+translate_result translate_in_mode(linear_memory_op const &op,
+                                   paging_state const &state,
+                                   MEMORY *memory,
+                                   paging_structure_cache *psc)
+{
+  walk_observer observer;
+
+  return translate_in_mode<MODE>(op, state, memory, psc, observer);
+}
+
+// Remembers the page table that the last walk went through, so walks for
+// other pages in the same table only read their page table entry. In contrast
+// to a paging-structure cache, this is cheap to set up for a single batch of
+// translations and works in all paging modes.
+class last_table_cache
+{
+  // The lowest linear address bit that indexes the page directory.
+  unsigned order_;
+
+  uint64_t tag_ = ~uint64_t(0);
+  paging_structure_cache::entry table_ {0, tlb_attr {}};
+
+public:
+  std::optional<paging_structure_cache::entry> lookup(uint64_t linear_addr) const
+  {
+    if ((linear_addr >> order_) == tag_)
+      return table_;
+
+    return {};
+  }
+
+  void insert(unsigned order,
+              uint64_t linear_addr,
+              uint16_t /* pcid */,
+              paging_structure_cache::entry const &value)
+  {
+    if (order == order_) {
+      tag_ = linear_addr >> order;
+      table_ = value;
+    }
+  }
+
+  explicit last_table_cache(paging_mode mode) : order_(mode == paging_mode::PM32 ? 22 : 21) {}
+};
+
+// Like translate_in_mode, but walks start at the page table that the cache
+// remembers, if possible.
+template <paging_mode MODE, typename MEMORY>
+translate_result translate_in_mode(linear_memory_op const &op,
+                                   paging_state const &state,
+                                   MEMORY *memory,
+                                   last_table_cache *cache)
+{
+  using PSC = last_table_cache;
+  using OBSERVER = walk_observer;
+
+  translate_result result;
+  OBSERVER observer;
+
+  assert(memory);
+
+  do {
+    auto const table = cache->lookup(op.linear_addr);
+
+    if constexpr (MODE == paging_mode::PHYS)
+      result = tlb_entry::no_paging(op.linear_addr);
+    else if constexpr (MODE == paging_mode::PM32)
+      result = table ? walk<uint32_t, MEMORY, PSC, OBSERVER, pm32_pt>(
+                           op, state, memory, cache, observer, table->next_table, table->attr)
+                     : walk<uint32_t, MEMORY, PSC, OBSERVER, pm32_pd, pm32_pt>(
+                           op, state, memory, cache, observer, state.get_cr3() & 0xFFFFF000UL);
+    else if constexpr (MODE == paging_mode::PM32_PAE)
+      result = table ? walk<uint64_t, MEMORY, PSC, OBSERVER, pm64_pt>(
+                           op, state, memory, cache, observer, table->next_table, table->attr)
+                     : pae_walk(op, state, memory, cache, observer);
+    else if constexpr (MODE == paging_mode::PM64_4LEVEL)
+      result = table ? walk<uint64_t, MEMORY, PSC, OBSERVER, pm64_pt>(
+                           op, state, memory, cache, observer, table->next_table, table->attr)
+                     : pm64_walk(op, state, memory, cache, observer);
+  } while (std::holds_alternative<std::monostate>(result));
+
+  return result;
+}
+
+// Call fn with the paging mode as a compile-time constant.
+template <typename FN>
+void with_paging_mode(paging_mode mode, FN const &fn)
+{
+  switch (mode) {
+  case paging_mode::PHYS:
+    return fn(std::integral_constant<paging_mode, paging_mode::PHYS> {});
+  case paging_mode::PM32:
+    return fn(std::integral_constant<paging_mode, paging_mode::PM32> {});
+  case paging_mode::PM32_PAE:
+    return fn(std::integral_constant<paging_mode, paging_mode::PM32_PAE> {});
+  case paging_mode::PM64_4LEVEL:
+    return fn(std::integral_constant<paging_mode, paging_mode::PM64_4LEVEL> {});
+  }
+
+  __builtin_trap();
+}
+
+}  // namespace vmmu::internal
+
+template <typename MEMORY>
+vmmu::translate_result vmmu::translate(linear_memory_op const &op,
+                                       paging_state const &state,
+                                       MEMORY *memory,
+                                       paging_structure_cache *psc)
+{
+  using namespace vmmu::internal;
+
+  translate_result result;
+
+  with_paging_mode(state.get_paging_mode(), [&](auto mode) {
+    result = translate_in_mode<decltype(mode)::value>(op, state, memory, psc);
+  });
+
+  return result;
+}
+
+template <typename MEMORY, typename OBSERVER>
+vmmu::translate_result vmmu::translate(linear_memory_op const &op,
+                                       paging_state const &state,
+                                       MEMORY *memory,
+                                       paging_structure_cache *psc,
+                                       OBSERVER *observer)
+{
+  using namespace vmmu::internal;
+
+  translate_result result;
+
+  assert(observer);
+
+  with_paging_mode(state.get_paging_mode(), [&](auto mode) {
+    result = translate_in_mode<decltype(mode)::value>(op, state, memory, psc, *observer);
+  });
+
+  return result;
+}
+
+template <typename MEMORY>
+void vmmu::translate_batch(linear_memory_op const *ops,
+                           size_t count,
+                           paging_state const &state,
+                           MEMORY *memory,
+                           translate_result *results,
+                           paging_structure_cache *psc)
+{
+  using namespace vmmu::internal;
+
+  with_paging_mode(state.get_paging_mode(), [&](auto mode) {
+    last_table_cache cache {mode};
+
+    translate_each(ops, count, state, results, [&](linear_memory_op const &op) {
+      if (psc)
+        return translate_in_mode<decltype(mode)::value>(op, state, memory, psc);
+
+      return translate_in_mode<decltype(mode)::value>(op, state, memory, &cache);
+    });
+  });
+}
+
+template <typename MEMORY>
+std::optional<vmmu::page_fault_info> vmmu::translate_range(linear_memory_op const &op,
+                                                           uint64_t length,
+                                                           paging_state const &state,
+                                                           MEMORY *memory,
+                                                           std::vector<phys_segment> &segments,
+                                                           paging_structure_cache *psc)
+{
+  using namespace vmmu::internal;
+
+  std::optional<page_fault_info> fault;
+
+  with_paging_mode(state.get_paging_mode(), [&](auto mode) {
+    last_table_cache cache {mode};
+
+    fault = translate_pages(op, length, segments, [&](linear_memory_op const &page_op) {
+      if (psc)
+        return translate_in_mode<decltype(mode)::value>(page_op, state, memory, psc);
+
+      return translate_in_mode<decltype(mode)::value>(page_op, state, memory, &cache);
+    });
+  });
+
+  return fault;
+}
@@ -0,0 +1,601 @@
+#pragma once
+
+// Two-dimensional address translation for guests that run with nested paging.
+// See Intel SDM Vol. 3 28.3 "The Extended Page Table Mechanism (EPT)".
+//
+// The guest page table translates linear addresses to guest-physical
+// addresses, and every guest-physical address, including those of the guest
+// page tables themselves, is translated to a host-physical address by the EPT.
+// A walk that misses all caches reads up to 24 entries: four EPT entries for
+// each of the four guest page table entries and the final guest-physical
+// address, plus the guest entries themselves.
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <variant>
+#include <vmmu/internal/compiler.hpp>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+// EPT definitions
+
+enum : uint64_t {
+  EPT_R = uint64_t(1) << 0,
+  EPT_W = uint64_t(1) << 1,
+  EPT_X = uint64_t(1) << 2,
+  EPT_RWX = EPT_R | EPT_W | EPT_X,
+  EPT_PS = uint64_t(1) << 7,
+  EPT_A = uint64_t(1) << 8,
+  EPT_D = uint64_t(1) << 9,
+
+  EPTP_WALK_LENGTH_MASK = uint64_t(7) << 3,
+  EPTP_WALK_LENGTH_4 = uint64_t(3) << 3,
+  EPTP_AD = uint64_t(1) << 6,
+
+  // Exit qualification of EPT violations. See Intel SDM Vol. 3 27.2.1 "Basic
+  // VM-Exit Information". Bits 2:0 describe the access and bits 5:3 the access
+  // rights of the guest-physical address.
+  EPT_QUAL_READ = uint64_t(1) << 0,
+  EPT_QUAL_WRITE = uint64_t(1) << 1,
+  EPT_QUAL_FETCH = uint64_t(1) << 2,
+  EPT_QUAL_RIGHTS_SHIFT = 3,
+  EPT_QUAL_GLA_VALID = uint64_t(1) << 7,
+  EPT_QUAL_GLA_TRANSLATION = uint64_t(1) << 8,
+};
+
+// The EPT pointer that selects the second translation stage. Only 4-level EPT
+// is supported.
+class ept_state
+{
+  uint64_t eptp_;
+
+public:
+  uint64_t get_eptp() const { return eptp_; }
+  uint64_t get_root() const { return eptp_ & internal::bit_range<51, 12>::mask(); }
+
+  // Accessed and dirty flags are only maintained, if they are enabled.
+  bool get_ad() const { return eptp_ & EPTP_AD; }
+
+  explicit ept_state(uint64_t eptp) : eptp_(eptp)
+  {
+    assert((eptp & EPTP_WALK_LENGTH_MASK) == EPTP_WALK_LENGTH_4);
+  }
+};
+
+// The information that goes along with an EPT violation or an EPT
+// misconfiguration VM exit.
+struct ept_violation_info {
+  uint64_t guest_phys_addr;
+
+  // Only valid, if EPT_QUAL_GLA_VALID is set in the qualification.
+  uint64_t guest_linear_addr;
+
+  uint64_t qualification;
+
+  // An EPT entry had an invalid combination of access rights, so the access
+  // causes an EPT misconfiguration instead of a violation. See Intel SDM Vol. 3
+  // 28.3.3.1 "EPT Misconfigurations". The qualification is undefined.
+  bool misconfiguration;
+
+  ept_violation_info() = delete;
+  ept_violation_info(uint64_t guest_phys_addr_,
+                     uint64_t qualification_,
+                     bool misconfiguration_ = false)
+      : guest_phys_addr(guest_phys_addr_),
+        guest_linear_addr(0),
+        qualification(qualification_),
+        misconfiguration(misconfiguration_)
+  {
+  }
+};
+
+// A translation of a power-of-2 naturally aligned guest-physical memory region
+// to host-physical memory.
+class ept_entry
+{
+  uint64_t guest_phys_addr_;
+  uint64_t host_phys_addr_;
+  uint8_t size_bits_;
+
+  // EPT_R, EPT_W and EPT_X combined over all levels.
+  uint8_t rights_;
+
+  // Writes don't need to set a dirty flag anymore.
+  bool dirty_;
+
+public:
+  uint64_t guest_phys_addr() const { return guest_phys_addr_; }
+  uint64_t host_phys_addr() const { return host_phys_addr_; }
+  uint8_t size_bits() const { return size_bits_; }
+  uint64_t size() const { return uint64_t(1) << size_bits_; }
+  uint8_t rights() const { return rights_; }
+  bool is_dirty() const { return dirty_; }
+
+  std::optional<uint64_t> translate(uint64_t gpa) const
+  {
+    uint64_t const mask = ~(size() - 1);
+
+    if ((gpa & mask) == guest_phys_addr_)
+      return (gpa & ~mask) | host_phys_addr_;
+
+    return {};
+  }
+
+  // Returns true, if a cache can use this entry for an access with the given
+  // rights without walking the EPT.
+  bool hits(uint64_t gpa, uint8_t access) const
+  {
+    return translate(gpa) and (rights_ & access) == access and (not(access & EPT_W) or dirty_);
+  }
+
+  ept_entry(uint64_t guest_phys_addr,
+            uint64_t host_phys_addr,
+            uint8_t size_bits,
+            uint8_t rights,
+            bool dirty)
+      : guest_phys_addr_(guest_phys_addr),
+        host_phys_addr_(host_phys_addr),
+        size_bits_(size_bits),
+        rights_(rights),
+        dirty_(dirty)
+  {
+    assert((guest_phys_addr & (size() - 1)) == 0);
+    assert((host_phys_addr & (size() - 1)) == 0);
+  }
+};
+
+using ept_result = std::variant<std::monostate, ept_entry, ept_violation_info>;
+
+// A direct-mapped cache for guest-physical translations, i.e. the second
+// translation stage only. Entries are tagged with the EPT pointer, so switching
+// between EPT pointers doesn't need an invalidation.
+//
+// Large pages are cached in the slot of the 4KB page that was accessed.
+class ept_cache
+{
+  static constexpr size_t SIZE = 64;
+
+  struct tagged_entry {
+    uint64_t eptp = 0;
+    uint64_t generation = 0;
+    ept_entry entry {0, 0, 12, 0, false};
+  };
+
+  std::array<tagged_entry, SIZE> entries_;
+  uint64_t generation_ = 1;
+
+  static size_t index(uint64_t gpa) { return (gpa >> 12) % SIZE; }
+
+public:
+  std::optional<ept_entry> lookup(uint64_t gpa, uint64_t eptp, uint8_t access) const
+  {
+    auto const &e = entries_[index(gpa)];
+
+    if (e.generation == generation_ and e.eptp == eptp and e.entry.hits(gpa, access))
+      return e.entry;
+
+    return {};
+  }
+
+  void insert(uint64_t gpa, uint64_t eptp, ept_entry const &entry)
+  {
+    entries_[index(gpa)] = tagged_entry {eptp, generation_, entry};
+  }
+
+  // Remove all entries. This is the effect of INVEPT, regardless of its type.
+  void clear() { generation_++; }
+};
+
+// A translation of a linear address to a host-physical address through both
+// stages.
+//
+// The guest attributes are kept as they are, but the entry is only marked
+// dirty if writes need neither a guest nor an EPT dirty flag update. Hits are
+// additionally checked against the EPT access rights.
+class nested_tlb_entry
+{
+  tlb_entry entry_;
+  uint8_t ept_rights_;
+
+public:
+  // The translation of the linear address to the host-physical address.
+  tlb_entry const &entry() const { return entry_; }
+  uint8_t ept_rights() const { return ept_rights_; }
+
+  uint64_t linear_addr() const { return entry_.linear_addr(); }
+  uint64_t phys_addr() const { return entry_.phys_addr(); }
+  tlb_attr const &attr() const { return entry_.attr(); }
+  uint64_t size() const { return entry_.size(); }
+
+  std::optional<uint64_t> translate(uint64_t la) const { return entry_.translate(la); }
+
+  bool hits(linear_memory_op const &op, paging_state const &state) const;
+
+  // Only used for unused slots of TLBs.
+  static nested_tlb_entry no_paging() { return {tlb_entry::no_paging(), 0}; }
+
+  nested_tlb_entry(tlb_entry const &entry, uint8_t ept_rights)
+      : entry_(entry), ept_rights_(ept_rights)
+  {
+  }
+};
+
+using nested_translate_result =
+    std::variant<std::monostate, nested_tlb_entry, page_fault_info, ept_violation_info>;
+
+namespace internal
+{
+// clang-format off
+//                      WORD      INDEX              NEXT TABLE         FRAME              FLAGS
+using ept_pml4  = level<uint64_t, bit_range<47, 39>, bit_range<51, 12>, bit_range< 0,  0>, 0>;
+using ept_pdpt  = level<uint64_t, bit_range<38, 30>, bit_range<51, 12>, bit_range<51, 30>, HAS_PS>;
+using ept_pd    = level<uint64_t, bit_range<29, 21>, bit_range<51, 12>, bit_range<51, 21>, HAS_PS>;
+using ept_pt    = level<uint64_t, bit_range<20, 12>, bit_range<51, 12>, bit_range<51, 12>, IS_TERMINAL>;
+// clang-format on
+
+// The EPT rights an access of the given type needs.
+inline uint8_t ept_access(linear_memory_op::access_type type)
+{
+  switch (type) {
+  case linear_memory_op::access_type::READ:
+    return EPT_R;
+  case linear_memory_op::access_type::WRITE:
+    return EPT_W;
+  case linear_memory_op::access_type::EXECUTE:
+    return EPT_X;
+  }
+
+  unreachable();
+}
+
+// The EPT walk. Access is a combination of EPT_R, EPT_W and EPT_X. See Intel
+// SDM Vol. 3 28.3.2 "EPT Translation Mechanism".
+template <typename MEMORY, typename LEVEL, typename... REST>
+ept_result ept_walk(uint64_t gpa,
+                    uint8_t access,
+                    ept_state const &ept,
+                    MEMORY *memory,
+                    uint64_t table_base,
+                    uint8_t rights = EPT_RWX)
+{
+  table_entry_ref<uint64_t, MEMORY> entry_ref {
+      memory, table_base + sizeof(uint64_t) * LEVEL::get_table_index(gpa)};
+
+  uint64_t const table_entry = entry_ref.read();
+  uint64_t updated_entry = table_entry | (ept.get_ad() ? uint64_t(EPT_A) : 0);
+
+  rights &= table_entry & EPT_RWX;
+
+  // Entries that allow writes, but not reads, are misconfigured.
+  if (unlikely((table_entry & (EPT_R | EPT_W)) == EPT_W))
+    return ept_violation_info {gpa, 0, true};
+
+  // Entries without any access rights are not present. The qualification
+  // reports the rights of all levels up to this one, i.e. none.
+  if (unlikely(not(table_entry & EPT_RWX)))
+    return ept_violation_info {gpa, access | uint64_t(rights) << EPT_QUAL_RIGHTS_SHIFT};
+
+  if (LEVEL::is_leaf(table_entry)) {
+    if (unlikely((rights & access) != access))
+      return ept_violation_info {gpa, access | uint64_t(rights) << EPT_QUAL_RIGHTS_SHIFT};
+
+    bool dirty = not ept.get_ad() or (table_entry & EPT_D);
+
+    if (ept.get_ad() and (access & EPT_W)) {
+      updated_entry |= EPT_D;
+      dirty = true;
+    }
+
+    if (unlikely(table_entry != updated_entry) and
+        not entry_ref.cmpxchg(table_entry, updated_entry))
+      return /* retry */ {};
+
+    uint64_t const mask = (uint64_t(1) << LEVEL::get_page_frame_order()) - 1;
+
+    return ept_entry {gpa & ~mask, LEVEL::get_page_frame(table_entry),
+                      LEVEL::get_page_frame_order(), rights, dirty};
+  }
+
+  if (unlikely(table_entry != updated_entry) and
+      not entry_ref.cmpxchg(table_entry, updated_entry))
+    return /* retry */ {};
+
+  if constexpr (sizeof...(REST) != 0)
+    return ept_walk<MEMORY, REST...>(gpa, access, ept, memory,
+                                     LEVEL::get_next_table_base(table_entry), rights);
+
+  __builtin_trap();
+}
+
+// Translate a guest-physical address with the given access rights. Walks are
+// retried until they don't race with concurrent EPT updates.
+template <typename MEMORY>
+ept_result translate_guest_phys(uint64_t gpa,
+                                uint8_t access,
+                                ept_state const &ept,
+                                MEMORY *memory,
+                                ept_cache *cache)
+{
+  if (cache)
+    if (auto entry = cache->lookup(gpa, ept.get_eptp(), access))
+      return *entry;
+
+  ept_result result;
+
+  do {
+    result = ept_walk<MEMORY, ept_pml4, ept_pdpt, ept_pd, ept_pt>(gpa, access, ept, memory,
+                                                                   ept.get_root());
+  } while (std::holds_alternative<std::monostate>(result));
+
+  if (cache)
+    if (auto const *entry = std::get_if<ept_entry>(&result))
+      cache->insert(gpa, ept.get_eptp(), *entry);
+
+  return result;
+}
+
+// Presents guest-physical memory to the guest page table walker. Every access
+// goes through the second translation stage.
+//
+// Reading a guest page table entry needs read access. Updating its accessed or
+// dirty flags needs write access. With EPT accessed and dirty flags enabled,
+// all accesses to guest page tables count as writes. See Intel SDM Vol. 3
+// 28.3.3.2 "EPT Violations".
+//
+// After the first EPT violation, reads return non-present entries and
+// compare-exchange fails, so the guest walk ends with a page fault. The caller
+// reports the violation instead.
+template <typename MEMORY>
+class guest_phys_memory
+{
+  ept_state const &ept_;
+  MEMORY *memory_;
+  ept_cache *cache_;
+
+  // The linear address that the guest walk translates.
+  uint64_t linear_addr_;
+
+  std::optional<ept_violation_info> violation_;
+
+  std::optional<uint64_t> host_phys_addr(uint64_t gpa, uint8_t access)
+  {
+    auto const res = translate_guest_phys(gpa, access, ept_, memory_, cache_);
+
+    if (auto const *entry = std::get_if<ept_entry>(&res))
+      return entry->translate(gpa);
+
+    violation_ = std::get<ept_violation_info>(res);
+
+    if (not violation_->misconfiguration) {
+      violation_->guest_linear_addr = linear_addr_;
+      violation_->qualification |= EPT_QUAL_GLA_VALID;
+    }
+
+    return {};
+  }
+
+public:
+  std::optional<ept_violation_info> const &violation() const { return violation_; }
+
+  template <typename WORD>
+  WORD read(uint64_t gpa, WORD dummy)
+  {
+    if (violation_)
+      return 0;
+
+    auto const hpa = host_phys_addr(gpa, ept_.get_ad() ? EPT_W : EPT_R);
+
+    return hpa ? memory_->read(*hpa, dummy) : 0;
+  }
+
+  template <typename WORD>
+  bool cmpxchg(uint64_t gpa, WORD expected, WORD new_value)
+  {
+    if (violation_)
+      return false;
+
+    auto const hpa = host_phys_addr(gpa, EPT_W);
+
+    return hpa and memory_->cmpxchg(*hpa, expected, new_value);
+  }
+
+  guest_phys_memory(ept_state const &ept, MEMORY *memory, ept_cache *cache, uint64_t linear_addr)
+      : ept_(ept), memory_(memory), cache_(cache), linear_addr_(linear_addr)
+  {
+  }
+};
+
+}  // namespace internal
+
+inline bool nested_tlb_entry::hits(linear_memory_op const &op, paging_state const &state) const
+{
+  uint8_t const access = internal::ept_access(op.type);
+
+  return (ept_rights_ & access) and entry_.hits(op, state);
+}
+
+// Translate a guest-physical address for an access of the given type.
+//
+// Returns either the EPT entry that translates the address and allows the
+// access, or the information for the resulting EPT violation. If a cache is
+// passed, it is consulted first and filled on misses.
+template <typename MEMORY>
+ept_result translate_guest_phys(uint64_t gpa,
+                                linear_memory_op::access_type type,
+                                ept_state const &ept,
+                                MEMORY *memory,
+                                ept_cache *cache = nullptr)
+{
+  return internal::translate_guest_phys(gpa, internal::ept_access(type), ept, memory, cache);
+}
+
+// Translate a linear memory access of a guest that runs with nested paging.
+// The memory backend is accessed with host-physical addresses.
+//
+// Returns the combined translation of the linear address to a host-physical
+// address, the page fault of the guest walk, or the EPT violation of either a
+// guest page table access or the final guest-physical address. The combined
+// translation covers the smaller of the guest and the EPT page.
+//
+// Guest-physical translations are looked up in and added to the EPT cache, if
+// one is given. Walks of 4-level guest page tables use the paging-structure
+// cache. Its entries were read from guest page tables through the EPT, so they
+// are only valid for the EPT they were cached with.
+template <typename MEMORY>
+nested_translate_result translate_nested(linear_memory_op const &op,
+                                         paging_state const &state,
+                                         ept_state const &ept,
+                                         MEMORY *memory,
+                                         ept_cache *cache = nullptr,
+                                         paging_structure_cache *psc = nullptr)
+{
+  using namespace internal;
+
+  guest_phys_memory<MEMORY> guest_memory {ept, memory, cache, op.linear_addr};
+  translate_result guest;
+
+  with_paging_mode(state.get_paging_mode(), [&](auto mode) {
+    guest = translate_in_mode<decltype(mode)::value>(op, state, &guest_memory, psc);
+  });
+
+  if (guest_memory.violation())
+    return *guest_memory.violation();
+
+  if (auto const *pf = std::get_if<page_fault_info>(&guest))
+    return *pf;
+
+  tlb_entry const &guest_entry = std::get<tlb_entry>(guest);
+  auto const guest_phys_addr = guest_entry.translate(op.linear_addr);
+
+  assert(guest_phys_addr);
+
+  uint64_t const gpa = *guest_phys_addr;
+  auto const res = internal::translate_guest_phys(gpa, ept_access(op.type), ept, memory, cache);
+
+  if (auto const *violation = std::get_if<ept_violation_info>(&res)) {
+    ept_violation_info info = *violation;
+
+    if (not info.misconfiguration) {
+      info.guest_linear_addr = op.linear_addr;
+      info.qualification |= EPT_QUAL_GLA_VALID | EPT_QUAL_GLA_TRANSLATION;
+    }
+
+    return info;
+  }
+
+  ept_entry const &host_entry = std::get<ept_entry>(res);
+  uint8_t const size_bits =
+      std::min(uint8_t(__builtin_ctzll(guest_entry.size())), host_entry.size_bits());
+  uint64_t const mask = (uint64_t(1) << size_bits) - 1;
+  tlb_attr const &attr = guest_entry.attr();
+
+  return nested_tlb_entry {
+      tlb_entry {op.linear_addr & ~mask, *host_entry.translate(gpa) & ~mask, size_bits,
+                 tlb_attr {attr.is_w(), attr.is_u(), attr.is_xd(),
+                           attr.is_d() and host_entry.is_dirty(), attr.is_g()}},
+      host_entry.rights()};
+}
+
+// A set-associative TLB for guests with nested paging.
+//
+// It caches the combined translations of linear to host-physical addresses, so
+// hits skip both translation stages. Misses are served with the help of a
+// paging-structure cache for the guest page table and a separate cache for
+// guest-physical translations.
+//
+// Guest TLB invalidations work as for set_assoc_tlb. Changes to the EPT or the
+// EPT pointer need invept, because neither combined translations nor
+// paging-structure cache entries are tagged with the EPT pointer.
+template <size_t SETS, size_t WAYS>
+class nested_tlb
+{
+  tlb_array<SETS, WAYS, 12, nested_tlb_entry> entries_;
+  paging_structure_cache psc_;
+  ept_cache ept_cache_;
+
+public:
+  // Reset the TLB to its pristine (empty) state.
+  void clear()
+  {
+    entries_.clear();
+    psc_.clear();
+    ept_cache_.clear();
+  }
+
+  // Remove all translations that depend on the EPT, i.e. all combined and
+  // guest-physical translations and the paging-structure cache, whose entries
+  // were read through the EPT. This is the effect of INVEPT.
+  void invept()
+  {
+    entries_.clear();
+    psc_.clear();
+    ept_cache_.clear();
+  }
+
+  // Remove all non-global translations that belong to the given PCID.
+  void invalidate_pcid(uint16_t pcid)
+  {
+    entries_.invalidate_pcid(pcid);
+    psc_.invalidate_pcid(pcid);
+  }
+
+  // Remove all non-global translations of all PCIDs.
+  void invalidate_non_global()
+  {
+    entries_.invalidate_non_global();
+    psc_.clear();
+  }
+
+  // Remove the translations of the given PCID for the linear addresses from
+  // first to last (inclusive), optionally including global ones. The
+  // paging-structure cache entries of the PCID are removed as well.
+  void invalidate_addresses(uint64_t first, uint64_t last, uint16_t pcid, bool include_global)
+  {
+    entries_.invalidate_addresses(first, last, pcid, include_global);
+    psc_.invalidate_pcid(pcid);
+  }
+
+  // Perform the invalidation of a MOV to CR3 with the given value. Only
+  // CR4.PCIDE is used from the paging state.
+  void mov_to_cr3(uint64_t value, paging_state const &state)
+  {
+    invalidate_cr3_write(this, value, state);
+  }
+
+  // Perform the invalidation of INVLPG for the given linear address.
+  void invlpg(uint64_t linear_addr, paging_state const &state)
+  {
+    invalidate_linear_range(this, linear_addr, 1, state);
+  }
+
+  // Perform the invalidation of INVPCID with the given descriptor.
+  void invpcid(invpcid_type type, uint16_t pcid, uint64_t linear_addr = 0)
+  {
+    invalidate_invpcid(this, type, pcid, linear_addr);
+  }
+
+  // This method is semantically identical to vmmu::translate_nested. It just
+  // caches its results.
+  template <typename MEMORY>
+  nested_translate_result translate(linear_memory_op const &op,
+                                    paging_state const &state,
+                                    ept_state const &ept,
+                                    MEMORY *memory)
+  {
+    if (auto entry = entries_.lookup(op, state))
+      return *entry;
+
+    auto res = ::vmmu::translate_nested(op, state, ept, memory, &ept_cache_, &psc_);
+
+    if (auto const *entry = std::get_if<nested_tlb_entry>(&res))
+      entries_.insert(op.linear_addr, state.get_pcid(), *entry);
+
+    return res;
+  }
+};
+
+}  // namespace vmmu
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+// A page of host memory that holds a shadow page table.
+struct shadow_table_page {
+  // The 512 entries as the shadow paging engine writes them.
+  uint64_t *entries;
+
+  // The address that the host MMU uses to find the table.
+  uint64_t phys_addr;
+};
+
+// The interface between the shadow paging engine and the embedder.
+class shadow_hooks
+{
+public:
+  // Allocate a zeroed, 4KB aligned page for a shadow page table.
+  virtual shadow_table_page allocate_table() = 0;
+  virtual void free_table(shadow_table_page const &page) = 0;
+
+  // Return the host-physical address of the 4KB page that backs the given
+  // guest-physical page or nothing, if accesses to it have to be emulated, for
+  // example because it is MMIO.
+  virtual std::optional<uint64_t> guest_to_host(uint64_t guest_page) = 0;
+
+  // Start or stop trapping writes to the given guest-physical page. The
+  // engine removes write access to the page from its own shadow page tables.
+  // These hooks are for other mappings of the page that the embedder
+  // maintains, for example in an IOMMU or for DMA emulation.
+  virtual void write_protect(uint64_t guest_page) = 0;
+  virtual void write_unprotect(uint64_t guest_page) = 0;
+
+  // Flush the host TLB, because shadow page table entries were removed or
+  // lost write access.
+  virtual void flush_host_tlb() = 0;
+
+  virtual ~shadow_hooks() {}
+};
+
+// The shadow page table now maps the faulting access, so it can be retried.
+struct shadow_mapped {
+};
+
+// The result of a shadow page fault. Besides shadow_mapped and guest page
+// faults, the engine returns the guest translation for accesses that the guest
+// allows, but that cannot be mapped directly. The embedder has to emulate
+// them. These are writes to guest page tables that are write-protected,
+// accesses to memory without host backing and supervisor writes to read-only
+// user pages with CR0.WP clear.
+using shadow_fault_result = std::variant<shadow_mapped, tlb_entry, page_fault_info>;
+
+// Maintains shadow page tables for a guest that runs without nested paging.
+//
+// Shadow page tables use the 4-level 64-bit format and translate guest linear
+// addresses directly to host-physical addresses with 4KB pages. The host MMU
+// walks them instead of the guest page table. They are filled lazily: each
+// host page fault is passed to handle_fault, which walks the guest page table
+// and installs the translation.
+//
+// To keep shadow page tables in sync with the guest, all guest page table
+// pages that were used in a walk are write-protected. When the guest writes
+// to them, the embedder emulates the write and calls guest_write, which
+// removes the shadow entries that were derived from the written guest entry.
+//
+// Guest page tables of the last level are a special case, because guests
+// write them often. The first write to such a table unprotects it and marks
+// it out of sync. Its shadow entries may be stale until the guest invalidates
+// its TLB, which it has to do anyway after changing page table entries. INVLPG
+// removes the shadow entry of the address, and MOV to CR3 and sync bring all
+// out-of-sync tables back in sync and protect them again.
+//
+// Shadow page tables are kept per guest address space, i.e. per CR3 base and
+// paging mode, so switching between processes keeps them. Guest page tables
+// are read through the abstract_memory interface with guest-physical
+// addresses. The engine is not thread-safe.
+class shadow_paging
+{
+  struct shadow_table;
+
+  struct shadow_table_deleter {
+    shadow_hooks *hooks;
+    void operator()(shadow_table *table) const;
+  };
+
+  using table_ptr = std::unique_ptr<shadow_table, shadow_table_deleter>;
+
+  struct shadow_table {
+    shadow_table_page page;
+
+    // The next level tables. Empty for the last level.
+    std::vector<table_ptr> children;
+  };
+
+  // A guest page table entry that a shadow address space depends on. The
+  // guest page table at a guest-physical page is used for the linear
+  // addresses from base, where each entry covers 2^order bytes.
+  struct table_use {
+    uint64_t address_space;
+    uint64_t base;
+    uint8_t order;
+    uint8_t entry_size;
+
+    bool operator==(table_use const &other) const
+    {
+      return address_space == other.address_space and base == other.base and
+             order == other.order and entry_size == other.entry_size;
+    }
+  };
+
+  struct guest_table {
+    std::vector<table_use> uses;
+    bool unsync = false;
+  };
+
+  // A shadow entry that maps a guest-physical page to the given host page.
+  struct mapping {
+    uint64_t address_space;
+    uint64_t linear_page;
+    uint64_t host_page;
+
+    bool operator==(mapping const &other) const
+    {
+      return address_space == other.address_space and linear_page == other.linear_page and
+             host_page == other.host_page;
+    }
+  };
+
+  abstract_memory *memory_;
+  shadow_hooks *hooks_;
+
+  // Shadow page table roots by address space.
+  std::map<uint64_t, table_ptr> roots_;
+
+  // All guest page tables that were seen in walks by guest-physical page.
+  std::unordered_map<uint64_t, guest_table> tables_;
+
+  // The shadow entries that map each guest-physical page. Entries may be
+  // stale. They are dropped when write access is removed.
+  std::unordered_map<uint64_t, std::vector<mapping>> mappings_;
+
+  static uint64_t address_space_of(paging_state const &state);
+
+  table_ptr make_table(bool last_level);
+  shadow_table &root_of(uint64_t address_space);
+
+  // Return the shadow entry for the linear page or nullptr, if the tables on
+  // the way don't exist.
+  uint64_t *find_entry(uint64_t address_space, uint64_t linear_page);
+
+  // Remove the shadow entries for the linear addresses from first to last.
+  void zap(uint64_t address_space, uint64_t first, uint64_t last);
+  void zap_table(shadow_table &table, unsigned order, uint64_t base, uint64_t first, uint64_t last);
+
+  // Remove write access to the guest-physical page from all shadow entries.
+  // Returns true, if an entry changed.
+  bool remove_write_access(uint64_t guest_page);
+
+  // Start tracking a guest page table that a walk used. Returns true, if
+  // shadow entries lost write access.
+  bool track_table(uint64_t guest_page, table_use const &use);
+
+  // Remove all shadow entries that were derived from guest page table
+  // entries in the byte range of the given table.
+  void zap_uses(guest_table const &table, uint64_t offset, uint64_t size);
+
+  bool protect(uint64_t guest_page);
+
+public:
+  // Return the address of the shadow page table root that the host MMU has to
+  // use for the given guest paging state.
+  uint64_t root(paging_state const &state);
+
+  // Handle a host page fault that the given access caused in the shadow page
+  // table for the given paging state.
+  shadow_fault_result handle_fault(linear_memory_op const &op, paging_state const &state);
+
+  // Tell the engine that the guest wrote size bytes at the given
+  // guest-physical address into a write-protected page. The embedder calls this
+  // after emulating the write.
+  void guest_write(uint64_t guest_phys_addr, uint64_t size);
+
+  // Returns true, if writes to the guest-physical page are trapped, because it
+  // contains a guest page table that is in sync.
+  bool is_write_protected(uint64_t guest_page) const;
+
+  // Perform the invalidation of a guest INVLPG in all address spaces.
+  void invlpg(uint64_t linear_addr);
+
+  // Bring all out-of-sync guest page tables back in sync.
+  void sync();
+
+  // Perform the invalidation of a guest MOV to CR3. With PAE paging, the
+  // PDPTEs may have changed, so the shadow page table of the address space is
+  // discarded.
+  void mov_to_cr3(paging_state const &state);
+
+  // Discard all shadow page tables and stop tracking guest page tables.
+  void clear();
+
+  shadow_paging(abstract_memory *memory, shadow_hooks *hooks);
+  ~shadow_paging();
+
+  shadow_paging(shadow_paging const &) = delete;
+  shadow_paging &operator=(shadow_paging const &) = delete;
+};
+
+}  // namespace vmmu
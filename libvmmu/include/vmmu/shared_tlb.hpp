@@ -0,0 +1,483 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vmmu/internal/compiler.hpp>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+// A set-associative TLB that several vCPU threads share.
+//
+// Translations are tagged with their address space, i.e. the page table base
+// and PCID from CR3 and the paging mode, so vCPUs that run in the same address
+// space reuse each other's translations. Global translations are shared across
+// all address spaces.
+//
+// Lookups don't take locks. Each slot has a version word that is odd while the
+// slot is written. Readers copy the slot and discard the copy, if the version
+// changed in the meantime (a seqlock). Inserts try to take the slot and give up
+// if another thread is writing it, because dropping a translation is always
+// fine for a TLB.
+//
+// Invalidations are tracked with generations as in tlb_generations, but with
+// atomic counters. Every invalidation starts a new generation. An insert only
+// succeeds, if no invalidation started since its page table walk began, so a
+// walk that raced with a page table update and its invalidation can't leave a
+// stale translation behind.
+//
+// Translations are tagged with their own page and the set is selected by the
+// page number at their page size, so a large page is cached once. Lookups and
+// invalidations probe one set for each page size that was ever cached.
+//
+// Translations with paging disabled are not cached and walks don't use a
+// paging-structure cache, because it would have to be shared as well.
+template <size_t SETS, size_t WAYS>
+class shared_tlb
+{
+  static_assert(SETS > 0 and (SETS & (SETS - 1)) == 0, "SETS must be a power of 2");
+  static_assert(WAYS > 0, "WAYS must not be zero");
+
+  static constexpr unsigned SET_BITS = __builtin_ctzll(SETS);
+  static constexpr unsigned PAGE_BITS = 12;
+  static constexpr size_t SPACE_GROUPS = 64;
+
+  // The tag of unused slots. It never matches, because tags are page
+  // aligned.
+  static constexpr uint64_t INVALID_TAG = 1;
+
+  enum : uint8_t {
+    ATTR_W = 1U << 0,
+    ATTR_U = 1U << 1,
+    ATTR_XD = 1U << 2,
+    ATTR_D = 1U << 3,
+    ATTR_G = 1U << 4,
+  };
+
+  // A copy of a slot that readers can work with.
+  struct slot_data {
+    uint64_t address_space;
+
+    // The linear address of the page.
+    uint64_t tag;
+
+    uint64_t linear_addr;
+    uint64_t phys_addr;
+    uint64_t generation;
+    uint8_t size_bits;
+    uint8_t attr;
+
+    bool is_global() const { return attr & ATTR_G; }
+
+    tlb_entry entry() const
+    {
+      return {linear_addr, phys_addr, size_bits,
+              tlb_attr {bool(attr & ATTR_W), bool(attr & ATTR_U), bool(attr & ATTR_XD),
+                        bool(attr & ATTR_D), bool(attr & ATTR_G)}};
+    }
+  };
+
+  struct alignas(64) slot {
+    std::atomic<uint64_t> version {0};
+
+    std::atomic<uint64_t> address_space {0};
+    std::atomic<uint64_t> tag {INVALID_TAG};
+    std::atomic<uint64_t> linear_addr {0};
+    std::atomic<uint64_t> phys_addr {0};
+    std::atomic<uint64_t> generation {0};
+    std::atomic<uint8_t> size_bits {PAGE_BITS};
+    std::atomic<uint8_t> attr {0};
+
+    // Copy the slot. Returns false, if the slot was written concurrently.
+    bool read(slot_data &data) const
+    {
+      uint64_t const before = version.load(std::memory_order_acquire);
+
+      if (before & 1)
+        return false;
+
+      data.address_space = address_space.load(std::memory_order_relaxed);
+      data.tag = tag.load(std::memory_order_relaxed);
+      data.linear_addr = linear_addr.load(std::memory_order_relaxed);
+      data.phys_addr = phys_addr.load(std::memory_order_relaxed);
+      data.generation = generation.load(std::memory_order_relaxed);
+      data.size_bits = size_bits.load(std::memory_order_relaxed);
+      data.attr = attr.load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return version.load(std::memory_order_relaxed) == before;
+    }
+
+    void write(slot_data const &data)
+    {
+      address_space.store(data.address_space, std::memory_order_relaxed);
+      tag.store(data.tag, std::memory_order_relaxed);
+      linear_addr.store(data.linear_addr, std::memory_order_relaxed);
+      phys_addr.store(data.phys_addr, std::memory_order_relaxed);
+      generation.store(data.generation, std::memory_order_relaxed);
+      size_bits.store(data.size_bits, std::memory_order_relaxed);
+      attr.store(data.attr, std::memory_order_relaxed);
+    }
+
+    bool try_lock()
+    {
+      uint64_t current = version.load(std::memory_order_relaxed);
+
+      if (current & 1 or not version.compare_exchange_strong(current, current + 1))
+        return false;
+
+      std::atomic_thread_fence(std::memory_order_release);
+      return true;
+    }
+
+    void lock()
+    {
+      while (not try_lock())
+        internal::cpu_relax();
+    }
+
+    void unlock() { version.fetch_add(1, std::memory_order_release); }
+  };
+
+  std::array<slot, SETS * WAYS> slots_;
+
+  // The generation of inserts whose walk starts now. Invalidations increment
+  // it.
+  alignas(64) std::atomic<uint64_t> current_ {1};
+
+  // Entries are valid, if their generation is larger than the ones below that
+  // cover them.
+  alignas(64) std::atomic<uint64_t> flushed_all_ {0};
+  std::atomic<uint64_t> flushed_non_global_ {0};
+  std::array<std::atomic<uint64_t>, SPACE_GROUPS> flushed_space_ {};
+
+  // Bit i is set, if pages of size 2^i were ever cached.
+  std::atomic<uint64_t> page_sizes_ {uint64_t(1) << PAGE_BITS};
+
+  // The page of the given size that contains the linear address.
+  static uint64_t page_of(uint64_t linear_addr, unsigned size_bits)
+  {
+    return linear_addr & ~((uint64_t(1) << size_bits) - 1);
+  }
+
+  // Pages of different sizes with the same number go to different sets.
+  static size_t set_index(uint64_t linear_addr, unsigned size_bits)
+  {
+    uint64_t const page = linear_addr >> size_bits;
+
+    return (page ^ (page >> SET_BITS) ^ (page >> 2 * SET_BITS) ^ size_bits) & (SETS - 1);
+  }
+
+  // Call fn with the size bits of each page size that was ever cached, from
+  // the smallest to the largest. Stops when fn returns true.
+  template <typename FN>
+  void for_each_page_size(FN const &fn) const
+  {
+    for (uint64_t sizes = page_sizes_.load(); sizes != 0; sizes &= sizes - 1)
+      if (fn(unsigned(__builtin_ctzll(sizes))))
+        return;
+  }
+
+  static size_t space_group(uint64_t address_space)
+  {
+    uint64_t const base = address_space & ~uint64_t(0xFFF);
+
+    return ((base >> PAGE_BITS) ^ (address_space & CR3_PCID_MASK)) % SPACE_GROUPS;
+  }
+
+  // Identify the address space of the page table base and PCID in the given
+  // CR3 value in the given paging mode.
+  static uint64_t address_space(uint64_t cr3, uint16_t pcid, internal::paging_mode mode)
+  {
+    return (cr3 & ~uint64_t(0xFFF) & ~CR3_NOFLUSH) | pcid | uint64_t(mode) << 60;
+  }
+
+  static uint64_t address_space(paging_state const &state)
+  {
+    return address_space(state.get_cr3(), state.get_pcid(), state.get_paging_mode());
+  }
+
+  // Start a new generation and return the last one.
+  uint64_t next_generation() { return current_.fetch_add(1); }
+
+  static void raise(std::atomic<uint64_t> &value, uint64_t at_least)
+  {
+    uint64_t current = value.load();
+
+    while (current < at_least and not value.compare_exchange_weak(current, at_least))
+      ;
+  }
+
+  bool is_valid(slot_data const &data) const
+  {
+    if (data.tag == INVALID_TAG or
+        data.generation <= flushed_all_.load(std::memory_order_acquire))
+      return false;
+
+    return data.is_global() or
+           (data.generation > flushed_non_global_.load(std::memory_order_acquire) and
+            data.generation >
+                flushed_space_[space_group(data.address_space)].load(std::memory_order_acquire));
+  }
+
+  bool matches(slot_data const &data, uint64_t space, uint64_t page, unsigned size_bits) const
+  {
+    return data.tag == page and data.size_bits == size_bits and
+           (data.is_global() or data.address_space == space) and is_valid(data);
+  }
+
+  std::optional<tlb_entry> lookup(uint64_t space,
+                                  linear_memory_op const &op,
+                                  paging_state const &state) const
+  {
+    std::optional<tlb_entry> result;
+
+    for_each_page_size([&](unsigned size_bits) {
+      uint64_t const page = page_of(op.linear_addr, size_bits);
+      slot const *set = &slots_[set_index(op.linear_addr, size_bits) * WAYS];
+
+      for (size_t way = 0; way < WAYS; way++) {
+        slot_data data;
+
+        if (not set[way].read(data) or not matches(data, space, page, size_bits))
+          continue;
+
+        tlb_entry const entry = data.entry();
+
+        if (entry.hits(op, state)) {
+          result = entry;
+          return true;
+        }
+      }
+
+      return false;
+    });
+
+    return result;
+  }
+
+  // Cache a translation that was created by a walk that started in the given
+  // generation. The slot of an older translation for the same page is reused.
+  // Otherwise, an unused slot or the one with the oldest translation is
+  // replaced.
+  void insert(uint64_t space, uint64_t generation, tlb_entry const &entry)
+  {
+    auto const size_bits = uint8_t(__builtin_ctzll(entry.match_mask()));
+    uint64_t const page = entry.linear_addr();
+    slot *set = &slots_[set_index(page, size_bits) * WAYS];
+
+    size_t victim = 0;
+    uint64_t victim_generation = ~uint64_t(0);
+
+    for (size_t way = 0; way < WAYS; way++) {
+      slot_data data;
+
+      if (not set[way].read(data))
+        continue;
+
+      uint64_t const age = is_valid(data) ? data.generation : 0;
+
+      if (matches(data, space, page, size_bits)) {
+        victim = way;
+        break;
+      }
+
+      if (age < victim_generation) {
+        victim = way;
+        victim_generation = age;
+      }
+    }
+
+    // Invalidations must probe this page size, before the translation can be
+    // inserted. An invalidation that loads the page sizes before this has
+    // started a new generation, so the insert below fails.
+    page_sizes_.fetch_or(uint64_t(1) << size_bits);
+
+    auto const &attr = entry.attr();
+    slot_data const data {
+        space,
+        page,
+        entry.linear_addr(),
+        entry.phys_addr(),
+        generation,
+        size_bits,
+        uint8_t(ATTR_W * attr.is_w() | ATTR_U * attr.is_u() | ATTR_XD * attr.is_xd() |
+                ATTR_D * attr.is_d() | ATTR_G * attr.is_g())};
+
+    slot &target = set[victim];
+
+    if (not target.try_lock())
+      return;
+
+    // An invalidation that started after the walk may have missed this
+    // translation.
+    if (current_.load() == generation)
+      target.write(data);
+
+    target.unlock();
+  }
+
+  // Remove the translations in the given slots that satisfy the predicate.
+  template <typename PRED>
+  void remove_if(slot *first, size_t count, PRED const &pred)
+  {
+    for (slot *s = first; s != first + count; s++) {
+      slot_data data;
+
+      // Wait for concurrent writers, so their translations are not missed.
+      while (not s->read(data))
+        internal::cpu_relax();
+
+      if (data.tag == INVALID_TAG or not pred(data))
+        continue;
+
+      s->lock();
+
+      if (s->tag.load(std::memory_order_relaxed) == data.tag)
+        s->tag.store(INVALID_TAG, std::memory_order_relaxed);
+
+      s->unlock();
+    }
+  }
+
+public:
+  // Reset the TLB to its pristine (empty) state.
+  void clear() { raise(flushed_all_, next_generation()); }
+
+  // Remove all non-global translations of all address spaces.
+  void invalidate_non_global() { raise(flushed_non_global_, next_generation()); }
+
+  // Remove all non-global translations of the address space with the given
+  // CR3 value. Other address spaces may lose their translations as well.
+  void invalidate_address_space(uint64_t cr3, paging_state const &state)
+  {
+    uint16_t const pcid = state.get_cr4_pcide() ? uint16_t(cr3 & CR3_PCID_MASK) : 0;
+
+    raise(flushed_space_[space_group(address_space(cr3, pcid, state.get_paging_mode()))],
+          next_generation());
+  }
+
+  // Translations are not tagged with the PCID alone, so this removes the
+  // non-global translations of all address spaces.
+  void invalidate_pcid(uint16_t /* pcid */) { invalidate_non_global(); }
+
+  // Remove the translations of all address spaces for the linear addresses
+  // from first to last (inclusive), optionally including global ones. The PCID
+  // is ignored.
+  //
+  // Only the sets the range maps to are searched for each page size, unless
+  // the range covers more sets than there are.
+  void invalidate_addresses(uint64_t first,
+                            uint64_t last,
+                            uint16_t /* pcid */,
+                            bool include_global)
+  {
+    // Walks that started before this point must not insert their translations
+    // anymore.
+    next_generation();
+
+    auto const pred = [=](slot_data const &data) {
+      uint64_t const size = uint64_t(1) << data.size_bits;
+
+      return (include_global or not data.is_global()) and data.linear_addr <= last and
+             data.linear_addr + (size - 1) >= first;
+    };
+
+    for_each_page_size([&](unsigned size_bits) {
+      uint64_t const first_page = first >> size_bits;
+      uint64_t const last_page = last >> size_bits;
+
+      if (last_page - first_page >= SETS - 1) {
+        remove_if(slots_.data(), slots_.size(), pred);
+        return true;
+      }
+
+      for (uint64_t page = first_page; page <= last_page; page++)
+        remove_if(&slots_[set_index(page << size_bits, size_bits) * WAYS], WAYS, pred);
+
+      return false;
+    });
+  }
+
+  // Perform the invalidation of a MOV to CR3 with the given value. Only
+  // CR4.PCIDE and the paging mode are used from the paging state.
+  void mov_to_cr3(uint64_t value, paging_state const &state)
+  {
+    if (not state.get_cr4_pcide() or not(value & CR3_NOFLUSH))
+      invalidate_address_space(value, state);
+  }
+
+  // Perform the invalidation of INVLPG for the given linear address.
+  void invlpg(uint64_t linear_addr, paging_state const &state)
+  {
+    invalidate_linear_range(this, linear_addr, 1, state);
+  }
+
+  // Perform the invalidation of INVPCID with the given descriptor.
+  void invpcid(invpcid_type type, uint16_t pcid, uint64_t linear_addr = 0)
+  {
+    invalidate_invpcid(this, type, pcid, linear_addr);
+  }
+
+  // Invalidate the translations for a range of linear addresses as if INVLPG
+  // was executed for each page in it.
+  void invalidate_range(uint64_t linear_addr, uint64_t length, paging_state const &state)
+  {
+    invalidate_linear_range(this, linear_addr, length, state);
+  }
+
+  // This method is semantically identical to vmmu::translate. It just caches
+  // its results in the TLB. It can be called concurrently from any number of
+  // threads.
+  template <typename MEMORY>
+  translate_result translate(linear_memory_op const &op,
+                             paging_state const &state,
+                             MEMORY *memory)
+  {
+    if (state.get_paging_mode() == internal::paging_mode::PHYS)
+      return ::vmmu::translate(op, state, memory);
+
+    uint64_t const space = address_space(state);
+
+    if (auto entry = lookup(space, op, state))
+      return *entry;
+
+    uint64_t const generation = current_.load();
+    auto res = ::vmmu::translate(op, state, memory);
+
+    if (auto const *entry = std::get_if<tlb_entry>(&res))
+      insert(space, generation, *entry);
+
+    return res;
+  }
+
+  // Translate a batch of operations. See vmmu::translate_batch.
+  template <typename MEMORY>
+  void translate_batch(linear_memory_op const *ops,
+                       size_t count,
+                       paging_state const &state,
+                       MEMORY *memory,
+                       translate_result *results)
+  {
+    internal::translate_each(ops, count, state, results, [&](linear_memory_op const &op) {
+      return translate(op, state, memory);
+    });
+  }
+
+  // Translate a linear memory range. See vmmu::translate_range.
+  template <typename MEMORY>
+  std::optional<page_fault_info> translate_range(linear_memory_op const &op,
+                                                 uint64_t length,
+                                                 paging_state const &state,
+                                                 MEMORY *memory,
+                                                 std::vector<phys_segment> &segments)
+  {
+    return internal::translate_pages(op, length, segments, [&](linear_memory_op const &page_op) {
+      return translate(page_op, state, memory);
+    });
+  }
+};
+
+}  // namespace vmmu
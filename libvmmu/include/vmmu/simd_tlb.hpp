@@ -0,0 +1,181 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+namespace internal
+{
+// Return a bit mask of the entries i < count for which (linear_addr &
+// masks[i]) == tags[i]. The count must be a multiple of 8 and at most 64. Both
+// arrays must be 64-byte aligned.
+using tag_match_fn = uint64_t (*)(uint64_t const *tags,
+                                  uint64_t const *masks,
+                                  size_t count,
+                                  uint64_t linear_addr);
+
+uint64_t match_tags_scalar(uint64_t const *tags,
+                           uint64_t const *masks,
+                           size_t count,
+                           uint64_t linear_addr);
+
+#if defined(__x86_64__)
+uint64_t match_tags_sse2(uint64_t const *tags,
+                         uint64_t const *masks,
+                         size_t count,
+                         uint64_t linear_addr);
+uint64_t match_tags_avx2(uint64_t const *tags,
+                         uint64_t const *masks,
+                         size_t count,
+                         uint64_t linear_addr);
+uint64_t match_tags_avx512(uint64_t const *tags,
+                           uint64_t const *masks,
+                           size_t count,
+                           uint64_t linear_addr);
+#endif
+
+// The best tag matching function for the host CPU. It is selected when it is
+// called for the first time.
+extern std::atomic<tag_match_fn> match_tags;
+
+}  // namespace internal
+
+// A fully associative TLB that compares many entries at once.
+//
+// The tags and match masks of all entries are kept in separate arrays, so a
+// lookup can compare 2, 4 or 8 entries with a single SIMD instruction. The
+// instruction set is selected at runtime. Invalid entries have a tag with bit 0
+// set, which never matches, because the linear address is masked at least to
+// 4KB granularity.
+//
+// Entries are replaced in FIFO order. Like tlb<SIZE>, this TLB doesn't track
+// PCIDs and has to be cleared when the address space changes.
+template <size_t SIZE>
+class simd_tlb
+{
+  static_assert(SIZE > 0 and SIZE % 8 == 0, "SIZE must be a multiple of 8");
+
+  static constexpr uint64_t INVALID_TAG = 1;
+  static constexpr size_t CHUNK = 64;
+
+  struct cached_entry {
+    tlb_entry entry = tlb_entry::no_paging();
+  };
+
+  alignas(64) std::array<uint64_t, SIZE> tags_;
+  alignas(64) std::array<uint64_t, SIZE> masks_ {};
+  std::array<cached_entry, SIZE> entries_;
+
+  size_t pos_ = 0;
+
+  std::optional<tlb_entry> lookup(linear_memory_op const &op, paging_state const &state) const
+  {
+    auto const match = internal::match_tags.load(std::memory_order_relaxed);
+
+    for (size_t base = 0; base < SIZE; base += CHUNK) {
+      size_t const count = std::min(CHUNK, SIZE - base);
+
+      for (uint64_t hits = match(&tags_[base], &masks_[base], count, op.linear_addr); hits != 0;
+           hits &= hits - 1) {
+        auto const &entry = entries_[base + __builtin_ctzll(hits)].entry;
+
+        if (entry.hits(op, state))
+          return entry;
+      }
+    }
+
+    return {};
+  }
+
+  // Return the slot of the entry that maps the same page as the given one, if
+  // there is one.
+  std::optional<size_t> find_page(tlb_entry const &entry) const
+  {
+    auto const match = internal::match_tags.load(std::memory_order_relaxed);
+
+    for (size_t base = 0; base < SIZE; base += CHUNK) {
+      size_t const count = std::min(CHUNK, SIZE - base);
+
+      for (uint64_t hits = match(&tags_[base], &masks_[base], count, entry.linear_addr());
+           hits != 0; hits &= hits - 1) {
+        size_t const slot = base + __builtin_ctzll(hits);
+
+        if (masks_[slot] == entry.match_mask())
+          return slot;
+      }
+    }
+
+    return {};
+  }
+
+  // Cache an entry. An older entry for the same page is replaced, because it
+  // may have stale accessed and dirty information.
+  void insert(tlb_entry const &entry)
+  {
+    size_t slot = pos_;
+
+    if (auto const old = find_page(entry))
+      slot = *old;
+    else
+      pos_ = (pos_ + 1) % SIZE;
+
+    tags_[slot] = entry.linear_addr();
+    masks_[slot] = entry.match_mask();
+    entries_[slot].entry = entry;
+  }
+
+public:
+  // Reset the TLB to its pristine (empty) state.
+  void clear() { tags_.fill(INVALID_TAG); }
+
+  // This method is semantically identical to vmmu::translate. It just caches
+  // its results in the TLB.
+  template <typename MEMORY>
+  translate_result translate(linear_memory_op const &op,
+                             paging_state const &state,
+                             MEMORY *memory)
+  {
+    if (auto entry = lookup(op, state))
+      return *entry;
+
+    auto res = ::vmmu::translate(op, state, memory);
+
+    if (std::holds_alternative<tlb_entry>(res))
+      insert(std::get<tlb_entry>(res));
+
+    return res;
+  }
+
+  // Translate a batch of operations. See vmmu::translate_batch.
+  template <typename MEMORY>
+  void translate_batch(linear_memory_op const *ops,
+                       size_t count,
+                       paging_state const &state,
+                       MEMORY *memory,
+                       translate_result *results)
+  {
+    internal::translate_each(ops, count, state, results, [&](linear_memory_op const &op) {
+      return translate(op, state, memory);
+    });
+  }
+
+  // Translate a linear memory range. See vmmu::translate_range.
+  template <typename MEMORY>
+  std::optional<page_fault_info> translate_range(linear_memory_op const &op,
+                                                 uint64_t length,
+                                                 paging_state const &state,
+                                                 MEMORY *memory,
+                                                 std::vector<phys_segment> &segments)
+  {
+    return internal::translate_pages(op, length, segments, [&](linear_memory_op const &page_op) {
+      return translate(page_op, state, memory);
+    });
+  }
+
+  simd_tlb() { clear(); }
+};
+
+}  // namespace vmmu
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+namespace internal
+{
+// The counters of translation_stats. T is uint64_t for snapshots and an atomic
+// for the live counters.
+template <typename T>
+struct basic_translation_counters {
+  static constexpr size_t PAGING_MODES = 4;
+  static constexpr size_t ACCESS_TYPES = 3;
+
+  // Page table levels go from 1 to 4. Index 0 is unused.
+  static constexpr size_t LEVELS = 5;
+
+  // Indexed by paging mode and access type.
+  using per_access_type = std::array<std::array<T, ACCESS_TYPES>, PAGING_MODES>;
+
+  // Indexed by paging mode and page table level.
+  using per_level = std::array<std::array<T, LEVELS>, PAGING_MODES>;
+
+  // Page table walks. Retries after races with page table updates count as
+  // part of the same walk.
+  per_access_type translations {};
+
+  // Translations that ended with a page fault.
+  per_access_type page_faults {};
+
+  // TLB lookups.
+  per_access_type tlb_hits {};
+  per_access_type tlb_misses {};
+
+  // Page table entries that walks read.
+  per_level entry_reads {};
+
+  // Successful and failed updates of accessed and dirty flags. Each failure
+  // restarts the walk.
+  per_level ad_updates {};
+  per_level ad_retries {};
+
+  // Translations by the number of page table entries they read, i.e. the
+  // index is the depth of the walk instead of a level. Retries add to the
+  // depth.
+  per_level walk_depths {};
+
+  // Call fn for each counter together with the corresponding counter of other.
+  template <typename U, typename FN>
+  void zip(basic_translation_counters<U> const &other, FN const &fn)
+  {
+    auto const zip_array = [&](auto &mine, auto const &theirs) {
+      for (size_t mode = 0; mode < PAGING_MODES; mode++)
+        for (size_t i = 0; i < mine[mode].size(); i++)
+          fn(mine[mode][i], theirs[mode][i]);
+    };
+
+    zip_array(translations, other.translations);
+    zip_array(page_faults, other.page_faults);
+    zip_array(tlb_hits, other.tlb_hits);
+    zip_array(tlb_misses, other.tlb_misses);
+    zip_array(entry_reads, other.entry_reads);
+    zip_array(ad_updates, other.ad_updates);
+    zip_array(ad_retries, other.ad_retries);
+    zip_array(walk_depths, other.walk_depths);
+  }
+};
+
+}  // namespace internal
+
+// A snapshot of translation_stats.
+struct translation_counters : internal::basic_translation_counters<uint64_t> {
+  static size_t index(internal::paging_mode mode) { return size_t(mode); }
+  static size_t index(linear_memory_op::access_type type) { return size_t(type); }
+
+  // Sum up a per-mode array over all paging modes.
+  template <typename ARRAY>
+  static uint64_t total(ARRAY const &counters)
+  {
+    uint64_t sum = 0;
+
+    for (auto const &per_mode : counters)
+      for (auto value : per_mode)
+        sum += value;
+
+    return sum;
+  }
+};
+
+// An observer (see walk_observer) that counts translations, TLB lookups, page
+// faults and page table accesses per paging mode, access type and page table
+// level.
+//
+// Counters are only updated by the thread that translates, so updates are
+// plain loads and stores without atomic read-modify-write operations. Other
+// threads may take snapshots and reset the counters at any time. Resetting
+// doesn't write the counters, but remembers their current values as the new
+// baseline for snapshots.
+//
+// To get statistics for several vCPUs that share a TLB, give each of them
+// their own observer.
+class translation_stats : public walk_observer
+{
+  using counter = std::atomic<uint64_t>;
+
+  internal::basic_translation_counters<counter> counters_;
+  internal::basic_translation_counters<counter> baseline_;
+
+  // The number of page table entries the current translation read so far.
+  unsigned depth_ = 0;
+
+  static void increment(counter &c)
+  {
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  static size_t mode_of(paging_state const &state) { return size_t(state.get_paging_mode()); }
+  static size_t type_of(linear_memory_op const &op) { return size_t(op.type); }
+
+public:
+  // Return the counters since the last reset.
+  translation_counters snapshot() const;
+
+  // Start counting from zero.
+  void reset();
+
+  void walk_start(linear_memory_op const &op, paging_state const &state)
+  {
+    increment(counters_.translations[mode_of(state)][type_of(op)]);
+    depth_ = 0;
+  }
+
+  void entry_read(linear_memory_op const &, paging_state const &state, unsigned level, uint64_t)
+  {
+    increment(counters_.entry_reads[mode_of(state)][level]);
+    depth_++;
+  }
+
+  void ad_update(linear_memory_op const &, paging_state const &state, unsigned level, bool success)
+  {
+    increment((success ? counters_.ad_updates : counters_.ad_retries)[mode_of(state)][level]);
+  }
+
+  void walk_end(linear_memory_op const &op, paging_state const &state, translate_result const &res)
+  {
+    if (std::holds_alternative<page_fault_info>(res))
+      increment(counters_.page_faults[mode_of(state)][type_of(op)]);
+
+    size_t const depth = std::min<size_t>(depth_, counters_.LEVELS - 1);
+
+    increment(counters_.walk_depths[mode_of(state)][depth]);
+  }
+
+  void tlb_hit(linear_memory_op const &op, paging_state const &state)
+  {
+    increment(counters_.tlb_hits[mode_of(state)][type_of(op)]);
+  }
+
+  void tlb_miss(linear_memory_op const &op, paging_state const &state)
+  {
+    increment(counters_.tlb_misses[mode_of(state)][type_of(op)]);
+  }
+};
+
+}  // namespace vmmu
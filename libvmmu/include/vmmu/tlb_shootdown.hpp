@@ -0,0 +1,195 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vmmu/internal/compiler.hpp>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+// An invalidation that one vCPU requests from the TLB of another.
+struct tlb_invalidation {
+  enum class kind : uint8_t {
+    // The translations of the PCID for the linear addresses from first to
+    // last (inclusive), optionally including global ones.
+    ADDRESSES,
+
+    // All non-global translations of the PCID.
+    PCID,
+
+    // All non-global translations.
+    NON_GLOBAL,
+
+    // Everything.
+    ALL,
+  };
+
+  kind type;
+  uint64_t first = 0;
+  uint64_t last = 0;
+  uint16_t pcid = 0;
+  bool include_global = false;
+
+  static tlb_invalidation addresses(uint64_t first,
+                                    uint64_t last,
+                                    uint16_t pcid,
+                                    bool include_global)
+  {
+    return {kind::ADDRESSES, first, last, pcid, include_global};
+  }
+
+  static tlb_invalidation of_pcid(uint16_t pcid) { return {kind::PCID, 0, 0, pcid, false}; }
+  static tlb_invalidation non_global() { return {kind::NON_GLOBAL}; }
+  static tlb_invalidation all() { return {kind::ALL}; }
+};
+
+namespace internal
+{
+template <typename TLB, typename = void>
+struct has_selective_invalidation : std::false_type {
+};
+
+template <typename TLB>
+struct has_selective_invalidation<
+    TLB,
+    std::void_t<decltype(std::declval<TLB &>().invalidate_addresses(0, 0, 0, false)),
+                decltype(std::declval<TLB &>().invalidate_pcid(0)),
+                decltype(std::declval<TLB &>().invalidate_non_global())>> : std::true_type {
+};
+
+// Perform an invalidation on a TLB. TLBs that can only be cleared as a whole
+// are cleared.
+template <typename TLB>
+void apply_invalidation(TLB *tlb, tlb_invalidation const &inv)
+{
+  if constexpr (has_selective_invalidation<TLB>::value) {
+    switch (inv.type) {
+    case tlb_invalidation::kind::ADDRESSES:
+      tlb->invalidate_addresses(inv.first, inv.last, inv.pcid, inv.include_global);
+      return;
+    case tlb_invalidation::kind::PCID:
+      tlb->invalidate_pcid(inv.pcid);
+      return;
+    case tlb_invalidation::kind::NON_GLOBAL:
+      tlb->invalidate_non_global();
+      return;
+    case tlb_invalidation::kind::ALL:
+      break;
+    }
+  }
+
+  tlb->clear();
+}
+
+}  // namespace internal
+
+// Coordinates TLB shootdowns between the vCPUs of a guest.
+//
+// When a vCPU changes page tables that other vCPUs may have cached, it queues
+// invalidations for them with shoot or shoot_all instead of invalidating their
+// TLBs directly. Each vCPU calls apply with its own TLB before it translates
+// addresses. This only costs two loads, unless invalidations are pending.
+//
+// Every shootdown gets a ticket from a global epoch counter. A vCPU
+// acknowledges all tickets up to the newest one it has seen once it has
+// applied its queue. Repeated shootdowns before the next translation are thus
+// handled together. Invalidations in the queue are merged where possible and
+// the queue collapses into a full flush when it runs over.
+//
+// The initiator can continue right away or wait until all targets have
+// acknowledged the ticket. A vCPU that doesn't translate anymore, because it
+// is halted, never acknowledges anything, so embedders that wait have to kick
+// halted vCPUs or apply on their behalf before they resume.
+class tlb_shootdown
+{
+  static constexpr size_t QUEUE_SIZE = 16;
+
+  struct alignas(64) vcpu_queue {
+    // The newest ticket that was queued for this vCPU and the newest one it
+    // applied.
+    std::atomic<uint64_t> requested {0};
+    std::atomic<uint64_t> acknowledged {0};
+
+    std::mutex lock;
+    std::array<tlb_invalidation, QUEUE_SIZE> entries;
+    size_t count = 0;
+  };
+
+  std::atomic<uint64_t> epoch_ {0};
+
+  size_t vcpus_;
+  std::unique_ptr<vcpu_queue[]> queues_;
+
+  // Add an invalidation to a queue and record the ticket. The queue lock must
+  // be held while the ticket is taken and queued, so tickets in each queue are
+  // ascending.
+  static void enqueue(vcpu_queue &queue, tlb_invalidation const &inv, uint64_t ticket);
+
+  // Take all pending invalidations of the vCPU. Returns their number and the
+  // newest ticket among them.
+  size_t take(size_t vcpu, std::array<tlb_invalidation, QUEUE_SIZE> &entries, uint64_t &ticket);
+
+  void acknowledge(size_t vcpu, uint64_t ticket)
+  {
+    queues_[vcpu].acknowledged.store(ticket, std::memory_order_release);
+  }
+
+public:
+  // A vCPU number that matches no vCPU.
+  static constexpr size_t NO_VCPU = ~size_t(0);
+
+  size_t vcpus() const { return vcpus_; }
+
+  // Queue an invalidation for a single vCPU. Returns the ticket of the
+  // shootdown.
+  uint64_t shoot(size_t vcpu, tlb_invalidation const &inv);
+
+  // Queue an invalidation for all vCPUs except the given one, which is usually
+  // the initiator. Returns the ticket of the shootdown.
+  uint64_t shoot_all(tlb_invalidation const &inv, size_t except = NO_VCPU);
+
+  // Returns true, if the vCPU has invalidations to apply.
+  bool is_pending(size_t vcpu) const
+  {
+    vcpu_queue const &queue = queues_[vcpu];
+
+    return queue.requested.load(std::memory_order_acquire) !=
+           queue.acknowledged.load(std::memory_order_relaxed);
+  }
+
+  // Returns the number of invalidations that are queued for the vCPU.
+  size_t pending_invalidations(size_t vcpu);
+
+  // Returns true, if all vCPUs except the given one have applied the
+  // shootdown with the given ticket.
+  bool is_complete(uint64_t ticket, size_t except = NO_VCPU) const;
+
+  // Wait until is_complete returns true.
+  void wait(uint64_t ticket, size_t except = NO_VCPU) const;
+
+  // Apply the invalidations that are pending for the vCPU to its TLB. Only the
+  // thread of the vCPU may call this.
+  template <typename TLB>
+  void apply(size_t vcpu, TLB *tlb)
+  {
+    if (internal::likely(not is_pending(vcpu)))
+      return;
+
+    std::array<tlb_invalidation, QUEUE_SIZE> entries;
+    uint64_t ticket = 0;
+    size_t const count = take(vcpu, entries, ticket);
+
+    for (size_t i = 0; i < count; i++)
+      internal::apply_invalidation(tlb, entries[i]);
+
+    acknowledge(vcpu, ticket);
+  }
+
+  explicit tlb_shootdown(size_t vcpus);
+};
+
+}  // namespace vmmu
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <tuple>
+#include <vmmu/internal/compiler.hpp>
+#include <vmmu/vmmu.hpp>
+
+namespace vmmu
+{
+// A histogram with power-of-2 buckets. Bucket i counts the values from 2^i to
+// 2^(i+1) - 1. Bucket 0 also counts 0.
+class log2_histogram
+{
+public:
+  static constexpr size_t BUCKETS = 64;
+
+private:
+  std::array<uint64_t, BUCKETS> buckets_ {};
+
+public:
+  static size_t bucket_of(uint64_t value) { return value ? 63 - __builtin_clzll(value) : 0; }
+
+  void record(uint64_t value) { buckets_[bucket_of(value)]++; }
+
+  uint64_t bucket(size_t i) const { return buckets_.at(i); }
+
+  uint64_t count() const
+  {
+    uint64_t sum = 0;
+
+    for (auto value : buckets_)
+      sum += value;
+
+    return sum;
+  }
+
+  void clear() { buckets_ = {}; }
+};
+
+// An observer (see walk_observer) that measures how long translations, page
+// table entry reads and accessed/dirty updates take.
+//
+// Durations are measured in TSC cycles (see internal::read_cycles) and are
+// kept per paging mode and, for memory accesses, per page table level. Reading
+// the TSC is not free, so measured translations become somewhat slower. The
+// histograms are not synchronized, i.e. they may only be read by the thread
+// that translates.
+class walk_latency : public walk_observer
+{
+  static constexpr size_t PAGING_MODES = 4;
+
+  // Page table levels go from 1 to 4. Index 0 is unused.
+  static constexpr size_t LEVELS = 5;
+
+  std::array<log2_histogram, PAGING_MODES> translations_;
+  std::array<std::array<log2_histogram, LEVELS>, PAGING_MODES> reads_;
+  std::array<std::array<log2_histogram, LEVELS>, PAGING_MODES> ad_updates_;
+
+  uint64_t walk_start_ = 0;
+  uint64_t access_start_ = 0;
+
+  static size_t mode_of(paging_state const &state) { return size_t(state.get_paging_mode()); }
+
+public:
+  // The duration of whole translations including retries.
+  log2_histogram const &translation_cycles(internal::paging_mode mode) const
+  {
+    return translations_.at(size_t(mode));
+  }
+
+  // The duration of reading a page table entry of the given level.
+  log2_histogram const &read_cycles(internal::paging_mode mode, unsigned level) const
+  {
+    return reads_.at(size_t(mode)).at(level);
+  }
+
+  // The duration of the compare-exchange that sets the accessed or dirty flag
+  // in a page table entry of the given level.
+  log2_histogram const &ad_update_cycles(internal::paging_mode mode, unsigned level) const
+  {
+    return ad_updates_.at(size_t(mode)).at(level);
+  }
+
+  void clear() { *this = walk_latency {}; }
+
+  void walk_start(linear_memory_op const &, paging_state const &)
+  {
+    walk_start_ = internal::read_cycles();
+  }
+
+  void walk_end(linear_memory_op const &, paging_state const &state, translate_result const &)
+  {
+    translations_[mode_of(state)].record(internal::read_cycles() - walk_start_);
+  }
+
+  void entry_read_start(linear_memory_op const &, paging_state const &, unsigned)
+  {
+    access_start_ = internal::read_cycles();
+  }
+
+  void entry_read(linear_memory_op const &, paging_state const &state, unsigned level, uint64_t)
+  {
+    reads_[mode_of(state)][level].record(internal::read_cycles() - access_start_);
+  }
+
+  void ad_update_start(linear_memory_op const &, paging_state const &, unsigned)
+  {
+    access_start_ = internal::read_cycles();
+  }
+
+  void ad_update(linear_memory_op const &, paging_state const &state, unsigned level, bool)
+  {
+    ad_updates_[mode_of(state)][level].record(internal::read_cycles() - access_start_);
+  }
+};
+
+// Receives the events of a walk_tracer. The default implementations ignore
+// them.
+class trace_sink
+{
+public:
+  virtual void walk_start(linear_memory_op const &, paging_state const &) {}
+
+  // The walk read the page table entry of the given level.
+  virtual void level_visit(linear_memory_op const &,
+                           paging_state const &,
+                           unsigned /* level */,
+                           uint64_t /* entry */)
+  {
+  }
+
+  // The walk tried to set the accessed or dirty flag in an entry of the given
+  // level.
+  virtual void ad_update(linear_memory_op const &,
+                         paging_state const &,
+                         unsigned /* level */,
+                         bool /* success */)
+  {
+  }
+
+  // The translation ended with a page fault.
+  virtual void fault(linear_memory_op const &, paging_state const &, page_fault_info const &) {}
+
+  // A TLB cached a translation.
+  virtual void tlb_fill(linear_memory_op const &, paging_state const &, tlb_entry const &) {}
+
+  virtual ~trace_sink() {}
+};
+
+// An observer (see walk_observer) that forwards translation events to a
+// trace_sink, for example to attach a profiler. Without a sink, each event
+// only costs a check of the sink pointer.
+class walk_tracer : public walk_observer
+{
+  trace_sink *sink_ = nullptr;
+
+public:
+  // Start sending events to the given sink. Pass nullptr to stop.
+  void attach(trace_sink *sink) { sink_ = sink; }
+
+  void walk_start(linear_memory_op const &op, paging_state const &state)
+  {
+    if (internal::unlikely(sink_ != nullptr))
+      sink_->walk_start(op, state);
+  }
+
+  void entry_read(linear_memory_op const &op,
+                  paging_state const &state,
+                  unsigned level,
+                  uint64_t entry)
+  {
+    if (internal::unlikely(sink_ != nullptr))
+      sink_->level_visit(op, state, level, entry);
+  }
+
+  void ad_update(linear_memory_op const &op,
+                 paging_state const &state,
+                 unsigned level,
+                 bool success)
+  {
+    if (internal::unlikely(sink_ != nullptr))
+      sink_->ad_update(op, state, level, success);
+  }
+
+  void walk_end(linear_memory_op const &op, paging_state const &state, translate_result const &res)
+  {
+    if (internal::unlikely(sink_ != nullptr))
+      if (auto const *pf = std::get_if<page_fault_info>(&res))
+        sink_->fault(op, state, *pf);
+  }
+
+  void tlb_fill(linear_memory_op const &op, paging_state const &state, tlb_entry const &entry)
+  {
+    if (internal::unlikely(sink_ != nullptr))
+      sink_->tlb_fill(op, state, entry);
+  }
+};
+
+// An observer that passes all hooks on to several observers in order, e.g. to
+// count and trace at the same time.
+template <typename... OBSERVERS>
+class observer_list : public walk_observer
+{
+  std::tuple<OBSERVERS...> observers_;
+
+  template <typename FN>
+  void for_each(FN const &fn)
+  {
+    std::apply([&](auto &...observer) { (fn(observer), ...); }, observers_);
+  }
+
+public:
+  template <size_t I>
+  auto &get()
+  {
+    return std::get<I>(observers_);
+  }
+
+  void walk_start(linear_memory_op const &op, paging_state const &state)
+  {
+    for_each([&](auto &o) { o.walk_start(op, state); });
+  }
+
+  void entry_read_start(linear_memory_op const &op, paging_state const &state, unsigned level)
+  {
+    for_each([&](auto &o) { o.entry_read_start(op, state, level); });
+  }
+
+  void entry_read(linear_memory_op const &op,
+                  paging_state const &state,
+                  unsigned level,
+                  uint64_t entry)
+  {
+    for_each([&](auto &o) { o.entry_read(op, state, level, entry); });
+  }
+
+  void ad_update_start(linear_memory_op const &op, paging_state const &state, unsigned level)
+  {
+    for_each([&](auto &o) { o.ad_update_start(op, state, level); });
+  }
+
+  void ad_update(linear_memory_op const &op,
+                 paging_state const &state,
+                 unsigned level,
+                 bool success)
+  {
+    for_each([&](auto &o) { o.ad_update(op, state, level, success); });
+  }
+
+  void walk_end(linear_memory_op const &op, paging_state const &state, translate_result const &res)
+  {
+    for_each([&](auto &o) { o.walk_end(op, state, res); });
+  }
+
+  void tlb_hit(linear_memory_op const &op, paging_state const &state)
+  {
+    for_each([&](auto &o) { o.tlb_hit(op, state); });
+  }
+
+  void tlb_miss(linear_memory_op const &op, paging_state const &state)
+  {
+    for_each([&](auto &o) { o.tlb_miss(op, state); });
+  }
+
+  void tlb_fill(linear_memory_op const &op, paging_state const &state, tlb_entry const &entry)
+  {
+    for_each([&](auto &o) { o.tlb_fill(op, state, entry); });
+  }
+};
+
+}  // namespace vmmu
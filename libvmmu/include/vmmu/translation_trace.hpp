@@ -0,0 +1,295 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+#include <vmmu/vmmu.hpp>
+
+// Translation traces record the linear memory accesses that a guest
+// translates through a TLB, so TLB designs can be compared by replaying the
+// same accesses through them.
+//
+// A trace starts with the 8 bytes of TRACE_MAGIC, followed by records. Each
+// record starts with a tag byte whose low 2 bits select its kind. Numbers are
+// unsigned LEB128 varints. Differences are zigzag encoded before, so small
+// negative differences stay small.
+//
+//   ACCESS: Tag bits 2-3 are the access type and bit 4 is set for implicit
+//           supervisor accesses. The tag is followed by the difference of the
+//           linear address to the one of the previous access.
+//
+//   STATE:  The paging state of the following accesses changed. The tag is
+//           followed by RFLAGS, CR0, CR3, CR4, EFER, the CPL and the 4 PDPTEs
+//           (see trace_state).
+//
+//   ENTRY:  A walk read a page table entry whose value wasn't recorded
+//           before. The tag is followed by the difference of its physical
+//           address to the one of the previous entry and its value.
+//
+//   CR3:    The guest wrote CR3. The tag is followed by the written value
+//           including CR3_NOFLUSH, which the paging state doesn't keep.
+//
+// Entries are recorded before the access whose translation read them. The
+// page tables of a replay thus always have the values the recording saw.
+//
+// Other TLB invalidations, such as INVLPG, are not recorded. Replays flush
+// TLBs like a guest would on recorded CR3 writes and when the recorded state
+// changes otherwise. With PCIDs, CR3 writes must be recorded, because a state
+// change alone doesn't tell whether the guest kept the translations of the
+// new PCID.
+namespace vmmu
+{
+namespace internal
+{
+enum trace_record : uint8_t {
+  TRACE_ACCESS = 0,
+  TRACE_STATE = 1,
+  TRACE_ENTRY = 2,
+  TRACE_CR3 = 3,
+
+  TRACE_KIND_MASK = 3,
+  TRACE_TYPE_SHIFT = 2,
+  TRACE_IMPLICIT = 1U << 4,
+};
+
+inline uint64_t zigzag_encode(uint64_t value)
+{
+  return (value << 1) ^ -(value >> 63);
+}
+
+inline uint64_t zigzag_decode(uint64_t value)
+{
+  return (value >> 1) ^ -(value & 1);
+}
+
+}  // namespace internal
+
+constexpr std::array<uint8_t, 8> TRACE_MAGIC {'V', 'M', 'M', 'U', 'T', 'R', 'C', '1'};
+
+// The register values that make up a paging state. Only the bits that
+// influence paging are kept.
+struct trace_state {
+  uint64_t rflags;
+  uint64_t cr0;
+  uint64_t cr3;
+  uint64_t cr4;
+  uint64_t efer;
+  uint64_t cpl;
+  std::array<uint64_t, 4> pdpte;
+
+  bool operator==(trace_state const &other) const;
+  bool operator!=(trace_state const &other) const { return not(*this == other); }
+
+  static trace_state of(paging_state const &state);
+
+  paging_state to_paging_state() const;
+
+  // Load the registers into an existing paging state. Returns the combination
+  // of paging_state::change flags that tells how TLBs have to be invalidated.
+  unsigned apply(paging_state *state) const;
+};
+
+// A page table entry value as it was read by a walk.
+struct trace_entry {
+  uint64_t phys_addr;
+  uint64_t value;
+};
+
+// A MOV to CR3 with the written value.
+struct trace_cr3_write {
+  uint64_t value;
+};
+
+using trace_event = std::variant<linear_memory_op, trace_state, trace_entry, trace_cr3_write>;
+
+// Encodes translations into a trace.
+//
+// The recorder appends the encoded trace to an in-memory buffer. Callers write
+// the buffer to a file whenever it has grown large enough and discard it
+// afterwards, so traces can be longer than the available memory. Only the
+// page table entries the recorder has seen are kept in memory.
+//
+// Page table entries are only recorded when walks read them, so recording has
+// to start with an empty TLB. translate clears the TLB on its first call.
+class trace_recorder
+{
+  std::vector<uint8_t> buffer_;
+
+  uint64_t linear_addr_ = 0;
+  uint64_t phys_addr_ = 0;
+  std::optional<trace_state> state_;
+  bool started_ = false;
+
+  // The last known value of each page table entry in the trace.
+  std::unordered_map<uint64_t, uint64_t> entries_;
+
+  void put_varint(uint64_t value);
+
+public:
+  // The trace since the last call to discard.
+  std::vector<uint8_t> const &buffer() const { return buffer_; }
+  void discard() { buffer_.clear(); }
+
+  // Record an access. The paging state is only recorded when it changed.
+  void record_access(linear_memory_op const &op, paging_state const &state);
+
+  // Record that a walk read a page table entry. Nothing is recorded, if the
+  // entry has the value that was recorded last.
+  void record_entry(uint64_t phys_addr, uint64_t value);
+
+  // Record a MOV to CR3 with the given value. Callers record CR3 writes
+  // before the translations that use the new value, so replays can flush TLBs
+  // like the guest did.
+  void record_cr3_write(uint64_t value);
+
+  // Remember that a walk updated a page table entry. A replay updates the entry
+  // in the same way, so this doesn't need to be recorded.
+  void entry_updated(uint64_t phys_addr, uint64_t value) { entries_[phys_addr] = value; }
+
+  // Translate an access through a TLB and record it. TLB is tlb<SIZE> or any
+  // other TLB with the same translate and clear methods. The first call clears
+  // the TLB, so every translation it caches was walked while recording.
+  template <typename TLB, typename MEMORY>
+  translate_result translate(TLB *tlb,
+                             linear_memory_op const &op,
+                             paging_state const &state,
+                             MEMORY *memory);
+
+  trace_recorder();
+};
+
+namespace internal
+{
+// Passes page table accesses on to another memory backend and records the
+// entries that walks read.
+template <typename MEMORY>
+class recording_memory
+{
+  MEMORY *memory_;
+  trace_recorder *recorder_;
+
+public:
+  template <typename WORD>
+  WORD read(uint64_t phys_addr, WORD dummy)
+  {
+    WORD const value = memory_->read(phys_addr, dummy);
+
+    recorder_->record_entry(phys_addr, value);
+    return value;
+  }
+
+  template <typename WORD>
+  bool cmpxchg(uint64_t phys_addr, WORD expected, WORD new_value)
+  {
+    bool const success = memory_->cmpxchg(phys_addr, expected, new_value);
+
+    if (success)
+      recorder_->entry_updated(phys_addr, new_value);
+
+    return success;
+  }
+
+  recording_memory(MEMORY *memory, trace_recorder *recorder)
+      : memory_(memory), recorder_(recorder)
+  {
+  }
+};
+
+}  // namespace internal
+
+template <typename TLB, typename MEMORY>
+translate_result trace_recorder::translate(TLB *tlb,
+                                           linear_memory_op const &op,
+                                           paging_state const &state,
+                                           MEMORY *memory)
+{
+  if (not started_) {
+    tlb->clear();
+    started_ = true;
+  }
+
+  internal::recording_memory<MEMORY> recording {memory, this};
+  auto const res = tlb->translate(op, state, &recording);
+
+  record_access(op, state);
+  return res;
+}
+
+// Decodes a trace from memory, for example from a trace file that was mapped
+// with mmap. The reader only moves forward, so the kernel can drop pages of
+// the file that were already read.
+class trace_reader
+{
+  uint8_t const *pos_;
+  uint8_t const *end_;
+
+  uint64_t linear_addr_ = 0;
+  uint64_t phys_addr_ = 0;
+
+  bool error_ = false;
+
+  std::optional<uint64_t> get_varint();
+
+public:
+  // Return the next event or nothing at the end of the trace.
+  std::optional<trace_event> next();
+
+  // Returns true, if the trace has no valid header or ends in the middle of a
+  // record.
+  bool error() const { return error_; }
+
+  trace_reader(uint8_t const *data, size_t size);
+};
+
+// A memory backend for replays. It holds the page table entries that a trace
+// recorded. Entries that were never recorded read as not present.
+class trace_memory final : public abstract_memory
+{
+  std::unordered_map<uint64_t, uint64_t> entries_;
+  uint64_t reads_ = 0;
+
+  template <typename WORD>
+  WORD read_word(uint64_t phys_addr)
+  {
+    reads_++;
+
+    auto const it = entries_.find(phys_addr);
+    return it != entries_.end() ? WORD(it->second) : 0;
+  }
+
+  template <typename WORD>
+  bool cmpxchg_word(uint64_t phys_addr, WORD expected, WORD new_value)
+  {
+    uint64_t &entry = entries_[phys_addr];
+
+    if (WORD(entry) != expected)
+      return false;
+
+    entry = new_value;
+    return true;
+  }
+
+public:
+  // The number of page table entries that walks read so far.
+  uint64_t reads() const { return reads_; }
+
+  void apply(trace_entry const &entry) { entries_[entry.phys_addr] = entry.value; }
+
+  uint64_t read(uint64_t phys_addr, uint64_t) override { return read_word<uint64_t>(phys_addr); }
+  uint32_t read(uint64_t phys_addr, uint32_t) override { return read_word<uint32_t>(phys_addr); }
+
+  bool cmpxchg(uint64_t phys_addr, uint32_t expected, uint32_t new_value) override
+  {
+    return cmpxchg_word(phys_addr, expected, new_value);
+  }
+
+  bool cmpxchg(uint64_t phys_addr, uint64_t expected, uint64_t new_value) override
+  {
+    return cmpxchg_word(phys_addr, expected, new_value);
+  }
+};
+
+}  // namespace vmmu
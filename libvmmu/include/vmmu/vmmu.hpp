@@ -1,9 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cassert>
 #include <cstdint>
 #include <optional>
 #include <variant>
+#include <vector>
 
 #if defined(__clang__)
 #define __VMMU_UBSAN_NO_UNSIGNED_OVERFLOW__ \
@@ -23,6 +26,9 @@ enum {
   CR0_WP = uint64_t(1) << 16,
   CR0_PG = uint64_t(1) << 31,
 
+  CR3_PCID_MASK = uint64_t(0xFFF),
+  CR3_NOFLUSH = uint64_t(1) << 63,  // Only used in MOV to CR3
+
   CR4_PSE = uint64_t(1) << 4,
   CR4_PAE = uint64_t(1) << 5,
   CR4_PGE = uint64_t(1) << 7,
@@ -40,6 +46,7 @@ enum {
   PTE_A = uint64_t(1) << 5,
   PTE_D = uint64_t(1) << 6,
   PTE_PS = uint64_t(1) << 7,
+  PTE_G = uint64_t(1) << 8,
   PTE_XD = uint64_t(1) << 63,
 
   EC_P = uint64_t(1) << 0,     // Page was present
@@ -49,23 +56,120 @@ enum {
   EC_I = uint64_t(1) << 4,     // Access was instruction fetch
 };
 
+namespace internal
+{
+enum class paging_mode : uint8_t {
+  // Paging is disabled.
+  PHYS,
+
+  // Classic 32-bit paging.
+  PM32,
+
+  // 32-bit mode with 64-bit page tables.
+  PM32_PAE,
+
+  // 4-level 64-bit paging,
+  PM64_4LEVEL,
+};
+
+}  // namespace internal
+
+class tlb_entry;
+class abstract_memory;
+class paging_state;
+class paging_structure_cache;
+struct linear_memory_op;
+struct page_fault_info;
+
+using translate_result = std::variant<std::monostate, tlb_entry, page_fault_info>;
+
+namespace internal
+{
+// A page table walk for a specific paging mode.
+using walker_fn = translate_result (*)(linear_memory_op const &,
+                                       paging_state const &,
+                                       abstract_memory *,
+                                       paging_structure_cache *);
+
+}  // namespace internal
+
 // Contains CPU state necessary for page table walks. See Intel SDM Vol. 3 4.1
 // "Paging Modes and Control Bits".
+//
+// The control bits are packed into a single word. Everything that is derived
+// from them, i.e. the paging mode, the page table walker and the access
+// rights, is computed when they change, so translations don't have to.
 class paging_state
 {
+public:
+  // The setters for control registers return a combination of these flags to
+  // describe what changed. Callers use them to decide whether to invalidate
+  // TLBs. See Intel SDM Vol. 3 4.10.4.1 "Operations that Invalidate TLBs and
+  // Paging-Structure Caches".
+  enum change : unsigned {
+    // The paging mode changed (CR0.PG, CR4.PAE or EFER.LME).
+    CHANGE_MODE = 1U << 0,
+
+    // CR3 changed, i.e. the address space or the PCID.
+    CHANGE_CR3 = 1U << 1,
+
+    // CR0.WP, CR4.SMEP, CR4.SMAP or EFER.NXE changed. TLBs in this library
+    // check access rights on every hit and don't need to be invalidated.
+    CHANGE_ACCESS_RIGHTS = 1U << 2,
+
+    // CR4.PSE, CR4.PGE or CR4.PCIDE changed how page tables are interpreted or
+    // how translations are tagged.
+    CHANGE_TRANSLATION = 1U << 3,
+  };
+
+private:
+  // Bits in the flags word. AC and the supervisor bit are the lowest bits, so
+  // they can index the permission table directly.
+  enum : uint32_t {
+    FLAG_RFLAGS_AC = 1U << 0,
+    FLAG_SUPERVISOR = 1U << 1,
+    FLAG_CR0_WP = 1U << 2,
+    FLAG_CR0_PG = 1U << 3,
+    FLAG_CR4_PSE = 1U << 4,
+    FLAG_CR4_PAE = 1U << 5,
+    FLAG_CR4_PGE = 1U << 6,
+    FLAG_CR4_PCIDE = 1U << 7,
+    FLAG_CR4_SMEP = 1U << 8,
+    FLAG_CR4_SMAP = 1U << 9,
+    FLAG_EFER_LME = 1U << 10,
+    FLAG_EFER_NXE = 1U << 11,
+
+    FLAGS_CR0 = FLAG_CR0_WP | FLAG_CR0_PG,
+    FLAGS_CR4 = FLAG_CR4_PSE | FLAG_CR4_PAE | FLAG_CR4_PGE | FLAG_CR4_PCIDE | FLAG_CR4_SMEP |
+                FLAG_CR4_SMAP,
+    FLAGS_EFER = FLAG_EFER_LME | FLAG_EFER_NXE,
+  };
+
   uint64_t cr3;
   std::array<uint64_t, 4> pdpte;
 
-  bool cr0_wp, cr0_pg;
+  uint32_t flags;
+  internal::paging_mode mode;
+  internal::walker_fn walker;
 
-  bool cr4_pse, cr4_pae;
-  bool cr4_smep, cr4_smap;
+  // Bit i is set, if accesses with permission index i are allowed. See
+  // internal::permission_index. The table has an entry for each combination of
+  // RFLAGS.AC and supervisor mode and permissions is the currently valid one.
+  std::array<uint64_t, 4> permission_table;
+  uint64_t permissions;
 
-  bool efer_lme, efer_nxe;
+  bool has(uint32_t flag) const { return flags & flag; }
 
-  bool rflags_ac;
+  void set_flag(uint32_t flag, bool value)
+  {
+    flags = (flags & ~flag) | (value ? flag : 0);
+    permissions = permission_table[flags & (FLAG_RFLAGS_AC | FLAG_SUPERVISOR)];
+  }
 
-  bool cpl_is_supervisor;
+  // Replace the flags selected by the mask and recompute what depends on
+  // them. Returns a combination of change flags.
+  unsigned update_flags(uint32_t mask, uint32_t new_flags);
+  void recompute();
 
 public:
   uint64_t get_pdpte(size_t i) const
@@ -75,21 +179,53 @@ public:
 
   uint64_t get_cr3() const { return cr3; }
 
-  bool get_cr0_wp() const { return cr0_wp; }
-  bool get_cr0_pg() const { return cr0_pg; }
+  bool get_cr0_wp() const { return has(FLAG_CR0_WP); }
+  bool get_cr0_pg() const { return has(FLAG_CR0_PG); }
 
-  bool get_cr4_pse() const { return cr4_pse; }
-  bool get_cr4_pae() const { return cr4_pae; }
-  bool get_cr4_smep() const { return cr4_smep; }
-  bool get_cr4_smap() const { return cr4_smap; }
+  bool get_cr4_pse() const { return has(FLAG_CR4_PSE); }
+  bool get_cr4_pae() const { return has(FLAG_CR4_PAE); }
+  bool get_cr4_pge() const { return has(FLAG_CR4_PGE); }
+  bool get_cr4_pcide() const { return has(FLAG_CR4_PCIDE); }
+  bool get_cr4_smep() const { return has(FLAG_CR4_SMEP); }
+  bool get_cr4_smap() const { return has(FLAG_CR4_SMAP); }
 
-  bool get_efer_lme() const { return efer_lme; }
-  bool get_efer_nxe() const { return efer_nxe; }
-  bool get_rflags_ac() const { return rflags_ac; }
+  bool get_efer_lme() const { return has(FLAG_EFER_LME); }
+  bool get_efer_nxe() const { return has(FLAG_EFER_NXE); }
+  bool get_rflags_ac() const { return has(FLAG_RFLAGS_AC); }
+
+  // Returns the current process-context identifier. See Intel SDM Vol. 3
+  // 4.10.1 "Process-Context Identifiers (PCIDs)".
+  uint16_t get_pcid() const { return get_cr4_pcide() ? uint16_t(cr3 & CR3_PCID_MASK) : 0; }
 
   // This returns whether the CPL indicates supervisor mode. This is unrelated
   // to implicit supervisor accesses.
-  bool is_supervisor() const { return cpl_is_supervisor; }
+  bool is_supervisor() const { return has(FLAG_SUPERVISOR); }
+
+  internal::paging_mode get_paging_mode() const { return mode; }
+
+  // The page table walk for the current paging mode.
+  internal::walker_fn get_walker() const { return walker; }
+
+  // Returns whether an access with the given permission index is allowed in
+  // this state.
+  bool permits(unsigned index) const { return permissions >> index & 1; }
+
+  // Update control registers. Only the bits that influence paging are
+  // considered. See enum change for the return values.
+  unsigned set_cr0(uint64_t cr0_);
+  unsigned set_cr3(uint64_t cr3_);
+  unsigned set_cr4(uint64_t cr4_);
+  unsigned set_efer(uint64_t efer_);
+
+  // The PDPTEs are only used with PAE paging. Callers load them whenever the
+  // CPU would. See Intel SDM Vol. 3 4.4.1 "PDPTE Registers".
+  void set_pdpte(decltype(pdpte) const &pdpte_) { pdpte = pdpte_; }
+
+  // Changes of the CPL and RFLAGS.AC (e.g. by STAC and CLAC) are frequent and
+  // never require TLB invalidation. They only select another precomputed set
+  // of access rights.
+  void set_rflags(uint64_t rflags_) { set_flag(FLAG_RFLAGS_AC, rflags_ & RFLAGS_AC); }
+  void set_cpl(unsigned cpl_) { set_flag(FLAG_SUPERVISOR, cpl_ != 3); }
 
   paging_state() = delete;
 
@@ -105,8 +241,8 @@ public:
 // A wrapper for TLB entry permissions.
 class tlb_attr
 {
-  // Stores PTE_W, PTE_U, PTE_XD, and PTE_D. The last two are stored inverted to
-  // allow for combining attributes with a single AND operation.
+  // Stores PTE_W, PTE_U, PTE_XD, PTE_D, and PTE_G. The last three are stored
+  // inverted to allow for combining attributes with a single AND operation.
   uint64_t pte;
 
 public:
@@ -114,6 +250,7 @@ public:
   bool is_u() const { return pte & PTE_U; }
   bool is_xd() const { return ~pte & PTE_XD; }
   bool is_d() const { return ~pte & PTE_D; }
+  bool is_g() const { return ~pte & PTE_G; }
 
   void set_d() { pte &= ~PTE_D; }
 
@@ -130,10 +267,10 @@ public:
   // page table walks.
   static tlb_attr no_paging() { return tlb_attr {PTE_W | PTE_U | PTE_D}; }
 
-  explicit tlb_attr(uint64_t pte_) : pte(pte_ ^ (PTE_D | PTE_XD)) {}
+  explicit tlb_attr(uint64_t pte_) : pte(pte_ ^ (PTE_D | PTE_XD | PTE_G)) {}
 
-  tlb_attr(bool w_, bool u_, bool xd_, bool d_)
-      : tlb_attr(PTE_W * w_ | PTE_U * u_ | PTE_XD * xd_ | PTE_D * d_)
+  tlb_attr(bool w_, bool u_, bool xd_, bool d_, bool g_ = false)
+      : tlb_attr(PTE_W * w_ | PTE_U * u_ | PTE_XD * xd_ | PTE_D * d_ | PTE_G * g_)
   {
   }
 
@@ -165,6 +302,38 @@ struct linear_memory_op {
                    supervisor_type sv_type_ = supervisor_type::EXPLICIT);
 };
 
+namespace internal
+{
+// Access rights only depend on the paging state, the XD, U and W attributes of
+// the translation, the access type and whether the access is an implicit
+// supervisor access. The permission index encodes everything except the paging
+// state:
+//
+//   Bit 0:   XD attribute
+//   Bit 1:   W attribute
+//   Bit 2:   U attribute
+//   Bit 3:   Implicit supervisor access
+//   Bit 4-5: Access type
+//
+// The paging state precomputes whether each of the indexes is allowed.
+enum : unsigned {
+  PERM_XD = 1U << 0,
+  PERM_W = 1U << 1,
+  PERM_U = 1U << 2,
+  PERM_IMPLICIT = 1U << 3,
+  PERM_TYPE_SHIFT = 4,
+
+  PERM_INDEXES = 3U << PERM_TYPE_SHIFT,
+};
+
+inline unsigned permission_index(linear_memory_op const &op, tlb_attr const &attr)
+{
+  return PERM_XD * attr.is_xd() | PERM_W * attr.is_w() | PERM_U * attr.is_u() |
+         PERM_IMPLICIT * op.is_implicit_supervisor() | unsigned(op.type) << PERM_TYPE_SHIFT;
+}
+
+}  // namespace internal
+
 // A TLB entry for an power-of-2 naturally aligned linear memory region.
 class tlb_entry
 {
@@ -195,12 +364,33 @@ public:
   // Returns true, if this TLB entry translates the given operation in the
   // current paging mode. See Intel SDM Vol 3 4.6.1 "Determination of Access
   // Rights" for details.
-  bool allows(linear_memory_op const &op, paging_state const &state) const;
+  bool allows(linear_memory_op const &op, paging_state const &state) const
+  {
+    return state.permits(internal::permission_index(op, attr()));
+  }
+
+  // Returns true, if a TLB can use this entry for the given operation without
+  // walking the page table. Writes to entries that are not dirty yet need a
+  // page table walk to set the dirty bit.
+  bool hits(linear_memory_op const &op, paging_state const &state) const
+  {
+    return translate(op.linear_addr) and (not op.is_write() or attr().is_d()) and
+           allows(op, state);
+  }
 
   // For non-paged mode, we create a TLB that covers everything and allows
   // everything.
   static tlb_entry no_paging() { return {0, 0, 63, tlb_attr::no_paging()}; }
 
+  // Entries can cover at most half of the address space, so non-paged
+  // translations use the half that contains the given linear address.
+  static tlb_entry no_paging(uint64_t linear_addr)
+  {
+    uint64_t const half = linear_addr & (uint64_t(1) << 63);
+
+    return {half, half, 63, tlb_attr::no_paging()};
+  }
+
   tlb_entry() = delete;
 
   tlb_entry(uint64_t linear_addr, uint64_t phys_addr, uint8_t size_bits, tlb_attr attr);
@@ -216,6 +406,21 @@ public:
   virtual bool cmpxchg(uint64_t phys_addr, uint32_t expected, uint32_t new_value) = 0;
   virtual bool cmpxchg(uint64_t phys_addr, uint64_t expected, uint64_t new_value) = 0;
 
+  // Optionally return a host pointer to the naturally aligned page table entry
+  // at the given physical address. The page table walker then reads the entry
+  // and updates accessed and dirty flags with host atomic operations through
+  // the pointer instead of looking up the location again for cmpxchg.
+  //
+  // Backends that return nullptr are accessed via read and cmpxchg.
+  virtual uint64_t *entry_pointer(uint64_t /* phys_addr */, uint64_t /* dummy */)
+  {
+    return nullptr;
+  }
+  virtual uint32_t *entry_pointer(uint64_t /* phys_addr */, uint32_t /* dummy */)
+  {
+    return nullptr;
+  }
+
   virtual ~abstract_memory() {}
 };
 
@@ -227,56 +432,979 @@ struct page_fault_info {
   page_fault_info(uint64_t cr2_, uint32_t error_code_) : cr2(cr2_), error_code(error_code_) {}
 };
 
-using translate_result = std::variant<std::monostate, tlb_entry, page_fault_info>;
+// Tracks cache flushes with generation numbers, so flushes take constant time
+// regardless of the number of cached entries.
+//
+// Cached entries are stamped with the generation that was current when they
+// were inserted. A flush remembers the current generation and starts a new
+// one. An entry is valid as long as its stamp is newer than all flushes that
+// cover it. Stamp 0 is never valid.
+//
+// PCID flushes are tracked for groups of PCIDs, so a flush may also invalidate
+// entries of other PCIDs. This is fine, because caches may drop entries at any
+// time.
+class tlb_generations
+{
+  static constexpr size_t PCID_GROUPS = 64;
+
+  uint64_t current_ = 1;
+  uint64_t flushed_all_ = 0;
+  uint64_t flushed_non_global_ = 0;
+  std::array<uint64_t, PCID_GROUPS> flushed_pcid_ {};
+
+public:
+  // The stamp for newly inserted entries.
+  uint64_t current() const { return current_; }
+
+  void flush_all() { flushed_all_ = current_++; }
+  void flush_non_global() { flushed_non_global_ = current_++; }
+  void flush_pcid(uint16_t pcid) { flushed_pcid_[pcid % PCID_GROUPS] = current_++; }
+
+  // Entries of the given PCID are valid, if their stamp is larger than the
+  // returned value.
+  uint64_t valid_after(uint16_t pcid, bool global) const
+  {
+    if (global)
+      return flushed_all_;
+
+    return std::max({flushed_all_, flushed_non_global_, flushed_pcid_[pcid % PCID_GROUPS]});
+  }
+
+  bool is_valid(uint64_t stamp, uint16_t pcid, bool global) const
+  {
+    return stamp > valid_after(pcid, global);
+  }
+};
+
+// Caches for the non-leaf entries of 4-level page tables. See Intel SDM Vol. 3
+// 4.10.3 "Paging-Structure Caches".
+//
+// For a prefix of the linear address, each cache remembers the base of the
+// next page table and the combined attributes of all entries on the way to it.
+// A page table walk can then skip the levels above the lowest cached entry.
+// The caches are direct-mapped.
+class paging_structure_cache
+{
+public:
+  struct entry {
+    uint64_t next_table;
+    tlb_attr attr;
+  };
+
+private:
+  template <size_t SIZE, unsigned ORDER>
+  class level_cache
+  {
+    struct tagged_entry {
+      uint64_t tag = 0;
+      uint16_t pcid = 0;
+      uint64_t generation = 0;
+      entry value;
+    };
+
+    std::array<tagged_entry, SIZE> entries_;
+
+    // Only bits 47:ORDER of the linear address select the entry.
+    static uint64_t tag(uint64_t linear_addr)
+    {
+      return (linear_addr & ((uint64_t(1) << 48) - 1)) >> ORDER;
+    }
+
+  public:
+    std::optional<entry> lookup(uint64_t linear_addr,
+                                uint16_t pcid,
+                                tlb_generations const &generations) const
+    {
+      auto const &e = entries_[tag(linear_addr) % SIZE];
+
+      if (e.tag == tag(linear_addr) and e.pcid == pcid and
+          generations.is_valid(e.generation, pcid, false))
+        return e.value;
+
+      return {};
+    }
+
+    void insert(uint64_t linear_addr, uint16_t pcid, uint64_t generation, entry const &value)
+    {
+      entries_[tag(linear_addr) % SIZE] = tagged_entry {tag(linear_addr), pcid, generation, value};
+    }
+  };
+
+  level_cache<4, 39> pml4e_;
+  level_cache<8, 30> pdpte_;
+  level_cache<32, 21> pde_;
+
+  tlb_generations generations_;
+
+public:
+  // Look up the cached entries of the respective level that map the given
+  // linear address in the address space of the given PCID.
+  std::optional<entry> lookup_pml4e(uint64_t linear_addr, uint16_t pcid) const
+  {
+    return pml4e_.lookup(linear_addr, pcid, generations_);
+  }
+  std::optional<entry> lookup_pdpte(uint64_t linear_addr, uint16_t pcid) const
+  {
+    return pdpte_.lookup(linear_addr, pcid, generations_);
+  }
+  std::optional<entry> lookup_pde(uint64_t linear_addr, uint16_t pcid) const
+  {
+    return pde_.lookup(linear_addr, pcid, generations_);
+  }
+
+  // Cache a non-leaf entry. The order is the lowest bit of the linear address
+  // that was used to index the table that contains the entry, i.e. 39 for
+  // PML4 entries, 30 for PDPT entries and 21 for PD entries.
+  void insert(unsigned order, uint64_t linear_addr, uint16_t pcid, entry const &value)
+  {
+    switch (order) {
+    case 39:
+      pml4e_.insert(linear_addr, pcid, generations_.current(), value);
+      break;
+    case 30:
+      pdpte_.insert(linear_addr, pcid, generations_.current(), value);
+      break;
+    case 21:
+      pde_.insert(linear_addr, pcid, generations_.current(), value);
+      break;
+    }
+  }
+
+  // Remove all entries that belong to the given PCID. There are no global
+  // paging-structure cache entries.
+  void invalidate_pcid(uint16_t pcid) { generations_.flush_pcid(pcid); }
+
+  void clear() { generations_.flush_all(); }
+};
+
+// Hooks that translations call while they walk page tables or look up TLBs.
+// They all do nothing here.
+//
+// Observers, such as translation_stats, derive from this class and hide the
+// hooks they are interested in. Hooks are resolved at compile time, so the
+// empty ones don't cost anything. Page table levels are numbered as in the
+// SDM, from 1 for page tables up to 4 for PML4 tables.
+struct walk_observer {
+  // A translation starts. Retries after races with page table updates are
+  // part of the same translation.
+  void walk_start(linear_memory_op const &, paging_state const &) {}
+
+  // The walk is about to read a page table entry of the given level and has
+  // read it.
+  void entry_read_start(linear_memory_op const &, paging_state const &, unsigned /* level */) {}
+  void entry_read(linear_memory_op const &,
+                  paging_state const &,
+                  unsigned /* level */,
+                  uint64_t /* entry */)
+  {
+  }
+
+  // The walk is about to set the accessed or dirty flag in a page table entry
+  // of the given level and has tried to. If this didn't succeed, the walk is
+  // retried.
+  void ad_update_start(linear_memory_op const &, paging_state const &, unsigned /* level */) {}
+  void ad_update(linear_memory_op const &,
+                 paging_state const &,
+                 unsigned /* level */,
+                 bool /* success */)
+  {
+  }
+
+  // The translation finished with a TLB entry or a page fault.
+  void walk_end(linear_memory_op const &, paging_state const &, translate_result const &) {}
+
+  // A TLB lookup found an entry or needs a page table walk.
+  void tlb_hit(linear_memory_op const &, paging_state const &) {}
+  void tlb_miss(linear_memory_op const &, paging_state const &) {}
+
+  // A TLB cached the result of a page table walk.
+  void tlb_fill(linear_memory_op const &, paging_state const &, tlb_entry const &) {}
+};
 
 // Translate a linear memory access given a state of the virtual CPU.
 //
 // Will return either a TLB entry that translates the operation and where it is
 // also guaranteed that the operation is allowed, or it returns page fault
 // information.
+//
+// If a paging-structure cache is passed, 4-level page table walks start at
+// the lowest cached level and fill the cache on the way. As with a real CPU,
+// the cache has to be cleared when page table entries change.
+translate_result translate(linear_memory_op const &op,
+                           paging_state const &state,
+                           abstract_memory *memory,
+                           paging_structure_cache *psc = nullptr);
+
+// The same as above for a memory backend whose type is known at compile time.
+// The walk is then specialized for the backend and its accesses can be
+// inlined.
+//
+// MEMORY must provide read and cmpxchg methods with the same signatures as
+// abstract_memory. It may also provide entry_pointer, but doesn't need to
+// derive from abstract_memory.
+template <typename MEMORY>
+translate_result translate(linear_memory_op const &op,
+                           paging_state const &state,
+                           MEMORY *memory,
+                           paging_structure_cache *psc = nullptr);
+
+// The same as above, but the hooks of the given observer are called during
+// the translation. See walk_observer.
+template <typename MEMORY, typename OBSERVER>
 translate_result translate(linear_memory_op const &op,
                            paging_state const &state,
-                           abstract_memory *memory);
+                           MEMORY *memory,
+                           paging_structure_cache *psc,
+                           OBSERVER *observer);
+
+// A physically contiguous part of a linear memory range.
+struct phys_segment {
+  uint64_t phys_addr;
+  uint64_t length;
+};
+
+// Translate length bytes of linear memory starting at op.linear_addr with the
+// access type of op into the physical segments that back them. The segments
+// replace the content of the given vector, which callers can reuse to avoid
+// allocations. Neighboring pages that are also physically contiguous are
+// merged into a single segment.
+//
+// Ranges end at the top of the linear address space and don't wrap around.
+//
+// Returns the page fault of the first inaccessible page, if there is one. The
+// segments then describe the part of the range before that page. Like a string
+// instruction that faults in the middle, these pages may already have their
+// accessed and dirty bits set. Upper levels of the page table are shared
+// between walks as in translate_batch.
+std::optional<page_fault_info> translate_range(linear_memory_op const &op,
+                                               uint64_t length,
+                                               paging_state const &state,
+                                               abstract_memory *memory,
+                                               std::vector<phys_segment> &segments,
+                                               paging_structure_cache *psc = nullptr);
+
+template <typename MEMORY>
+std::optional<page_fault_info> translate_range(linear_memory_op const &op,
+                                               uint64_t length,
+                                               paging_state const &state,
+                                               MEMORY *memory,
+                                               std::vector<phys_segment> &segments,
+                                               paging_structure_cache *psc = nullptr);
+
+// Translate count operations at once and store the results in the results
+// array, which must have room for count entries.
+//
+// The results are the same as those of a TLB that translates the operations
+// in order without any invalidation in between: Operations that fall into the
+// page of the last successful translation reuse it, if it permits them, and
+// the paging mode is determined only once. Pages that are translated again
+// after other pages are walked again. Walks for pages
+// in the same page table as the previous walk only read their page table
+// entry. If a paging-structure cache is passed, 4-level walks use it instead.
+void translate_batch(linear_memory_op const *ops,
+                     size_t count,
+                     paging_state const &state,
+                     abstract_memory *memory,
+                     translate_result *results,
+                     paging_structure_cache *psc = nullptr);
+
+template <typename MEMORY>
+void translate_batch(linear_memory_op const *ops,
+                     size_t count,
+                     paging_state const &state,
+                     MEMORY *memory,
+                     translate_result *results,
+                     paging_structure_cache *psc = nullptr);
+
+namespace internal
+{
+// Translate a batch of operations with the given translation function. An
+// operation that hits the last successful translation is not passed to it.
+template <typename FN>
+void translate_each(linear_memory_op const *ops,
+                    size_t count,
+                    paging_state const &state,
+                    translate_result *results,
+                    FN const &translate_one)
+{
+  std::optional<tlb_entry> last;
+
+  for (size_t i = 0; i < count; i++) {
+    if (last and last->hits(ops[i], state)) {
+      results[i] = *last;
+      continue;
+    }
+
+    results[i] = translate_one(ops[i]);
+
+    if (auto const *entry = std::get_if<tlb_entry>(&results[i]))
+      last = *entry;
+  }
+}
+
+// Translate a linear memory range page by page with the given translation
+// function.
+template <typename FN>
+std::optional<page_fault_info> translate_pages(linear_memory_op const &op,
+                                               uint64_t length,
+                                               std::vector<phys_segment> &segments,
+                                               FN const &translate_one)
+{
+  segments.clear();
+
+  for (uint64_t linear_addr = op.linear_addr; length != 0;) {
+    auto const res = translate_one(linear_memory_op {linear_addr, op.type, op.sv_type});
+
+    if (auto const *pf = std::get_if<page_fault_info>(&res))
+      return *pf;
+
+    tlb_entry const &entry = std::get<tlb_entry>(res);
+    auto const phys_addr = entry.translate(linear_addr);
+
+    // Translations always cover the page they were made for, so every
+    // iteration makes progress.
+    assert(phys_addr);
+
+    uint64_t const chunk = std::min(length, entry.size() - (linear_addr - entry.linear_addr()));
+
+    if (not segments.empty() and
+        segments.back().phys_addr + segments.back().length == *phys_addr)
+      segments.back().length += chunk;
+    else
+      segments.push_back({*phys_addr, chunk});
+
+    linear_addr += chunk;
+    length -= chunk;
+
+    if (linear_addr == 0)
+      break;
+  }
+
+  return {};
+}
+
+}  // namespace internal
 
 // A very primitive fully associative TLB.
 //
 // Entries are inserted in FIFO order and we look through all cached entries to
-// find a match.
-template <size_t SIZE>
+// find a match. Lookups and page table walks are reported to an OBSERVER (see
+// walk_observer), which does nothing by default.
+template <size_t SIZE, typename OBSERVER = walk_observer>
 class tlb
 {
   size_t pos_ = 0;
+  OBSERVER observer_;
+
+  // Entries are only valid, if they were inserted in the current generation.
+  // This makes clearing the TLB cheap.
+  uint64_t generation_ = 1;
+
+  struct stamped_entry {
+    tlb_entry entry = tlb_entry::no_paging();
+    uint64_t generation = 0;
+  };
 
   static_assert(SIZE > 1);
-  std::array<std::optional<tlb_entry>, SIZE> entries_;
+  std::array<stamped_entry, SIZE> entries_;
 
 public:
+  OBSERVER &observer() { return observer_; }
+  OBSERVER const &observer() const { return observer_; }
+
   // Reset the TLB to its pristine (empty) state.
-  void clear() { *this = {}; }
+  void clear() { generation_++; }
 
   // This method is semantically identical to the function with the same name
   // above. It just caches its results in the TLB.
-  //
-  // TODO Write tests.
+  template <typename MEMORY>
   translate_result __VMMU_UBSAN_NO_UNSIGNED_OVERFLOW__ translate(linear_memory_op const &op,
                                                                  paging_state const &state,
-                                                                 abstract_memory *memory)
+                                                                 MEMORY *memory)
   {
     for (size_t i = 0; i < entries_.size(); i++) {
-      auto const &entry = entries_[(pos_ + i) % entries_.size()];
+      auto const &stamped = entries_[(pos_ + i) % entries_.size()];
+      auto const &entry = stamped.entry;
 
-      if (entry and entry->translate(op.linear_addr) and entry->allows(op, state))
-        return *entry;
+      if (stamped.generation == generation_ and entry.hits(op, state)) {
+        observer_.tlb_hit(op, state);
+        return entry;
+      }
     }
 
-    auto res = ::vmmu::translate(op, state, memory);
+    observer_.tlb_miss(op, state);
+
+    auto res = ::vmmu::translate(op, state, memory, nullptr, &observer_);
 
     if (std::holds_alternative<tlb_entry>(res)) {
-      entries_[--pos_ % entries_.size()] = std::get<tlb_entry>(res);
+      entries_[--pos_ % entries_.size()] = {std::get<tlb_entry>(res), generation_};
+      observer_.tlb_fill(op, state, std::get<tlb_entry>(res));
+    }
+
+    return res;
+  }
+
+  // Translate a batch of operations. See vmmu::translate_batch.
+  template <typename MEMORY>
+  void translate_batch(linear_memory_op const *ops,
+                       size_t count,
+                       paging_state const &state,
+                       MEMORY *memory,
+                       translate_result *results)
+  {
+    internal::translate_each(ops, count, state, results, [&](linear_memory_op const &op) {
+      return translate(op, state, memory);
+    });
+  }
+
+  // Translate a linear memory range. See vmmu::translate_range.
+  template <typename MEMORY>
+  std::optional<page_fault_info> translate_range(linear_memory_op const &op,
+                                                 uint64_t length,
+                                                 paging_state const &state,
+                                                 MEMORY *memory,
+                                                 std::vector<phys_segment> &segments)
+  {
+    return internal::translate_pages(op, length, segments, [&](linear_memory_op const &page_op) {
+      return translate(page_op, state, memory);
+    });
+  }
+};
+
+// The types of invalidation of the INVPCID instruction. See the INVPCID
+// instruction reference in Intel SDM Vol. 2.
+enum class invpcid_type : uint8_t {
+  INDIVIDUAL_ADDRESS = 0,
+  SINGLE_CONTEXT = 1,
+  ALL_CONTEXT_INCLUDING_GLOBAL = 2,
+  ALL_CONTEXT = 3,
+};
+
+// Invalidate the translations that a MOV to CR3 with the given value
+// invalidates. See Intel SDM Vol. 3 4.10.4.1 "Operations that Invalidate TLBs
+// and Paging-Structure Caches".
+//
+// Without PCIDs, all translations are tagged with PCID 0 and are invalidated.
+// With PCIDs, only the translations of the new PCID are invalidated and only,
+// if bit 63 of the value is clear. Global translations are never invalidated.
+template <typename TLB>
+void invalidate_cr3_write(TLB *tlb, uint64_t value, paging_state const &state)
+{
+  if (not state.get_cr4_pcide()) {
+    tlb->invalidate_pcid(0);
+  } else if (not(value & CR3_NOFLUSH)) {
+    tlb->invalidate_pcid(uint16_t(value & CR3_PCID_MASK));
+  }
+}
+
+// Invalidate the translations that INVPCID invalidates.
+template <typename TLB>
+void invalidate_invpcid(TLB *tlb, invpcid_type type, uint16_t pcid, uint64_t linear_addr)
+{
+  switch (type) {
+  case invpcid_type::INDIVIDUAL_ADDRESS:
+    tlb->invalidate_addresses(linear_addr, linear_addr, pcid, false);
+    break;
+  case invpcid_type::SINGLE_CONTEXT:
+    tlb->invalidate_pcid(pcid);
+    break;
+  case invpcid_type::ALL_CONTEXT_INCLUDING_GLOBAL:
+    tlb->clear();
+    break;
+  case invpcid_type::ALL_CONTEXT:
+    tlb->invalidate_non_global();
+    break;
+  }
+}
+
+// Invalidate the translations for length bytes starting at linear_addr in the
+// current PCID. This has the same effect as executing INVLPG for each page in
+// the range, i.e. global translations are invalidated as well.
+template <typename TLB>
+void invalidate_linear_range(TLB *tlb,
+                             uint64_t linear_addr,
+                             uint64_t length,
+                             paging_state const &state)
+{
+  if (length == 0)
+    return;
+
+  // Don't wrap around at the end of the address space.
+  uint64_t const last = length - 1 > ~linear_addr ? ~uint64_t(0) : linear_addr + (length - 1);
+
+  tlb->invalidate_addresses(linear_addr, last, state.get_pcid(), true);
+}
+
+// The storage of a set-associative TLB with tree pseudo-LRU replacement.
+//
+// The set is selected by hashing the linear page number at INDEX_ORDER
+// granularity. Entries for larger pages are stored in the set of the linear
+// address that caused them to be inserted, so they may end up in multiple sets.
+// Entries are tagged with the PCID that was current when they were created.
+// Global entries match regardless of the PCID.
+//
+// ENTRY is tlb_entry or a type that wraps it with additional conditions for a
+// hit. It has to provide the same accessors as tlb_entry.
+template <size_t SETS, size_t WAYS, unsigned INDEX_ORDER = 12, typename ENTRY = tlb_entry>
+class tlb_array
+{
+  static_assert(SETS > 0 and (SETS & (SETS - 1)) == 0, "SETS must be a power of 2");
+  static_assert(WAYS > 0 and WAYS <= 64 and (WAYS & (WAYS - 1)) == 0,
+                "WAYS must be a power of 2 and at most 64");
+
+  static constexpr unsigned SET_BITS = __builtin_ctzll(SETS);
+
+  struct tagged_entry {
+    ENTRY entry = ENTRY::no_paging();
+    uint16_t pcid = 0;
+    uint64_t generation = 0;
+  };
+
+  struct tlb_set {
+    std::array<tagged_entry, WAYS> ways;
+
+    // The nodes of a binary tree that has the ways as leaves. Node i has the
+    // children 2i + 1 and 2i + 2. A set bit points to the right subtree, which
+    // is where the next victim is found.
+    uint64_t plru = 0;
+  };
+
+  std::array<tlb_set, SETS> sets_;
+  tlb_generations generations_;
+
+  // The generation in which the last entry was inserted that is larger than
+  // the index granularity. As long as no such entry can be valid, an address
+  // can only be cached in one set.
+  uint64_t spilled_generation_ = 0;
+
+  static bool is_spilled(ENTRY const &entry) { return entry.size() > (1ULL << INDEX_ORDER); }
+
+  static size_t set_index(uint64_t linear_addr)
+  {
+    uint64_t const page = linear_addr >> INDEX_ORDER;
+
+    // Fold the upper bits of the page number into the index, so large strides
+    // don't all end up in the same set.
+    return (page ^ (page >> SET_BITS) ^ (page >> 2 * SET_BITS)) & (SETS - 1);
+  }
+
+  // Mark a way as most recently used by pointing all nodes on its path away
+  // from it.
+  static void touch(tlb_set &set, size_t way)
+  {
+    for (size_t node = way + WAYS - 1; node != 0;) {
+      size_t const parent = (node - 1) / 2;
+
+      if (node == 2 * parent + 1)
+        set.plru |= uint64_t(1) << parent;
+      else
+        set.plru &= ~(uint64_t(1) << parent);
+
+      node = parent;
+    }
+  }
+
+  bool is_valid(tagged_entry const &tagged) const
+  {
+    return generations_.is_valid(tagged.generation, tagged.pcid, tagged.entry.attr().is_g());
+  }
+
+  size_t victim(tlb_set const &set) const
+  {
+    for (size_t way = 0; way < WAYS; way++)
+      if (not is_valid(set.ways[way]))
+        return way;
+
+    size_t node = 0;
+
+    while (node < WAYS - 1)
+      node = 2 * node + 1 + ((set.plru >> node) & 1);
+
+    return node - (WAYS - 1);
+  }
+
+  template <typename PRED>
+  void remove_if(tlb_set &set, PRED const &pred)
+  {
+    for (auto &tagged : set.ways)
+      if (is_valid(tagged) and pred(tagged))
+        tagged.generation = 0;
+  }
+
+  template <typename PRED>
+  void remove_if(PRED const &pred)
+  {
+    for (auto &set : sets_)
+      remove_if(set, pred);
+  }
+
+public:
+  // Invalidate all entries.
+  void clear() { generations_.flush_all(); }
+
+  // Return an entry that can be used for the given operation without a page
+  // table walk.
+  std::optional<ENTRY> lookup(linear_memory_op const &op, paging_state const &state)
+  {
+    tlb_set &set = sets_[set_index(op.linear_addr)];
+
+    uint16_t const pcid = state.get_pcid();
+    uint64_t const valid_after = generations_.valid_after(pcid, false);
+    uint64_t const global_valid_after = generations_.valid_after(pcid, true);
+
+    for (size_t way = 0; way < WAYS; way++) {
+      auto const &tagged = set.ways[way];
+      bool const is_global = tagged.entry.attr().is_g();
+
+      if ((is_global ? tagged.generation > global_valid_after
+                     : tagged.pcid == pcid and tagged.generation > valid_after) and
+          tagged.entry.hits(op, state)) {
+        touch(set, way);
+        return tagged.entry;
+      }
+    }
+
+    return {};
+  }
+
+  // Cache an entry that was created for an access to linear_addr. An older
+  // entry for the same page is replaced.
+  void insert(uint64_t linear_addr, uint16_t pcid, ENTRY const &entry)
+  {
+    tlb_set &set = sets_[set_index(linear_addr)];
+    size_t way = 0;
+
+    for (; way < WAYS; way++) {
+      auto const &old = set.ways[way];
+
+      if (is_valid(old) and (old.pcid == pcid or old.entry.attr().is_g()) and
+          old.entry.linear_addr() == entry.linear_addr() and old.entry.size() == entry.size())
+        break;
     }
 
+    if (way == WAYS)
+      way = victim(set);
+
+    set.ways[way] = tagged_entry {entry, pcid, generations_.current()};
+    touch(set, way);
+
+    if (is_spilled(entry))
+      spilled_generation_ = generations_.current();
+  }
+
+  // Remove all non-global entries that belong to the given PCID.
+  void invalidate_pcid(uint16_t pcid) { generations_.flush_pcid(pcid); }
+
+  // Remove all non-global entries regardless of their PCID.
+  void invalidate_non_global() { generations_.flush_non_global(); }
+
+  // Remove the entries of the given PCID that translate any address from first
+  // to last (inclusive). Global entries are removed as well, if include_global
+  // is set.
+  //
+  // Only the sets the range maps to are searched, unless the range covers more
+  // sets than there are or larger entries may be cached anywhere.
+  void invalidate_addresses(uint64_t first, uint64_t last, uint16_t pcid, bool include_global)
+  {
+    auto const matches = [=](tagged_entry const &tagged) {
+      ENTRY const &entry = tagged.entry;
+
+      return (entry.attr().is_g() ? include_global : tagged.pcid == pcid) and
+             entry.linear_addr() <= last and entry.linear_addr() + (entry.size() - 1) >= first;
+    };
+
+    uint64_t const first_page = first >> INDEX_ORDER;
+    uint64_t const last_page = last >> INDEX_ORDER;
+
+    if (generations_.is_valid(spilled_generation_, 0, true) or last_page - first_page >= SETS - 1) {
+      remove_if(matches);
+      return;
+    }
+
+    for (uint64_t page = first_page; page <= last_page; page++)
+      remove_if(sets_[set_index(page << INDEX_ORDER)], matches);
+  }
+};
+
+// A set-associative TLB.
+//
+// In contrast to the fully associative TLB above, a lookup only compares the
+// ways of a single set. The cost of a hit doesn't depend on the number of sets.
+// Misses are served with the help of a paging-structure cache.
+template <size_t SETS, size_t WAYS>
+class set_assoc_tlb
+{
+  tlb_array<SETS, WAYS> entries_;
+  paging_structure_cache psc_;
+
+public:
+  // Reset the TLB to its pristine (empty) state.
+  void clear()
+  {
+    entries_.clear();
+    psc_.clear();
+  }
+
+  // Remove all non-global translations that belong to the given PCID.
+  void invalidate_pcid(uint16_t pcid)
+  {
+    entries_.invalidate_pcid(pcid);
+    psc_.invalidate_pcid(pcid);
+  }
+
+  // Remove all non-global translations of all PCIDs.
+  void invalidate_non_global()
+  {
+    entries_.invalidate_non_global();
+    psc_.clear();
+  }
+
+  // Remove the translations of the given PCID for the linear addresses from
+  // first to last (inclusive), optionally including global ones. The
+  // paging-structure cache entries of the PCID are removed as well.
+  void invalidate_addresses(uint64_t first, uint64_t last, uint16_t pcid, bool include_global)
+  {
+    entries_.invalidate_addresses(first, last, pcid, include_global);
+    psc_.invalidate_pcid(pcid);
+  }
+
+  // Perform the invalidation of a MOV to CR3 with the given value. Only
+  // CR4.PCIDE is used from the paging state.
+  void mov_to_cr3(uint64_t value, paging_state const &state)
+  {
+    invalidate_cr3_write(this, value, state);
+  }
+
+  // Perform the invalidation of INVLPG for the given linear address.
+  void invlpg(uint64_t linear_addr, paging_state const &state)
+  {
+    invalidate_linear_range(this, linear_addr, 1, state);
+  }
+
+  // Perform the invalidation of INVPCID with the given descriptor.
+  void invpcid(invpcid_type type, uint16_t pcid, uint64_t linear_addr = 0)
+  {
+    invalidate_invpcid(this, type, pcid, linear_addr);
+  }
+
+  // Invalidate the translations for a range of linear addresses as if INVLPG
+  // was executed for each page in it.
+  void invalidate_range(uint64_t linear_addr, uint64_t length, paging_state const &state)
+  {
+    invalidate_linear_range(this, linear_addr, length, state);
+  }
+
+  // This method is semantically identical to vmmu::translate. It just caches
+  // its results in the TLB.
+  template <typename MEMORY>
+  translate_result translate(linear_memory_op const &op,
+                             paging_state const &state,
+                             MEMORY *memory)
+  {
+    if (auto entry = entries_.lookup(op, state))
+      return *entry;
+
+    auto res = ::vmmu::translate(op, state, memory, &psc_);
+
+    // Translations with paging disabled don't need memory accesses. Caching
+    // their huge entry would make every later range invalidation search the
+    // whole TLB.
+    if (std::holds_alternative<tlb_entry>(res) and
+        state.get_paging_mode() != internal::paging_mode::PHYS)
+      entries_.insert(op.linear_addr, state.get_pcid(), std::get<tlb_entry>(res));
+
     return res;
   }
+
+  // Translate a batch of operations. See vmmu::translate_batch.
+  template <typename MEMORY>
+  void translate_batch(linear_memory_op const *ops,
+                       size_t count,
+                       paging_state const &state,
+                       MEMORY *memory,
+                       translate_result *results)
+  {
+    internal::translate_each(ops, count, state, results, [&](linear_memory_op const &op) {
+      return translate(op, state, memory);
+    });
+  }
+
+  // Translate a linear memory range. See vmmu::translate_range.
+  template <typename MEMORY>
+  std::optional<page_fault_info> translate_range(linear_memory_op const &op,
+                                                 uint64_t length,
+                                                 paging_state const &state,
+                                                 MEMORY *memory,
+                                                 std::vector<phys_segment> &segments)
+  {
+    return internal::translate_pages(op, length, segments, [&](linear_memory_op const &page_op) {
+      return translate(page_op, state, memory);
+    });
+  }
+};
+
+// A TLB with separate set-associative arrays for each page size.
+//
+// Each array only holds pages of a single size and is indexed by the page
+// number of that size. Every page is thus cached in exactly one set and large
+// pages never evict 4KB pages. Lookups probe the arrays from the smallest to
+// the largest page size. Translations with paging disabled are not cached,
+// because they don't need memory accesses anyway. Misses are served with the
+// help of a paging-structure cache.
+template <size_t SETS_4K, size_t WAYS_4K, size_t SETS_LARGE = 8, size_t WAYS_LARGE = 4>
+class split_tlb
+{
+  tlb_array<SETS_4K, WAYS_4K, 12> entries_4k_;
+  tlb_array<SETS_LARGE, WAYS_LARGE, 21> entries_2m_;
+  tlb_array<SETS_LARGE, WAYS_LARGE, 22> entries_4m_;
+  tlb_array<SETS_LARGE, WAYS_LARGE, 30> entries_1g_;
+  paging_structure_cache psc_;
+
+  template <typename FN>
+  void for_each_array(FN const &fn)
+  {
+    fn(entries_4k_);
+    fn(entries_2m_);
+    fn(entries_4m_);
+    fn(entries_1g_);
+  }
+
+  std::optional<tlb_entry> lookup(linear_memory_op const &op, paging_state const &state)
+  {
+    if (auto entry = entries_4k_.lookup(op, state))
+      return entry;
+
+    if (auto entry = entries_2m_.lookup(op, state))
+      return entry;
+
+    if (auto entry = entries_4m_.lookup(op, state))
+      return entry;
+
+    return entries_1g_.lookup(op, state);
+  }
+
+  void insert(uint64_t linear_addr, uint16_t pcid, tlb_entry const &entry)
+  {
+    switch (entry.size()) {
+    case uint64_t(1) << 12:
+      entries_4k_.insert(linear_addr, pcid, entry);
+      break;
+    case uint64_t(1) << 21:
+      entries_2m_.insert(linear_addr, pcid, entry);
+      break;
+    case uint64_t(1) << 22:
+      entries_4m_.insert(linear_addr, pcid, entry);
+      break;
+    case uint64_t(1) << 30:
+      entries_1g_.insert(linear_addr, pcid, entry);
+      break;
+    }
+  }
+
+public:
+  // Reset the TLB to its pristine (empty) state.
+  void clear()
+  {
+    for_each_array([](auto &entries) { entries.clear(); });
+    psc_.clear();
+  }
+
+  // Remove all non-global translations that belong to the given PCID.
+  void invalidate_pcid(uint16_t pcid)
+  {
+    for_each_array([pcid](auto &entries) { entries.invalidate_pcid(pcid); });
+    psc_.invalidate_pcid(pcid);
+  }
+
+  // Remove all non-global translations of all PCIDs.
+  void invalidate_non_global()
+  {
+    for_each_array([](auto &entries) { entries.invalidate_non_global(); });
+    psc_.clear();
+  }
+
+  // Remove the translations of the given PCID for the linear addresses from
+  // first to last (inclusive), optionally including global ones. The
+  // paging-structure cache entries of the PCID are removed as well.
+  void invalidate_addresses(uint64_t first, uint64_t last, uint16_t pcid, bool include_global)
+  {
+    for_each_array([=](auto &entries) {
+      entries.invalidate_addresses(first, last, pcid, include_global);
+    });
+    psc_.invalidate_pcid(pcid);
+  }
+
+  // Perform the invalidation of a MOV to CR3 with the given value. Only
+  // CR4.PCIDE is used from the paging state.
+  void mov_to_cr3(uint64_t value, paging_state const &state)
+  {
+    invalidate_cr3_write(this, value, state);
+  }
+
+  // Perform the invalidation of INVLPG for the given linear address.
+  void invlpg(uint64_t linear_addr, paging_state const &state)
+  {
+    invalidate_linear_range(this, linear_addr, 1, state);
+  }
+
+  // Perform the invalidation of INVPCID with the given descriptor.
+  void invpcid(invpcid_type type, uint16_t pcid, uint64_t linear_addr = 0)
+  {
+    invalidate_invpcid(this, type, pcid, linear_addr);
+  }
+
+  // Invalidate the translations for a range of linear addresses as if INVLPG
+  // was executed for each page in it.
+  void invalidate_range(uint64_t linear_addr, uint64_t length, paging_state const &state)
+  {
+    invalidate_linear_range(this, linear_addr, length, state);
+  }
+
+  // This method is semantically identical to vmmu::translate. It just caches
+  // its results in the TLB.
+  template <typename MEMORY>
+  translate_result translate(linear_memory_op const &op,
+                             paging_state const &state,
+                             MEMORY *memory)
+  {
+    if (auto entry = lookup(op, state))
+      return *entry;
+
+    auto res = ::vmmu::translate(op, state, memory, &psc_);
+
+    if (std::holds_alternative<tlb_entry>(res))
+      insert(op.linear_addr, state.get_pcid(), std::get<tlb_entry>(res));
+
+    return res;
+  }
+
+  // Translate a batch of operations. See vmmu::translate_batch.
+  template <typename MEMORY>
+  void translate_batch(linear_memory_op const *ops,
+                       size_t count,
+                       paging_state const &state,
+                       MEMORY *memory,
+                       translate_result *results)
+  {
+    internal::translate_each(ops, count, state, results, [&](linear_memory_op const &op) {
+      return translate(op, state, memory);
+    });
+  }
+
+  // Translate a linear memory range. See vmmu::translate_range.
+  template <typename MEMORY>
+  std::optional<page_fault_info> translate_range(linear_memory_op const &op,
+                                                 uint64_t length,
+                                                 paging_state const &state,
+                                                 MEMORY *memory,
+                                                 std::vector<phys_segment> &segments)
+  {
+    return internal::translate_pages(op, length, segments, [&](linear_memory_op const &page_op) {
+      return translate(page_op, state, memory);
+    });
+  }
 };
 
 }  // namespace vmmu
+
+#include <vmmu/internal/pt_walk.hpp>
@@ -0,0 +1,19 @@
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <vmmu/flat_memory.hpp>
+
+using namespace vmmu;
+
+vmmu::flat_memory::flat_memory(std::vector<memslot> slots) : slots_(std::move(slots))
+{
+  std::sort(slots_.begin(), slots_.end(),
+            [](memslot const &a, memslot const &b) { return a.phys_addr < b.phys_addr; });
+
+  for (size_t i = 0; i < slots_.size(); i++) {
+    assert(slots_[i].phys_addr % 8 == 0);
+    assert(reinterpret_cast<uintptr_t>(slots_[i].host_addr) % 8 == 0);
+    assert(slots_[i].phys_addr + slots_[i].size >= slots_[i].phys_addr);
+    assert(i == 0 or slots_[i - 1].phys_addr + slots_[i - 1].size <= slots_[i].phys_addr);
+  }
+}
@@ -1,6 +1,167 @@
 #include <cassert>
 #include <vmmu/vmmu.hpp>
 
+using namespace vmmu;
+using namespace vmmu::internal;
+
+namespace
+{
+// Compute the paging mode as per Intel SDM Vol. 3 4.1.1 "Three Paging Modes"
+// (which are actually four). The conditions are written slightly verbose to
+// match 1:1 with the manual.
+paging_mode compute_paging_mode(paging_state const &s)
+{
+  if (not s.get_cr0_pg())
+    return paging_mode::PHYS;
+
+  if (s.get_cr0_pg() and not s.get_cr4_pae())
+    return paging_mode::PM32;
+
+  if (s.get_cr0_pg() and s.get_cr4_pae() and not s.get_efer_lme())
+    return paging_mode::PM32_PAE;
+
+  if (s.get_cr0_pg() and s.get_cr4_pae() and s.get_efer_lme())
+    return paging_mode::PM64_4LEVEL;
+
+  __builtin_unreachable();
+}
+
+walker_fn select_walker(paging_mode mode)
+{
+  walker_fn walker = nullptr;
+
+  with_paging_mode(mode, [&walker](auto m) {
+    walker = static_cast<walker_fn>(&translate_in_mode<decltype(m)::value, abstract_memory>);
+  });
+
+  return walker;
+}
+
+// Compute the permission bitmap for tlb_entry::allows. See Intel SDM Vol 3
+// 4.6.1 "Determination of Access Rights". The individual cases are spelled
+// out in allows_reference.
+uint64_t compute_permissions(paging_state const &state, bool cpl_is_supervisor, bool rflags_ac)
+{
+  auto const mode = state.get_paging_mode();
+
+  // No permission checking without paging.
+  if (mode == paging_mode::PHYS)
+    return ~uint64_t(0);
+
+  bool const nx = mode != paging_mode::PM32 and state.get_efer_nxe();
+  uint64_t permissions = 0;
+
+  for (unsigned index = 0; index < PERM_INDEXES; index++) {
+    bool const xd = index & PERM_XD;
+    bool const w = index & PERM_W;
+    bool const u = index & PERM_U;
+    bool const implicit = index & PERM_IMPLICIT;
+    auto const type = linear_memory_op::access_type(index >> PERM_TYPE_SHIFT);
+
+    bool const supervisor = implicit or cpl_is_supervisor;
+
+    // SMAP prevents supervisor-mode data accesses to user-mode addresses,
+    // unless EFLAGS.AC is set and the access is explicit.
+    bool const smap_blocks = state.get_cr4_smap() and (implicit or not rflags_ac);
+    bool const executable = not(nx and xd);
+
+    bool allowed = false;
+
+    switch (type) {
+    case linear_memory_op::access_type::READ:
+      allowed = supervisor ? not(u and smap_blocks) : u;
+      break;
+    case linear_memory_op::access_type::WRITE:
+      if (supervisor)
+        allowed = not(u and smap_blocks) and (w or not state.get_cr0_wp());
+      else
+        allowed = u and w;
+      break;
+    case linear_memory_op::access_type::EXECUTE:
+      if (supervisor)
+        allowed = not(u and state.get_cr4_smep()) and executable;
+      else
+        allowed = u and executable;
+      break;
+    }
+
+    permissions |= uint64_t(allowed) << index;
+  }
+
+  return permissions;
+}
+
+}  // namespace
+
+void vmmu::paging_state::recompute()
+{
+  mode = compute_paging_mode(*this);
+  walker = select_walker(mode);
+
+  for (uint32_t i = 0; i < permission_table.size(); i++)
+    permission_table[i] = compute_permissions(*this, i & FLAG_SUPERVISOR, i & FLAG_RFLAGS_AC);
+
+  permissions = permission_table[flags & (FLAG_RFLAGS_AC | FLAG_SUPERVISOR)];
+}
+
+unsigned vmmu::paging_state::update_flags(uint32_t mask, uint32_t new_flags)
+{
+  uint32_t const changed = (flags ^ new_flags) & mask;
+
+  if (changed == 0)
+    return 0;
+
+  auto const old_mode = mode;
+  unsigned changes = 0;
+
+  flags ^= changed;
+  recompute();
+
+  if (mode != old_mode)
+    changes |= CHANGE_MODE;
+
+  if (changed & (FLAG_CR0_WP | FLAG_CR4_SMEP | FLAG_CR4_SMAP | FLAG_EFER_NXE))
+    changes |= CHANGE_ACCESS_RIGHTS;
+
+  if (changed & (FLAG_CR4_PSE | FLAG_CR4_PGE | FLAG_CR4_PCIDE))
+    changes |= CHANGE_TRANSLATION;
+
+  return changes;
+}
+
+unsigned vmmu::paging_state::set_cr0(uint64_t cr0_)
+{
+  return update_flags(FLAGS_CR0, FLAG_CR0_WP * bool(cr0_ & CR0_WP) |
+                                     FLAG_CR0_PG * bool(cr0_ & CR0_PG));
+}
+
+unsigned vmmu::paging_state::set_cr3(uint64_t cr3_)
+{
+  uint64_t const new_cr3 = cr3_ & ~uint64_t(CR3_NOFLUSH);
+
+  if (new_cr3 == cr3)
+    return 0;
+
+  cr3 = new_cr3;
+  return CHANGE_CR3;
+}
+
+unsigned vmmu::paging_state::set_cr4(uint64_t cr4_)
+{
+  return update_flags(FLAGS_CR4, FLAG_CR4_PSE * bool(cr4_ & CR4_PSE) |
+                                     FLAG_CR4_PAE * bool(cr4_ & CR4_PAE) |
+                                     FLAG_CR4_PGE * bool(cr4_ & CR4_PGE) |
+                                     FLAG_CR4_PCIDE * bool(cr4_ & CR4_PCIDE) |
+                                     FLAG_CR4_SMEP * bool(cr4_ & CR4_SMEP) |
+                                     FLAG_CR4_SMAP * bool(cr4_ & CR4_SMAP));
+}
+
+unsigned vmmu::paging_state::set_efer(uint64_t efer_)
+{
+  return update_flags(FLAGS_EFER, FLAG_EFER_LME * bool(efer_ & EFER_LME) |
+                                      FLAG_EFER_NXE * bool(efer_ & EFER_NXE));
+}
+
 vmmu::paging_state::paging_state(uint64_t rflags_,
                                  uint64_t cr0_,
                                  uint64_t cr3_,
@@ -8,18 +169,22 @@ vmmu::paging_state::paging_state(uint64_t rflags_,
                                  uint64_t efer_,
                                  unsigned cpl_,
                                  decltype(vmmu::paging_state::pdpte) const &pdpte_)
-    : cr3(cr3_),
+    : cr3(cr3_ & ~uint64_t(CR3_NOFLUSH)),
       pdpte(pdpte_),
-      cr0_wp(cr0_ & CR0_WP),
-      cr0_pg(cr0_ & CR0_PG),
-      cr4_pse(cr4_ & CR4_PSE),
-      cr4_pae(cr4_ & CR4_PAE),
-      cr4_smep(cr4_ & CR4_SMEP),
-      cr4_smap(cr4_ & CR4_SMAP),
-      efer_lme(efer_ & EFER_LME),
-      efer_nxe(efer_ & EFER_NXE),
-      rflags_ac(rflags_ & RFLAGS_AC),
-      cpl_is_supervisor(cpl_ != 3)
+      flags(0),
+      mode(paging_mode::PHYS),
+      walker(nullptr),
+      permission_table {},
+      permissions(0)
 {
   assert(cpl_ <= 3);
+
+  // The setters only recompute derived state when something changes, so it is
+  // computed once more at the end.
+  set_cr0(cr0_);
+  set_cr4(cr4_);
+  set_efer(efer_);
+  set_rflags(rflags_);
+  set_cpl(cpl_);
+  recompute();
 }
@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <cassert>
+#include <vmmu/shadow.hpp>
+
+using namespace vmmu;
+
+namespace
+{
+using internal::paging_mode;
+
+constexpr uint64_t PAGE_MASK = 0xFFF;
+constexpr unsigned ROOT_ORDER = 39;
+constexpr unsigned ENTRIES = 512;
+
+// Shadow page tables translate 48-bit linear addresses.
+constexpr uint64_t LINEAR_MASK = (uint64_t(1) << 48) - 1;
+
+// Non-leaf shadow entries allow everything. Leaf entries restrict access.
+constexpr uint64_t SHADOW_TABLE_FLAGS = PTE_P | PTE_W | PTE_U | PTE_A;
+
+unsigned table_index(uint64_t linear_addr, unsigned order)
+{
+  return (linear_addr >> order) % ENTRIES;
+}
+
+// Forwards page table accesses to guest memory and remembers which page table
+// entries the last walk read. A failed compare-exchange restarts the walk, so
+// it also restarts the recording.
+class recording_memory
+{
+  abstract_memory *memory_;
+
+public:
+  struct access {
+    uint64_t phys_addr;
+    uint8_t size;
+  };
+
+  std::array<access, 4> reads;
+  size_t count = 0;
+
+  template <typename WORD>
+  WORD read(uint64_t phys_addr, WORD dummy)
+  {
+    assert(count < reads.size());
+
+    reads[count++] = {phys_addr, sizeof(WORD)};
+    return memory_->read(phys_addr, dummy);
+  }
+
+  template <typename WORD>
+  bool cmpxchg(uint64_t phys_addr, WORD expected, WORD new_value)
+  {
+    bool const success = memory_->cmpxchg(phys_addr, expected, new_value);
+
+    if (not success)
+      count = 0;
+
+    return success;
+  }
+
+  explicit recording_memory(abstract_memory *memory) : memory_(memory) {}
+};
+
+// The orders of the entries in the guest page tables that a walk reads, from
+// the top level down. PAE PDPTEs are not read from memory during walks.
+struct guest_format {
+  std::array<uint8_t, 4> orders;
+  unsigned index_bits;
+};
+
+guest_format format_of(paging_mode mode)
+{
+  switch (mode) {
+  case paging_mode::PM32:
+    return {{22, 12}, 10};
+  case paging_mode::PM32_PAE:
+    return {{21, 12}, 9};
+  case paging_mode::PM64_4LEVEL:
+    return {{39, 30, 21, 12}, 9};
+  case paging_mode::PHYS:
+    break;
+  }
+
+  return {{}, 9};
+}
+
+}  // namespace
+
+void vmmu::shadow_paging::shadow_table_deleter::operator()(shadow_table *table) const
+{
+  hooks->free_table(table->page);
+  delete table;
+}
+
+uint64_t vmmu::shadow_paging::address_space_of(paging_state const &state)
+{
+  return (state.get_cr3() & internal::bit_range<51, 12>::mask()) |
+         uint64_t(state.get_paging_mode()) << 60;
+}
+
+vmmu::shadow_paging::table_ptr vmmu::shadow_paging::make_table(bool last_level)
+{
+  table_ptr table {new shadow_table {hooks_->allocate_table(), {}},
+                   shadow_table_deleter {hooks_}};
+
+  assert((table->page.phys_addr & PAGE_MASK) == 0);
+
+  if (not last_level)
+    table->children.resize(ENTRIES);
+
+  return table;
+}
+
+vmmu::shadow_paging::shadow_table &vmmu::shadow_paging::root_of(uint64_t address_space)
+{
+  auto it = roots_.find(address_space);
+
+  if (it == roots_.end())
+    it = roots_.emplace(address_space, make_table(false)).first;
+
+  return *it->second;
+}
+
+uint64_t *vmmu::shadow_paging::find_entry(uint64_t address_space, uint64_t linear_page)
+{
+  auto const it = roots_.find(address_space);
+
+  if (it == roots_.end())
+    return nullptr;
+
+  shadow_table *table = it->second.get();
+
+  for (unsigned order = ROOT_ORDER; order > 12; order -= 9) {
+    table = table->children[table_index(linear_page, order)].get();
+
+    if (not table)
+      return nullptr;
+  }
+
+  return &table->page.entries[table_index(linear_page, 12)];
+}
+
+void vmmu::shadow_paging::zap_table(
+    shadow_table &table, unsigned order, uint64_t base, uint64_t first, uint64_t last)
+{
+  uint64_t const entry_size = uint64_t(1) << order;
+  unsigned const lo = first > base ? table_index(first, order) : 0;
+  unsigned const hi = last < base + ENTRIES * entry_size - 1 ? table_index(last, order) : ENTRIES - 1;
+
+  for (unsigned i = lo; i <= hi; i++) {
+    uint64_t const entry_first = base + i * entry_size;
+    uint64_t const entry_last = entry_first + (entry_size - 1);
+
+    if (table.children.empty()) {
+      table.page.entries[i] = 0;
+      continue;
+    }
+
+    table_ptr &child = table.children[i];
+
+    if (not child)
+      continue;
+
+    if (first <= entry_first and last >= entry_last) {
+      table.page.entries[i] = 0;
+      child.reset();
+    } else {
+      zap_table(*child, order - 9, entry_first, first, last);
+    }
+  }
+}
+
+void vmmu::shadow_paging::zap(uint64_t address_space, uint64_t first, uint64_t last)
+{
+  auto const it = roots_.find(address_space);
+
+  if (it == roots_.end() or first > LINEAR_MASK)
+    return;
+
+  zap_table(*it->second, ROOT_ORDER, 0, first, std::min(last, LINEAR_MASK));
+}
+
+bool vmmu::shadow_paging::remove_write_access(uint64_t guest_page)
+{
+  auto const it = mappings_.find(guest_page);
+
+  if (it == mappings_.end())
+    return false;
+
+  auto &mappings = it->second;
+  bool changed = false;
+
+  // Also forget mappings that don't exist anymore.
+  mappings.erase(std::remove_if(mappings.begin(), mappings.end(),
+                                [&](mapping const &m) {
+                                  uint64_t *entry = find_entry(m.address_space, m.linear_page);
+
+                                  if (not entry or (*entry & ~(PTE_XD | PAGE_MASK)) != m.host_page)
+                                    return true;
+
+                                  changed |= bool(*entry & PTE_W);
+                                  *entry &= ~uint64_t(PTE_W);
+                                  return false;
+                                }),
+                 mappings.end());
+
+  return changed;
+}
+
+bool vmmu::shadow_paging::protect(uint64_t guest_page)
+{
+  hooks_->write_protect(guest_page);
+  return remove_write_access(guest_page);
+}
+
+bool vmmu::shadow_paging::track_table(uint64_t guest_page, table_use const &use)
+{
+  auto const [it, inserted] = tables_.try_emplace(guest_page);
+  auto &uses = it->second.uses;
+
+  if (std::find(uses.begin(), uses.end(), use) == uses.end())
+    uses.push_back(use);
+
+  return inserted and protect(guest_page);
+}
+
+void vmmu::shadow_paging::zap_uses(guest_table const &table, uint64_t offset, uint64_t size)
+{
+  for (auto const &use : table.uses) {
+    uint64_t const first = offset / use.entry_size;
+    uint64_t const last = (offset + size - 1) / use.entry_size;
+
+    zap(use.address_space, use.base + (first << use.order),
+        use.base + ((last + 1) << use.order) - 1);
+  }
+}
+
+uint64_t vmmu::shadow_paging::root(paging_state const &state)
+{
+  return root_of(address_space_of(state)).page.phys_addr;
+}
+
+shadow_fault_result vmmu::shadow_paging::handle_fault(linear_memory_op const &op,
+                                                      paging_state const &state)
+{
+  recording_memory recording {memory_};
+  auto const res = translate(op, state, &recording);
+
+  if (auto const *pf = std::get_if<page_fault_info>(&res))
+    return *pf;
+
+  tlb_entry const &entry = std::get<tlb_entry>(res);
+  uint64_t const address_space = address_space_of(state);
+  uint64_t const linear_addr = op.linear_addr & LINEAR_MASK;
+  guest_format const format = format_of(state.get_paging_mode());
+
+  // Write-protect the guest page tables on the way and remember which linear
+  // addresses their entries translate.
+  bool lost_write_access = false;
+
+  for (size_t i = 0; i < recording.count; i++) {
+    auto const &access = recording.reads[i];
+    uint8_t const order = format.orders[i];
+    uint64_t const table_size = uint64_t(1) << (order + format.index_bits);
+
+    lost_write_access |= track_table(
+        access.phys_addr & ~PAGE_MASK,
+        {address_space, linear_addr & ~(table_size - 1), order, access.size});
+  }
+
+  if (lost_write_access)
+    hooks_->flush_host_tlb();
+
+  uint64_t const linear_page = linear_addr & ~PAGE_MASK;
+  uint64_t const guest_page = *entry.translate(op.linear_addr) & ~PAGE_MASK;
+  auto const host_page = hooks_->guest_to_host(guest_page);
+
+  if (not host_page)
+    return entry;
+
+  // Clean pages are mapped read-only, so the first write faults and sets the
+  // dirty flag in the guest page table.
+  tlb_attr const &attr = entry.attr();
+  bool const writable = attr.is_w() and attr.is_d() and not is_write_protected(guest_page);
+
+  // Fill in the missing tables down to the last level.
+  shadow_table *table = &root_of(address_space);
+
+  for (unsigned order = ROOT_ORDER; order > 12; order -= 9) {
+    unsigned const index = table_index(linear_page, order);
+    table_ptr &child = table->children[index];
+
+    if (not child) {
+      child = make_table(order == 21);
+      table->page.entries[index] = child->page.phys_addr | SHADOW_TABLE_FLAGS;
+    }
+
+    table = child.get();
+  }
+
+  table->page.entries[table_index(linear_page, 12)] =
+      *host_page | PTE_P | PTE_A | PTE_D | (writable ? PTE_W : uint64_t(0)) |
+      (attr.is_u() ? PTE_U : uint64_t(0)) |
+      (attr.is_xd() and state.get_efer_nxe() ? PTE_XD : uint64_t(0));
+
+  auto &mappings = mappings_[guest_page];
+  mapping const m {address_space, linear_page, *host_page};
+
+  if (std::find(mappings.begin(), mappings.end(), m) == mappings.end())
+    mappings.push_back(m);
+
+  // Writes that are not allowed by the shadow entry have to be emulated.
+  if (op.is_write() and not writable)
+    return entry;
+
+  return shadow_mapped {};
+}
+
+void vmmu::shadow_paging::guest_write(uint64_t guest_phys_addr, uint64_t size)
+{
+  uint64_t const guest_page = guest_phys_addr & ~PAGE_MASK;
+  uint64_t const offset = guest_phys_addr & PAGE_MASK;
+  auto const it = tables_.find(guest_page);
+
+  if (it == tables_.end() or it->second.unsync or size == 0)
+    return;
+
+  guest_table &table = it->second;
+  bool const is_last_level = std::all_of(table.uses.begin(), table.uses.end(),
+                                         [](table_use const &use) { return use.order == 12; });
+
+  if (is_last_level) {
+    // Let the guest write the table directly from now on. Its existing
+    // mappings are read-only, so they are removed and fault again.
+    table.unsync = true;
+    hooks_->write_unprotect(guest_page);
+
+    for (auto const &m : mappings_[guest_page])
+      zap(m.address_space, m.linear_page, m.linear_page + PAGE_MASK);
+
+    mappings_.erase(guest_page);
+  } else {
+    zap_uses(table, offset, std::min(size, PAGE_MASK + 1 - offset));
+  }
+
+  hooks_->flush_host_tlb();
+}
+
+bool vmmu::shadow_paging::is_write_protected(uint64_t guest_page) const
+{
+  auto const it = tables_.find(guest_page);
+
+  return it != tables_.end() and not it->second.unsync;
+}
+
+void vmmu::shadow_paging::invlpg(uint64_t linear_addr)
+{
+  uint64_t const linear_page = linear_addr & LINEAR_MASK & ~PAGE_MASK;
+
+  for (auto const &[address_space, root] : roots_)
+    zap(address_space, linear_page, linear_page + PAGE_MASK);
+
+  hooks_->flush_host_tlb();
+}
+
+void vmmu::shadow_paging::sync()
+{
+  bool changed = false;
+
+  for (auto &[guest_page, table] : tables_) {
+    if (not table.unsync)
+      continue;
+
+    zap_uses(table, 0, PAGE_MASK + 1);
+    table.unsync = false;
+    protect(guest_page);
+
+    changed = true;
+  }
+
+  if (changed)
+    hooks_->flush_host_tlb();
+}
+
+void vmmu::shadow_paging::mov_to_cr3(paging_state const &state)
+{
+  sync();
+
+  if (state.get_paging_mode() == paging_mode::PM32_PAE) {
+    roots_.erase(address_space_of(state));
+    hooks_->flush_host_tlb();
+  }
+}
+
+void vmmu::shadow_paging::clear()
+{
+  roots_.clear();
+
+  for (auto const &[guest_page, table] : tables_)
+    if (not table.unsync)
+      hooks_->write_unprotect(guest_page);
+
+  tables_.clear();
+  mappings_.clear();
+
+  hooks_->flush_host_tlb();
+}
+
+vmmu::shadow_paging::shadow_paging(abstract_memory *memory, shadow_hooks *hooks)
+    : memory_(memory), hooks_(hooks)
+{
+  assert(memory and hooks);
+}
+
+vmmu::shadow_paging::~shadow_paging()
+{
+  clear();
+}
@@ -0,0 +1,116 @@
+#include <vmmu/simd_tlb.hpp>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+using namespace vmmu;
+using namespace vmmu::internal;
+
+uint64_t vmmu::internal::match_tags_scalar(uint64_t const *tags,
+                                           uint64_t const *masks,
+                                           size_t count,
+                                           uint64_t linear_addr)
+{
+  uint64_t hits = 0;
+
+  for (size_t i = 0; i < count; i++)
+    hits |= uint64_t((linear_addr & masks[i]) == tags[i]) << i;
+
+  return hits;
+}
+
+#if defined(__x86_64__)
+
+uint64_t vmmu::internal::match_tags_sse2(uint64_t const *tags,
+                                         uint64_t const *masks,
+                                         size_t count,
+                                         uint64_t linear_addr)
+{
+  __m128i const la = _mm_set1_epi64x(int64_t(linear_addr));
+  uint64_t hits = 0;
+
+  for (size_t i = 0; i < count; i += 2) {
+    __m128i const masked = _mm_and_si128(la, _mm_load_si128((__m128i const *)&masks[i]));
+    __m128i const eq32 = _mm_cmpeq_epi32(masked, _mm_load_si128((__m128i const *)&tags[i]));
+
+    // SSE2 can only compare 32-bit lanes. Both halves have to match.
+    __m128i const eq64 = _mm_and_si128(eq32, _mm_shuffle_epi32(eq32, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    hits |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(eq64))) << i;
+  }
+
+  return hits;
+}
+
+__attribute__((target("avx2"))) uint64_t vmmu::internal::match_tags_avx2(uint64_t const *tags,
+                                                                         uint64_t const *masks,
+                                                                         size_t count,
+                                                                         uint64_t linear_addr)
+{
+  __m256i const la = _mm256_set1_epi64x(int64_t(linear_addr));
+  uint64_t hits = 0;
+
+  for (size_t i = 0; i < count; i += 4) {
+    __m256i const masked = _mm256_and_si256(la, _mm256_load_si256((__m256i const *)&masks[i]));
+    __m256i const eq = _mm256_cmpeq_epi64(masked, _mm256_load_si256((__m256i const *)&tags[i]));
+
+    hits |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(eq))) << i;
+  }
+
+  return hits;
+}
+
+__attribute__((target("avx512f"))) uint64_t vmmu::internal::match_tags_avx512(
+    uint64_t const *tags, uint64_t const *masks, size_t count, uint64_t linear_addr)
+{
+  __m512i const la = _mm512_set1_epi64(int64_t(linear_addr));
+  uint64_t hits = 0;
+
+  for (size_t i = 0; i < count; i += 8) {
+    __m512i const masked = _mm512_and_si512(la, _mm512_load_si512(&masks[i]));
+
+    hits |= uint64_t(_mm512_cmpeq_epi64_mask(masked, _mm512_load_si512(&tags[i]))) << i;
+  }
+
+  return hits;
+}
+
+#endif
+
+namespace
+{
+tag_match_fn select_match_tags()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    return match_tags_avx512;
+
+  if (__builtin_cpu_supports("avx2"))
+    return match_tags_avx2;
+
+  // SSE2 is part of the x86-64 baseline.
+  return match_tags_sse2;
+#else
+  return match_tags_scalar;
+#endif
+}
+
+// Replaces itself with the best implementation on the first call. This avoids
+// depending on the order of static initialization.
+uint64_t resolve_match_tags(uint64_t const *tags,
+                            uint64_t const *masks,
+                            size_t count,
+                            uint64_t linear_addr)
+{
+  tag_match_fn const fn = select_match_tags();
+
+  match_tags.store(fn, std::memory_order_relaxed);
+  return fn(tags, masks, count, linear_addr);
+}
+
+}  // namespace
+
+std::atomic<tag_match_fn> vmmu::internal::match_tags {resolve_match_tags};
@@ -0,0 +1,28 @@
+#include <vmmu/stats.hpp>
+
+using namespace vmmu;
+
+translation_counters vmmu::translation_stats::snapshot() const
+{
+  translation_counters result;
+
+  // The baseline is read first. Counters only grow and the baseline is a copy
+  // of older counter values. Reading the baseline with acquire pairs with the
+  // release in reset, so the counters read afterwards are at least as new as
+  // the values reset copied and the differences can't become negative.
+  result.zip(baseline_, [](uint64_t &value, counter const &base) {
+    value = base.load(std::memory_order_acquire);
+  });
+  result.zip(counters_, [](uint64_t &value, counter const &current) {
+    value = current.load(std::memory_order_relaxed) - value;
+  });
+
+  return result;
+}
+
+void vmmu::translation_stats::reset()
+{
+  baseline_.zip(counters_, [](counter &base, counter const &current) {
+    base.store(current.load(std::memory_order_relaxed), std::memory_order_release);
+  });
+}
@@ -1,5 +1,6 @@
 #include <cassert>
-#include <vmmu/internal/paging_mode.hpp>
+#include <vmmu/internal/allows_reference.hpp>
+#include <vmmu/internal/compiler.hpp>
 #include <vmmu/vmmu.hpp>
 
 using namespace vmmu;
@@ -16,10 +17,11 @@ vmmu::tlb_entry::tlb_entry(uint64_t linear_addr,
 }
 
 // I've tried to make the code match the written description in the manual 1:1.
-// Once all cases are covered by testing, we can dare to simplify.
-bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &state) const
+bool vmmu::internal::allows_reference(tlb_attr const &attr,
+                                      linear_memory_op const &op,
+                                      paging_state const &state)
 {
-  auto mode = get_paging_mode(state);
+  auto mode = state.get_paging_mode();
 
   // No permission checking without paging.
   if (mode == paging_mode::PHYS)
@@ -29,11 +31,11 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
     // For supervisor-mode accesses:
 
     // Data may be read (implicitly or explicitly) from any supervisor-mode address.
-    if (op.is_data_read() and not attr().is_u())
+    if (op.is_data_read() and not attr.is_u())
       return true;
 
     // Data reads from user-mode pages.
-    if (op.is_data_read() and attr().is_u()) {
+    if (op.is_data_read() and attr.is_u()) {
       // Access rights depend on the value of CR4.SMAP:
 
       // If CR4.SMAP = 0, data may be read from any user-mode address with a
@@ -60,7 +62,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
     }
 
     // Data writes to supervisor-mode addresses.
-    if (op.is_write() and not attr().is_u()) {
+    if (op.is_write() and not attr.is_u()) {
       // Access rights depend on the value of CR0.WP:
 
       // If CR0.WP = 0, data may be written to any supervisor-mode address.
@@ -74,13 +76,13 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
       // the R/W flag is 0 in any paging-structure entry controlling the
       // translation.
       if (state.get_cr0_wp())
-        return attr().is_w();
+        return attr.is_w();
 
       unreachable();
     }
 
     // Data writes to user-mode addresses.
-    if (op.is_write() and attr().is_u()) {
+    if (op.is_write() and attr.is_u()) {
       // Access rights depend on the value of CR0.WP:
 
       // If CR0.WP = 0, access rights depend on the value of CR4.SMAP:
@@ -117,7 +119,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
         // user-mode address with a translation for which the R/W flag is 0 in
         // any paging-structure entry controlling the translation.
         if (not state.get_cr4_smap())
-          return attr().is_w();
+          return attr.is_w();
 
         // If CR4.SMAP = 1, access rights depend on the value of EFLAGS.AC and
         // whether the access is implicit or explicit:
@@ -130,7 +132,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
           // a translation for which the R/W flag is 0 in any paging-structure
           // entry controlling the translation.
           if (state.get_rflags_ac() and not op.is_implicit_supervisor())
-            return attr().is_w();
+            return attr.is_w();
 
           // If EFLAGS.AC = 0 or the access is implicit, data may not be
           // written to any user-mode address.
@@ -143,7 +145,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
     }
 
     // Instruction fetches from supervisor-mode addresses.
-    if (op.is_instruction_fetch() and not attr().is_u()) {
+    if (op.is_instruction_fetch() and not attr.is_u()) {
       // For 32-bit paging or if IA32_EFER.NXE = 0, instructions may be
       // fetched from any supervisor-mode address.
       if (mode == paging_mode::PM32 or not state.get_efer_nxe())
@@ -155,11 +157,11 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
       // controlling the translation; instructions may not be fetched from any
       // supervisor-mode address with a translation for which the XD flag is 1
       // in any paging-structure entry controlling the translation.
-      return not attr().is_xd();
+      return not attr.is_xd();
     }
 
     // Instruction fetches from user-mode addresses.
-    if (op.is_instruction_fetch() and attr().is_u()) {
+    if (op.is_instruction_fetch() and attr.is_u()) {
       // Access rights depend on the values of CR4.SMEP:
 
       // If CR4.SMEP = 0, access rights depend on the paging mode and the
@@ -176,7 +178,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
         // the translation; instructions may not be fetched from any user-mode
         // address with a translation for which the XD flag is 1 in any
         // paging-structure entry controlling the translation.
-        return not attr().is_xd();
+        return not attr.is_xd();
       }
 
       // If CR4.SMEP = 1, instructions may not be fetched from any user-mode address.
@@ -199,7 +201,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
     // which read access is permitted.
     //
     // Data may not be read from any supervisor-mode address.
-    return attr().is_u();
+    return attr.is_u();
   }
 
   // Data writes.
@@ -210,11 +212,11 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
     // the R/W flag is 1 in every paging-structure entry controlling the
     // translation and with a protection key for which write access is
     // permitted.
-    if (attr().is_u())
-      return attr().is_w();
+    if (attr.is_u())
+      return attr.is_w();
 
     // Data may not be written to any supervisor-mode address.
-    if (not attr().is_u())
+    if (not attr.is_u())
       return false;
 
     unreachable();
@@ -226,7 +228,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
     // and the value of IA32_EFER.NXE:
 
     // Instructions may not be fetched from any supervisor-mode address.
-    if (not attr().is_u())
+    if (not attr.is_u())
       return false;
 
     // For 32-bit paging or if IA32_EFER.NXE = 0, instructions may be fetched
@@ -237,7 +239,7 @@ bool vmmu::tlb_entry::allows(linear_memory_op const &op, paging_state const &sta
     // For PAE paging or 4-level paging with IA32_EFER.NXE = 1, instructions may
     // be fetched from any user-mode address with a translation for which the XD
     // flag is 0 in every paging-structure entry controlling the translation.
-    return not attr().is_xd();
+    return not attr.is_xd();
   }
 
   // We forgot to handle a case.
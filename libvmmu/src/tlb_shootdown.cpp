@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cassert>
+#include <thread>
+#include <vmmu/tlb_shootdown.hpp>
+
+using namespace vmmu;
+
+namespace
+{
+// Returns true, if the invalidation a already covers b.
+bool covers(tlb_invalidation const &a, tlb_invalidation const &b)
+{
+  using kind = tlb_invalidation::kind;
+
+  switch (a.type) {
+  case kind::ALL:
+    return true;
+  case kind::NON_GLOBAL:
+    return b.type == kind::PCID or (b.type == kind::ADDRESSES and not b.include_global) or
+           b.type == kind::NON_GLOBAL;
+  case kind::PCID:
+    return (b.type == kind::PCID or (b.type == kind::ADDRESSES and not b.include_global)) and
+           a.pcid == b.pcid;
+  case kind::ADDRESSES:
+    return b.type == kind::ADDRESSES and a.pcid == b.pcid and
+           (a.include_global or not b.include_global) and a.first <= b.first and
+           a.last >= b.last;
+  }
+
+  return false;
+}
+
+// Try to extend the address invalidation a, so it also covers b.
+bool merge(tlb_invalidation &a, tlb_invalidation const &b)
+{
+  using kind = tlb_invalidation::kind;
+
+  if (a.type != kind::ADDRESSES or b.type != kind::ADDRESSES or a.pcid != b.pcid or
+      a.include_global != b.include_global)
+    return false;
+
+  // Only merge overlapping or adjacent ranges.
+  if (b.first > a.last and b.first - a.last > 1)
+    return false;
+  if (a.first > b.last and a.first - b.last > 1)
+    return false;
+
+  a.first = std::min(a.first, b.first);
+  a.last = std::max(a.last, b.last);
+  return true;
+}
+
+}  // namespace
+
+void vmmu::tlb_shootdown::enqueue(vcpu_queue &queue, tlb_invalidation const &inv, uint64_t ticket)
+{
+  queue.requested.store(ticket, std::memory_order_release);
+
+  for (size_t i = 0; i < queue.count; i++)
+    if (covers(queue.entries[i], inv) or merge(queue.entries[i], inv))
+      return;
+
+  if (inv.type == tlb_invalidation::kind::ALL or queue.count == queue.entries.size()) {
+    queue.entries[0] = tlb_invalidation::all();
+    queue.count = 1;
+    return;
+  }
+
+  queue.entries[queue.count++] = inv;
+}
+
+size_t vmmu::tlb_shootdown::take(size_t vcpu,
+                                 std::array<tlb_invalidation, QUEUE_SIZE> &entries,
+                                 uint64_t &ticket)
+{
+  vcpu_queue &queue = queues_[vcpu];
+  std::lock_guard<std::mutex> guard {queue.lock};
+
+  size_t const count = queue.count;
+
+  std::copy_n(queue.entries.begin(), count, entries.begin());
+  queue.count = 0;
+  ticket = queue.requested.load(std::memory_order_relaxed);
+
+  return count;
+}
+
+uint64_t vmmu::tlb_shootdown::shoot(size_t vcpu, tlb_invalidation const &inv)
+{
+  assert(vcpu < vcpus_);
+
+  vcpu_queue &queue = queues_[vcpu];
+  std::lock_guard<std::mutex> guard {queue.lock};
+  uint64_t const ticket = epoch_.fetch_add(1) + 1;
+
+  enqueue(queue, inv, ticket);
+  return ticket;
+}
+
+uint64_t vmmu::tlb_shootdown::shoot_all(tlb_invalidation const &inv, size_t except)
+{
+  // The ticket is taken while all queues are locked, so tickets are queued in
+  // ascending order everywhere. Locks are always taken in vCPU order.
+  for (size_t vcpu = 0; vcpu < vcpus_; vcpu++)
+    if (vcpu != except)
+      queues_[vcpu].lock.lock();
+
+  uint64_t const ticket = epoch_.fetch_add(1) + 1;
+
+  for (size_t vcpu = 0; vcpu < vcpus_; vcpu++) {
+    if (vcpu == except)
+      continue;
+
+    enqueue(queues_[vcpu], inv, ticket);
+    queues_[vcpu].lock.unlock();
+  }
+
+  return ticket;
+}
+
+size_t vmmu::tlb_shootdown::pending_invalidations(size_t vcpu)
+{
+  vcpu_queue &queue = queues_[vcpu];
+  std::lock_guard<std::mutex> guard {queue.lock};
+
+  return queue.count;
+}
+
+bool vmmu::tlb_shootdown::is_complete(uint64_t ticket, size_t except) const
+{
+  for (size_t vcpu = 0; vcpu < vcpus_; vcpu++) {
+    vcpu_queue const &queue = queues_[vcpu];
+
+    // vCPUs that were not targeted by the shootdown don't have to acknowledge
+    // it.
+    if (vcpu == except or queue.requested.load(std::memory_order_acquire) < ticket)
+      continue;
+
+    if (queue.acknowledged.load(std::memory_order_acquire) < ticket)
+      return false;
+  }
+
+  return true;
+}
+
+void vmmu::tlb_shootdown::wait(uint64_t ticket, size_t except) const
+{
+  while (not is_complete(ticket, except))
+    std::this_thread::yield();
+}
+
+vmmu::tlb_shootdown::tlb_shootdown(size_t vcpus)
+    : vcpus_(vcpus), queues_(std::make_unique<vcpu_queue[]>(vcpus))
+{
+}
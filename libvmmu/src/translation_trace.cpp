@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <vmmu/translation_trace.hpp>
+
+using namespace vmmu;
+using namespace vmmu::internal;
+
+bool vmmu::trace_state::operator==(trace_state const &other) const
+{
+  return rflags == other.rflags and cr0 == other.cr0 and cr3 == other.cr3 and cr4 == other.cr4 and
+         efer == other.efer and cpl == other.cpl and pdpte == other.pdpte;
+}
+
+trace_state vmmu::trace_state::of(paging_state const &state)
+{
+  return {
+      RFLAGS_RSVD | RFLAGS_AC * state.get_rflags_ac(),
+      CR0_PG * state.get_cr0_pg() | CR0_WP * state.get_cr0_wp(),
+      state.get_cr3(),
+      CR4_PSE * state.get_cr4_pse() | CR4_PAE * state.get_cr4_pae() |
+          CR4_PGE * state.get_cr4_pge() | CR4_PCIDE * state.get_cr4_pcide() |
+          CR4_SMEP * state.get_cr4_smep() | CR4_SMAP * state.get_cr4_smap(),
+      EFER_LME * state.get_efer_lme() | EFER_NXE * state.get_efer_nxe(),
+      state.is_supervisor() ? 0U : 3U,
+      {state.get_pdpte(0), state.get_pdpte(1), state.get_pdpte(2), state.get_pdpte(3)},
+  };
+}
+
+paging_state vmmu::trace_state::to_paging_state() const
+{
+  return {rflags, cr0, cr3, cr4, efer, unsigned(cpl), pdpte};
+}
+
+unsigned vmmu::trace_state::apply(paging_state *state) const
+{
+  unsigned changes = 0;
+
+  // CR4.PCIDE must be set before CR3, because it decides which CR3 bits are
+  // the PCID.
+  changes |= state->set_cr0(cr0);
+  changes |= state->set_cr4(cr4);
+  changes |= state->set_efer(efer);
+  changes |= state->set_cr3(cr3);
+
+  state->set_rflags(rflags);
+  state->set_cpl(unsigned(cpl));
+  state->set_pdpte(pdpte);
+
+  return changes;
+}
+
+void vmmu::trace_recorder::put_varint(uint64_t value)
+{
+  while (value >= 0x80) {
+    buffer_.push_back(uint8_t(value | 0x80));
+    value >>= 7;
+  }
+
+  buffer_.push_back(uint8_t(value));
+}
+
+void vmmu::trace_recorder::record_access(linear_memory_op const &op, paging_state const &state)
+{
+  trace_state const current = trace_state::of(state);
+
+  if (not state_ or *state_ != current) {
+    buffer_.push_back(TRACE_STATE);
+
+    for (uint64_t value : {current.rflags, current.cr0, current.cr3, current.cr4, current.efer,
+                           current.cpl})
+      put_varint(value);
+
+    for (uint64_t value : current.pdpte)
+      put_varint(value);
+
+    state_ = current;
+  }
+
+  buffer_.push_back(uint8_t(TRACE_ACCESS | unsigned(op.type) << TRACE_TYPE_SHIFT |
+                            (op.is_implicit_supervisor() ? TRACE_IMPLICIT : 0)));
+  put_varint(zigzag_encode(op.linear_addr - linear_addr_));
+
+  linear_addr_ = op.linear_addr;
+}
+
+void vmmu::trace_recorder::record_entry(uint64_t phys_addr, uint64_t value)
+{
+  auto const [it, inserted] = entries_.try_emplace(phys_addr, value);
+
+  if (not inserted and it->second == value)
+    return;
+
+  it->second = value;
+
+  buffer_.push_back(TRACE_ENTRY);
+  put_varint(zigzag_encode(phys_addr - phys_addr_));
+  put_varint(value);
+
+  phys_addr_ = phys_addr;
+}
+
+void vmmu::trace_recorder::record_cr3_write(uint64_t value)
+{
+  // Nothing was cached before the first access, so there is nothing to flush.
+  if (not state_)
+    return;
+
+  buffer_.push_back(TRACE_CR3);
+  put_varint(value);
+
+  // The replay loads CR3 from this record. The next state record doesn't need
+  // to repeat it.
+  state_->cr3 = value & ~uint64_t(CR3_NOFLUSH);
+}
+
+vmmu::trace_recorder::trace_recorder() : buffer_(TRACE_MAGIC.begin(), TRACE_MAGIC.end()) {}
+
+std::optional<uint64_t> vmmu::trace_reader::get_varint()
+{
+  uint64_t value = 0;
+
+  for (unsigned shift = 0; pos_ != end_ and shift < 64; shift += 7) {
+    uint8_t const byte = *pos_++;
+
+    value |= uint64_t(byte & 0x7f) << shift;
+
+    if (not(byte & 0x80))
+      return value;
+  }
+
+  error_ = true;
+  return {};
+}
+
+std::optional<trace_event> vmmu::trace_reader::next()
+{
+  if (error_ or pos_ == end_)
+    return {};
+
+  uint8_t const tag = *pos_++;
+
+  switch (tag & TRACE_KIND_MASK) {
+  case TRACE_ACCESS: {
+    auto const delta = get_varint();
+    unsigned const type = tag >> TRACE_TYPE_SHIFT & 3;
+    bool const implicit = tag & TRACE_IMPLICIT;
+
+    // Implicit supervisor accesses are never instruction fetches.
+    if (not delta or type > unsigned(linear_memory_op::access_type::EXECUTE) or
+        (implicit and type == unsigned(linear_memory_op::access_type::EXECUTE)))
+      break;
+
+    linear_addr_ += zigzag_decode(*delta);
+
+    return linear_memory_op {linear_addr_, linear_memory_op::access_type(type),
+                             implicit ? linear_memory_op::supervisor_type::IMPLICIT
+                                      : linear_memory_op::supervisor_type::EXPLICIT};
+  }
+
+  case TRACE_STATE: {
+    std::array<uint64_t, 10> values;
+
+    for (auto &value : values) {
+      auto const v = get_varint();
+
+      if (not v)
+        return {};
+
+      value = *v;
+    }
+
+    if (values[5] > 3)
+      break;
+
+    return trace_state {values[0], values[1], values[2], values[3], values[4], values[5],
+                        {values[6], values[7], values[8], values[9]}};
+  }
+
+  case TRACE_ENTRY: {
+    auto const delta = get_varint();
+    auto const value = get_varint();
+
+    if (not delta or not value)
+      break;
+
+    phys_addr_ += zigzag_decode(*delta);
+
+    return trace_entry {phys_addr_, *value};
+  }
+
+  case TRACE_CR3: {
+    auto const value = get_varint();
+
+    if (not value)
+      break;
+
+    return trace_cr3_write {*value};
+  }
+  }
+
+  error_ = true;
+  return {};
+}
+
+vmmu::trace_reader::trace_reader(uint8_t const *data, size_t size) : pos_(data), end_(data + size)
+{
+  if (size < TRACE_MAGIC.size() or not std::equal(TRACE_MAGIC.begin(), TRACE_MAGIC.end(), data)) {
+    error_ = true;
+    return;
+  }
+
+  pos_ += TRACE_MAGIC.size();
+}
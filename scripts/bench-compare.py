@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+"""Compare two result files of `bench --json`.
+
+Usage: bench-compare.py OLD.json NEW.json
+
+Prints the median time per operation of each benchmark in both files and the
+relative change. Benchmarks that only exist in one file are skipped.
+"""
+
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {r["name"]: r["ns_per_op"] for r in json.load(f)}
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+
+    old, new = load(sys.argv[1]), load(sys.argv[2])
+
+    for name in new:
+        if name not in old:
+            continue
+
+        change = (new[name] - old[name]) / old[name] * 100
+        print(f"{name:40} {old[name]:10.2f} {new[name]:10.2f} ns/op {change:+7.1f}%")
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
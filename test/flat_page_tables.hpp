@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+
+// A 4-level page table in flat memory at 0x1000 that maps linear page 0 to
+// 0x123000. The entries on the way have their accessed flags already set, the
+// leaf doesn't. Tests add further entries with entry().
+struct flat_page_tables {
+  std::vector<uint64_t> ram = std::vector<uint64_t>(4 * 512);
+  vmmu::flat_memory memory {{{0x1000, ram.size() * sizeof(uint64_t), ram.data()}}};
+
+  vmmu::paging_state state {vmmu::RFLAGS_RSVD, vmmu::CR0_PG, 0x1000, vmmu::CR4_PAE,
+                            vmmu::EFER_LME,    0};
+
+  uint64_t &entry(uint64_t phys_addr) { return ram[(phys_addr - 0x1000) / sizeof(uint64_t)]; }
+
+  flat_page_tables()
+  {
+    using namespace vmmu;
+
+    entry(0x1000) = 0x2000 | PTE_P | PTE_W | PTE_A;
+    entry(0x2000) = 0x3000 | PTE_P | PTE_W | PTE_A;
+    entry(0x3000) = 0x4000 | PTE_P | PTE_W | PTE_A;
+    entry(0x4000) = 0x123000 | PTE_P | PTE_W;
+  }
+};
@@ -3,10 +3,10 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
-#include <forward_list>
 #include <functional>
 #include <map>
-#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 
 // An exception that is thrown when the memory class is asked to access memory
@@ -24,6 +24,9 @@ struct accessed_uninitialized_memory {
 // operations. This is useful to check whether certain memory locations are not
 // accessed multiple times (TOCTOU bugs!) or whether the correct atomic
 // operations were used.
+//
+// Current values are kept per address next to the log, so reads and counting
+// operations don't scan the whole history and large tests stay fast.
 template <typename WORD>
 class memory
 {
@@ -44,11 +47,6 @@ private:
       return opc < rhs.opc or (opc == rhs.opc and address < rhs.address);
     }
 
-    bool operator==(operation_head const &rhs) const
-    {
-      return opc == rhs.opc and address == rhs.address;
-    }
-
     operation_head() = delete;
     operation_head(operation_type opc_, uint64_t address_) : opc(opc_), address(address_) {}
   };
@@ -68,11 +66,6 @@ private:
       return operation(operation_type::READ, address, value);
     }
 
-    bool matches_read(uint64_t address_) const
-    {
-      return this->opc == operation_type::WRITE and this->address == address_;
-    }
-
   private:
     operation(operation_type opc_, uint64_t address_, WORD value_)
         : operation_head(opc_, address_), value(value_)
@@ -80,9 +73,25 @@ private:
     }
   };
 
-  // Log of all operations. From new to old, i.e. new operations are added to
-  // the front.
-  std::forward_list<operation> history;
+  // Log of all operations from old to new.
+  std::vector<operation> history;
+
+  // Locations are created by their first write.
+  struct location {
+    // The last value that was written.
+    WORD value;
+
+    // The indexes of the operations on this address in the history.
+    std::vector<size_t> operations;
+  };
+
+  std::unordered_map<uint64_t, location> locations;
+
+  void record(location &loc, operation const &op)
+  {
+    loc.operations.push_back(history.size());
+    history.push_back(op);
+  }
 
   using async_handler_fn = std::function<void(this_t *)>;
 
@@ -91,6 +100,9 @@ private:
 
   void maybe_execute_async_handler(operation_head const &op)
   {
+    if (async_handlers.empty())
+      return;
+
     auto node = async_handlers.extract(op);
 
     if (not node)
@@ -122,7 +134,10 @@ public:
     assert(is_naturally_aligned(address));
     async_handler_guard g {this, operation_type::WRITE, address};
 
-    history.emplace_front(operation::write(address, value));
+    location &loc = locations[address];
+
+    loc.value = value;
+    record(loc, operation::write(address, value));
   }
 
   WORD read(uint64_t address)
@@ -130,14 +145,13 @@ public:
     assert(is_naturally_aligned(address));
     async_handler_guard g {this, operation_type::READ, address};
 
-    auto it = std::find_if(history.begin(), history.end(),
-                           [address](auto const &op) { return op.matches_read(address); });
+    auto it = locations.find(address);
 
-    if (it == history.end()) {
+    if (it == locations.end()) {
       throw accessed_uninitialized_memory {address};
     } else {
-      history.emplace_front(operation::read(address, it->value));
-      return it->value;
+      record(it->second, operation::read(address, it->second.value));
+      return it->second.value;
     }
   }
 
@@ -155,6 +169,14 @@ public:
   // Count the number of operations at a given address.
   size_t count_operations(operation_type op_type, uint64_t address) const
   {
-    return std::count(history.begin(), history.end(), operation_head {op_type, address});
+    auto it = locations.find(address);
+
+    if (it == locations.end())
+      return 0;
+
+    auto const &indexes = it->second.operations;
+
+    return std::count_if(indexes.begin(), indexes.end(),
+                         [&](size_t i) { return history[i].opc == op_type; });
   }
 };
@@ -0,0 +1,119 @@
+#include <catch2/catch.hpp>
+#include <thread>
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+}
+
+TEST_CASE("Flat memory accesses are bounds-checked", "[flat_memory]")
+{
+  std::vector<uint64_t> low(512), high(512);
+
+  // Slots are deliberately given out of order.
+  flat_memory mem {{{0x10000, 0x1000, high.data()}, {0, 0x1000, low.data()}}};
+
+  low[1] = 0x1122334455667788;
+  high[0] = 0xcafe;
+
+  SECTION("Reads return the backing memory")
+  {
+    CHECK(mem.read(8, uint64_t {}) == 0x1122334455667788);
+    CHECK(mem.read(8, uint32_t {}) == 0x55667788);
+    CHECK(mem.read(12, uint32_t {}) == 0x11223344);
+    CHECK(mem.read(0x10000, uint64_t {}) == 0xcafe);
+  }
+
+  SECTION("Reads from unbacked memory return all ones")
+  {
+    CHECK(mem.read(0x1000, uint64_t {}) == ~uint64_t(0));
+    CHECK(mem.read(0xfff8, uint32_t {}) == ~uint32_t(0));
+    CHECK(mem.read(0x11000, uint64_t {}) == ~uint64_t(0));
+    CHECK(mem.read(~uint64_t(7), uint64_t {}) == ~uint64_t(0));
+  }
+
+  SECTION("Compare-exchange only succeeds with the expected value")
+  {
+    CHECK_FALSE(mem.cmpxchg(8, uint64_t(0), uint64_t(1)));
+    CHECK(low[1] == 0x1122334455667788);
+
+    CHECK(mem.cmpxchg(8, uint64_t(0x1122334455667788), uint64_t(1)));
+    CHECK(low[1] == 1);
+
+    CHECK(mem.cmpxchg(0x10004, uint32_t(0), uint32_t(2)));
+    CHECK(high[0] == (uint64_t(2) << 32 | 0xcafe));
+  }
+
+  SECTION("Writes to unbacked memory are dropped")
+  {
+    CHECK(mem.cmpxchg(0x1000, uint64_t(0), uint64_t(1)));
+    CHECK(mem.read(0x1000, uint64_t {}) == ~uint64_t(0));
+  }
+
+  SECTION("Entry pointers are only available for backed memory")
+  {
+    CHECK(mem.entry_pointer(0xff8, uint64_t {}) == &low[511]);
+    CHECK(mem.entry_pointer(0x10004, uint32_t {}) ==
+          reinterpret_cast<uint32_t *>(high.data()) + 1);
+    CHECK(mem.entry_pointer(0x1000, uint64_t {}) == nullptr);
+  }
+}
+
+TEST_CASE("Flat memory backs page table walks", "[flat_memory]")
+{
+  std::vector<uint64_t> ram(4 * 512);
+  flat_memory mem {{{0x1000, ram.size() * sizeof(uint64_t), ram.data()}}};
+
+  auto const entry = [&ram](uint64_t phys_addr) -> uint64_t & {
+    return ram[(phys_addr - 0x1000) / sizeof(uint64_t)];
+  };
+
+  entry(0x1000) = 0x2000 | PTE_P | PTE_W;
+  entry(0x2000) = 0x3000 | PTE_P | PTE_W;
+  entry(0x3000) = 0x4000 | PTE_P | PTE_W;
+  entry(0x4008) = 0x123000 | PTE_P | PTE_W;
+
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0x1000, CR4_PAE, EFER_LME, 0};
+
+  SECTION("Walks set accessed and dirty bits")
+  {
+    auto const res = translate({0x1234, access_type::WRITE}, s, &mem);
+
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK(std::get<tlb_entry>(res).phys_addr() == 0x123000);
+
+    for (uint64_t addr : {0x1000, 0x2000, 0x3000, 0x4008})
+      CHECK((entry(addr) & PTE_A) != 0);
+
+    CHECK((entry(0x4008) & PTE_D) != 0);
+    CHECK((entry(0x3000) & PTE_D) == 0);
+  }
+
+  SECTION("Concurrent walks update the page table atomically")
+  {
+    // Each thread sets the dirty bit in its own page table entry, while all
+    // of them set accessed bits in the shared upper levels.
+    unsigned const threads = 4;
+
+    for (uint64_t i = 0; i < threads; i++)
+      entry(0x4000 + 8 * i) = (0x200 + i) << 12 | PTE_P | PTE_W;
+
+    std::vector<std::thread> workers;
+
+    for (uint64_t i = 0; i < threads; i++)
+      workers.emplace_back([&mem, &s, i]() {
+        for (int j = 0; j < 1000; j++)
+          translate({i << 12, access_type::WRITE}, s, &mem);
+      });
+
+    for (auto &w : workers)
+      w.join();
+
+    for (uint64_t i = 0; i < threads; i++)
+      CHECK(entry(0x4000 + 8 * i) == ((0x200 + i) << 12 | PTE_P | PTE_W | PTE_A | PTE_D));
+  }
+}
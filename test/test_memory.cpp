@@ -2,6 +2,8 @@
 // page table walker tests.
 
 #include <catch2/catch.hpp>
+#include <random>
+#include <unordered_map>
 
 #include "memory.hpp"
 
@@ -103,3 +105,42 @@ TEST_CASE("Operations are counted correctly")
   REQUIRE(mem.count_operations(operation_type::WRITE, 0) == 2);
   REQUIRE(mem.count_operations(operation_type::READ, 0) == 1);
 }
+
+TEST_CASE("Long histories don't slow down accesses")
+{
+  memory<uint32_t> mem;
+  std::mt19937_64 rng;
+
+  // The expected value and number of reads and writes of each address.
+  struct expected {
+    uint32_t value;
+    size_t reads;
+    size_t writes;
+  };
+
+  std::unordered_map<uint64_t, expected> model;
+
+  for (int i = 0; i < 500000; i++) {
+    uint64_t const address = rng() % 4096 * 4;
+    auto it = model.find(address);
+
+    if (it == model.end() or rng() % 2) {
+      uint32_t const value = uint32_t(rng());
+
+      mem.write(address, value);
+
+      auto &e = model[address];
+
+      e.value = value;
+      e.writes++;
+    } else {
+      REQUIRE(mem.read(address) == it->second.value);
+      it->second.reads++;
+    }
+  }
+
+  for (auto const &[address, e] : model) {
+    REQUIRE(mem.count_operations(operation_type::READ, address) == e.reads);
+    REQUIRE(mem.count_operations(operation_type::WRITE, address) == e.writes);
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vmmu/vmmu.hpp>
+
+#include "memory.hpp"
+
+// Default implementations for abstract methods that just abort.
+class test_memory_base : public vmmu::abstract_memory
+{
+public:
+  uint32_t read(uint64_t phys_addr, uint32_t) override { __builtin_trap(); }
+  uint64_t read(uint64_t phys_addr, uint64_t) override { __builtin_trap(); }
+
+  bool cmpxchg(uint64_t phys_addr, uint64_t expected, uint64_t new_value) override
+  {
+    __builtin_trap();
+  }
+  bool cmpxchg(uint64_t phys_addr, uint32_t expected, uint32_t new_value) override
+  {
+    __builtin_trap();
+  }
+};
+
+// Exposes the recording memory class to the page table walker. Only accesses
+// with the given word size are supported.
+template <typename WORD>
+class test_memory final : public test_memory_base
+{
+  memory<WORD> mem;
+
+public:
+  WORD read(uint64_t phys_addr, WORD) override { return mem.read(phys_addr); }
+
+  WORD reads(uint64_t phys_addr) { return read(phys_addr, WORD()); }
+
+  void write(uint64_t phys_addr, WORD value) { mem.write(phys_addr, value); }
+
+  bool cmpxchg(uint64_t phys_addr, WORD expected, WORD new_value) override
+  {
+    if (reads(phys_addr) == expected) {
+      write(phys_addr, new_value);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  using operation_type = typename memory<WORD>::operation_type;
+
+  template <typename H>
+  void execute_after(operation_type op_type, uint64_t address, H &&async_handler)
+  {
+    mem.execute_after(op_type, address, std::forward<H>(async_handler));
+  }
+
+  size_t count_operations(operation_type op_type, uint64_t address) const
+  {
+    return mem.count_operations(op_type, address);
+  }
+};
+
+using test_memory_32 = test_memory<uint32_t>;
+
+// A helper function, because catch2 doesn't understand & as operator.
+template <typename WORD, typename WORD2>
+inline bool is_bit_set(WORD v, WORD2 bit)
+{
+  return v & bit;
+}
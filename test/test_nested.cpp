@@ -0,0 +1,354 @@
+#include <catch2/catch.hpp>
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+#include <vmmu/nested.hpp>
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+
+// Forwards to flat memory and counts the page table entries that were read.
+class counting_memory
+{
+  flat_memory &mem_;
+
+public:
+  size_t reads = 0;
+
+  template <typename WORD>
+  WORD read(uint64_t phys_addr, WORD dummy)
+  {
+    reads++;
+    return mem_.read(phys_addr, dummy);
+  }
+
+  template <typename WORD>
+  bool cmpxchg(uint64_t phys_addr, WORD expected, WORD new_value)
+  {
+    return mem_.cmpxchg(phys_addr, expected, new_value);
+  }
+
+  explicit counting_memory(flat_memory &mem) : mem_(mem) {}
+};
+
+// Host memory with an EPT at host-physical address 0 that maps the first 2MB
+// of guest-physical memory with 4KB pages to host-physical GUEST_BASE.
+//
+// The guest has 4-level page tables at guest-physical GUEST_CR3 that map
+// linear page 1 to guest-physical DATA_PAGE and the 2MB linear page at 2MB to
+// guest-physical address 0.
+struct nested_setup {
+  static constexpr uint64_t GUEST_BASE = 0x200000;
+  static constexpr uint64_t GUEST_CR3 = 0x10000;
+  static constexpr uint64_t DATA_PAGE = 0x25000;
+
+  std::vector<uint64_t> ram = std::vector<uint64_t>(0x400000 / sizeof(uint64_t));
+  flat_memory mem {{{0, 0x400000, ram.data()}}};
+  counting_memory counting {mem};
+
+  paging_state const state {RFLAGS_RSVD, CR0_PG, GUEST_CR3, CR4_PAE, EFER_LME, 0};
+
+  uint64_t &host(uint64_t hpa) { return ram[hpa / sizeof(uint64_t)]; }
+  uint64_t &guest(uint64_t gpa) { return host(GUEST_BASE + gpa); }
+
+  // The EPT entry that maps the given guest-physical page.
+  uint64_t &ept_pte(uint64_t gpa) { return host(0x3000 + (gpa >> 12) * sizeof(uint64_t)); }
+
+  nested_setup()
+  {
+    host(0x0000) = 0x1000 | EPT_RWX;
+    host(0x1000) = 0x2000 | EPT_RWX;
+    host(0x2000) = 0x3000 | EPT_RWX;
+
+    for (uint64_t page = 0; page < 512; page++)
+      ept_pte(page << 12) = (GUEST_BASE + (page << 12)) | EPT_RWX;
+
+    guest(GUEST_CR3) = (GUEST_CR3 + 0x1000) | PTE_P | PTE_W | PTE_A;
+    guest(GUEST_CR3 + 0x1000) = (GUEST_CR3 + 0x2000) | PTE_P | PTE_W | PTE_A;
+    guest(GUEST_CR3 + 0x2000) = (GUEST_CR3 + 0x3000) | PTE_P | PTE_W | PTE_A;
+    guest(GUEST_CR3 + 0x2008) = PTE_P | PTE_W | PTE_A | PTE_D | PTE_PS;
+    guest(GUEST_CR3 + 0x3008) = DATA_PAGE | PTE_P | PTE_W | PTE_A;
+  }
+};
+
+}  // namespace
+
+TEST_CASE("Nested translations go through both stages", "[nested]")
+{
+  nested_setup s;
+  ept_state const ept {EPTP_WALK_LENGTH_4};
+
+  SECTION("Guest page table entries are read via the EPT")
+  {
+    auto const res = translate_nested({0x1234, access_type::READ}, s.state, ept, &s.counting);
+
+    REQUIRE(std::holds_alternative<nested_tlb_entry>(res));
+
+    auto const &entry = std::get<nested_tlb_entry>(res);
+
+    CHECK(entry.linear_addr() == 0x1000);
+    CHECK(entry.phys_addr() == s.GUEST_BASE + s.DATA_PAGE);
+    CHECK(entry.size() == 0x1000);
+    CHECK(entry.ept_rights() == EPT_RWX);
+    CHECK(*entry.translate(0x1234) == s.GUEST_BASE + s.DATA_PAGE + 0x234);
+
+    // Four EPT entries for each guest page table entry and for the data page.
+    CHECK(s.counting.reads == 24);
+  }
+
+  SECTION("Guest accessed and dirty flags are set in guest memory")
+  {
+    auto const res = translate_nested({0x1000, access_type::WRITE}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<nested_tlb_entry>(res));
+    CHECK(std::get<nested_tlb_entry>(res).attr().is_d());
+    CHECK(s.guest(s.GUEST_CR3 + 0x3008) & PTE_D);
+
+    // EPT accessed and dirty flags are disabled.
+    CHECK(s.ept_pte(s.DATA_PAGE) == ((s.GUEST_BASE + s.DATA_PAGE) | EPT_RWX));
+  }
+
+  SECTION("Combined translations cover the smaller page")
+  {
+    auto const res =
+        translate_nested({0x200000 + 0x3456, access_type::READ}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<nested_tlb_entry>(res));
+
+    auto const &entry = std::get<nested_tlb_entry>(res);
+
+    CHECK(entry.linear_addr() == 0x203000);
+    CHECK(entry.phys_addr() == s.GUEST_BASE + 0x3000);
+    CHECK(entry.size() == 0x1000);
+  }
+
+  SECTION("Guest paging can be disabled")
+  {
+    paging_state const phys {RFLAGS_RSVD, 0, 0, 0, 0, 0};
+
+    auto const res = translate_nested({0x7123, access_type::EXECUTE}, phys, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<nested_tlb_entry>(res));
+    CHECK(std::get<nested_tlb_entry>(res).linear_addr() == 0x7000);
+    CHECK(std::get<nested_tlb_entry>(res).phys_addr() == s.GUEST_BASE + 0x7000);
+
+    // Guest-physical addresses in the upper half of the address space are not
+    // mapped by the EPT.
+    CHECK(std::holds_alternative<ept_violation_info>(
+        translate_nested({~uint64_t(0xfff), access_type::READ}, phys, ept, &s.mem)));
+  }
+
+  SECTION("Guest page faults are reported")
+  {
+    auto const res = translate_nested({0x2000, access_type::READ}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<page_fault_info>(res));
+    CHECK(std::get<page_fault_info>(res).cr2 == 0x2000);
+  }
+}
+
+TEST_CASE("EPT violations are reported", "[nested]")
+{
+  nested_setup s;
+  ept_state const ept {EPTP_WALK_LENGTH_4};
+
+  SECTION("Accesses to the final guest-physical address")
+  {
+    s.ept_pte(s.DATA_PAGE) &= ~uint64_t(EPT_W);
+
+    auto const res = translate_nested({0x1008, access_type::WRITE}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<ept_violation_info>(res));
+
+    auto const &info = std::get<ept_violation_info>(res);
+
+    CHECK_FALSE(info.misconfiguration);
+    CHECK(info.guest_phys_addr == s.DATA_PAGE + 8);
+    CHECK(info.guest_linear_addr == 0x1008);
+    CHECK(info.qualification == (EPT_QUAL_WRITE | (EPT_R | EPT_X) << EPT_QUAL_RIGHTS_SHIFT |
+                                 EPT_QUAL_GLA_VALID | EPT_QUAL_GLA_TRANSLATION));
+
+    // The guest walk succeeded, so the guest dirty flag is already set.
+    CHECK(s.guest(s.GUEST_CR3 + 0x3008) & PTE_D);
+  }
+
+  SECTION("Accesses to guest page tables")
+  {
+    s.ept_pte(s.GUEST_CR3 + 0x3000) = 0;
+
+    auto const res = translate_nested({0x1000, access_type::READ}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<ept_violation_info>(res));
+
+    auto const &info = std::get<ept_violation_info>(res);
+
+    CHECK(info.guest_phys_addr == s.GUEST_CR3 + 0x3008);
+    CHECK(info.qualification == (EPT_QUAL_READ | EPT_QUAL_GLA_VALID));
+  }
+
+  SECTION("Guest accessed flag updates need write access")
+  {
+    s.guest(s.GUEST_CR3 + 0x3008) &= ~uint64_t(PTE_A);
+    s.ept_pte(s.GUEST_CR3 + 0x3000) &= ~uint64_t(EPT_W);
+
+    auto const res = translate_nested({0x1000, access_type::READ}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<ept_violation_info>(res));
+
+    auto const &info = std::get<ept_violation_info>(res);
+
+    CHECK(info.guest_phys_addr == s.GUEST_CR3 + 0x3008);
+    CHECK(info.qualification == (EPT_QUAL_WRITE | (EPT_R | EPT_X) << EPT_QUAL_RIGHTS_SHIFT |
+                                 EPT_QUAL_GLA_VALID));
+    CHECK_FALSE(s.guest(s.GUEST_CR3 + 0x3008) & PTE_A);
+  }
+
+  SECTION("Write-only entries are misconfigured")
+  {
+    s.ept_pte(s.DATA_PAGE) = (s.GUEST_BASE + s.DATA_PAGE) | EPT_W;
+
+    auto const res = translate_nested({0x1000, access_type::READ}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<ept_violation_info>(res));
+    CHECK(std::get<ept_violation_info>(res).misconfiguration);
+  }
+}
+
+TEST_CASE("EPT accessed and dirty flags are maintained", "[nested]")
+{
+  nested_setup s;
+  ept_state const ept {EPTP_WALK_LENGTH_4 | EPTP_AD};
+
+  REQUIRE(std::holds_alternative<nested_tlb_entry>(
+      translate_nested({0x1000, access_type::READ}, s.state, ept, &s.mem)));
+
+  CHECK(s.host(0) & EPT_A);
+  CHECK(s.ept_pte(s.DATA_PAGE) & EPT_A);
+  CHECK_FALSE(s.ept_pte(s.DATA_PAGE) & EPT_D);
+
+  // Accesses to guest page tables count as writes.
+  CHECK(s.ept_pte(s.GUEST_CR3 + 0x3000) & EPT_D);
+
+  auto const res = translate_nested({0x1000, access_type::WRITE}, s.state, ept, &s.mem);
+
+  REQUIRE(std::holds_alternative<nested_tlb_entry>(res));
+  CHECK(std::get<nested_tlb_entry>(res).attr().is_d());
+  CHECK(s.ept_pte(s.DATA_PAGE) & EPT_D);
+}
+
+TEST_CASE("Guest-physical translations are cached", "[nested]")
+{
+  nested_setup s;
+  ept_state const ept {EPTP_WALK_LENGTH_4};
+  ept_cache cache;
+
+  auto const res = translate_guest_phys(0x5123, access_type::READ, ept, &s.counting, &cache);
+
+  REQUIRE(std::holds_alternative<ept_entry>(res));
+  CHECK(*std::get<ept_entry>(res).translate(0x5123) == s.GUEST_BASE + 0x5123);
+  CHECK(s.counting.reads == 4);
+
+  SECTION("Cached translations are reused")
+  {
+    translate_guest_phys(0x5000, access_type::WRITE, ept, &s.counting, &cache);
+    CHECK(s.counting.reads == 4);
+  }
+
+  SECTION("Other EPT pointers don't share translations")
+  {
+    translate_guest_phys(0x5000, access_type::READ, ept_state {EPTP_WALK_LENGTH_4 | EPTP_AD},
+                         &s.counting, &cache);
+    CHECK(s.counting.reads == 8);
+  }
+
+  SECTION("The cache can be cleared")
+  {
+    cache.clear();
+    translate_guest_phys(0x5000, access_type::READ, ept, &s.counting, &cache);
+    CHECK(s.counting.reads == 8);
+  }
+}
+
+TEST_CASE("Nested TLBs cache combined translations", "[nested]")
+{
+  nested_setup s;
+  ept_state const ept {EPTP_WALK_LENGTH_4};
+  nested_tlb<16, 4> tlb;
+
+  auto const translate = [&](uint64_t la, access_type type) {
+    auto const res = tlb.translate({la, type}, s.state, ept, &s.counting);
+
+    return std::holds_alternative<nested_tlb_entry>(res);
+  };
+
+  REQUIRE(translate(0x1000, access_type::READ));
+  REQUIRE(s.counting.reads == 24);
+
+  SECTION("Hits skip both stages")
+  {
+    CHECK(translate(0x1fff, access_type::READ));
+    CHECK(s.counting.reads == 24);
+  }
+
+  SECTION("Misses reuse the EPT cache")
+  {
+    tlb.invlpg(0x1000, s.state);
+
+    CHECK(translate(0x1000, access_type::READ));
+
+    // INVLPG also drops the paging-structure cache entries, so the guest page
+    // table is walked again, but all guest-physical translations are cached.
+    CHECK(s.counting.reads == 28);
+  }
+
+  SECTION("EPT access rights are checked on hits")
+  {
+    // Without CR0.WP, supervisor writes ignore the guest W flag, but not the
+    // EPT.
+    s.ept_pte(s.DATA_PAGE) &= ~uint64_t(EPT_W);
+    tlb.invept();
+
+    paging_state const no_wp {RFLAGS_RSVD, CR0_PG, s.GUEST_CR3, CR4_PAE, EFER_LME, 0};
+
+    REQUIRE(std::holds_alternative<nested_tlb_entry>(
+        tlb.translate({0x1000, access_type::READ}, no_wp, ept, &s.mem)));
+    CHECK(std::holds_alternative<ept_violation_info>(
+        tlb.translate({0x1000, access_type::WRITE}, no_wp, ept, &s.mem)));
+  }
+
+  SECTION("EPT changes need invept")
+  {
+    s.ept_pte(s.DATA_PAGE) = 0;
+
+    CHECK(translate(0x1000, access_type::READ));
+
+    tlb.invept();
+
+    CHECK_FALSE(translate(0x1000, access_type::READ));
+  }
+
+  SECTION("invept drops page table pointers that were read through the EPT")
+  {
+    // Move the guest page directory to another host page, whose page table
+    // maps linear page 1 to the next guest-physical page.
+    uint64_t const pd = s.GUEST_CR3 + 0x2000;
+    uint64_t const moved_pd = 0x30000;
+
+    s.ept_pte(pd) = (s.GUEST_BASE + moved_pd) | EPT_RWX;
+    s.guest(moved_pd) = (s.GUEST_CR3 + 0x4000) | PTE_P | PTE_W | PTE_A;
+    s.guest(s.GUEST_CR3 + 0x4008) = (s.DATA_PAGE + 0x1000) | PTE_P | PTE_W | PTE_A;
+
+    tlb.invept();
+
+    auto const res = tlb.translate({0x1000, access_type::READ}, s.state, ept, &s.mem);
+    auto const uncached = translate_nested({0x1000, access_type::READ}, s.state, ept, &s.mem);
+
+    REQUIRE(std::holds_alternative<nested_tlb_entry>(res));
+    REQUIRE(std::holds_alternative<nested_tlb_entry>(uncached));
+    CHECK(std::get<nested_tlb_entry>(res).phys_addr() == s.GUEST_BASE + s.DATA_PAGE + 0x1000);
+    CHECK(std::get<nested_tlb_entry>(res).phys_addr() ==
+          std::get<nested_tlb_entry>(uncached).phys_addr());
+  }
+}
@@ -0,0 +1,157 @@
+#include <catch2/catch.hpp>
+#include <vmmu/vmmu.hpp>
+
+using namespace vmmu;
+using namespace vmmu::internal;
+
+namespace
+{
+void require_same_state(paging_state const &a, paging_state const &b)
+{
+  REQUIRE(a.get_cr3() == b.get_cr3());
+  REQUIRE(a.get_cr0_wp() == b.get_cr0_wp());
+  REQUIRE(a.get_cr0_pg() == b.get_cr0_pg());
+  REQUIRE(a.get_cr4_pse() == b.get_cr4_pse());
+  REQUIRE(a.get_cr4_pae() == b.get_cr4_pae());
+  REQUIRE(a.get_cr4_pge() == b.get_cr4_pge());
+  REQUIRE(a.get_cr4_pcide() == b.get_cr4_pcide());
+  REQUIRE(a.get_cr4_smep() == b.get_cr4_smep());
+  REQUIRE(a.get_cr4_smap() == b.get_cr4_smap());
+  REQUIRE(a.get_efer_lme() == b.get_efer_lme());
+  REQUIRE(a.get_efer_nxe() == b.get_efer_nxe());
+  REQUIRE(a.get_rflags_ac() == b.get_rflags_ac());
+  REQUIRE(a.is_supervisor() == b.is_supervisor());
+  REQUIRE(a.get_paging_mode() == b.get_paging_mode());
+  REQUIRE(a.get_walker() == b.get_walker());
+
+  for (unsigned index = 0; index < PERM_INDEXES; index++)
+    REQUIRE(a.permits(index) == b.permits(index));
+}
+
+}  // namespace
+
+TEST_CASE("Paging state computes the paging mode", "[paging_state]")
+{
+  CHECK(paging_state(RFLAGS_RSVD, 0, 0, CR4_PAE, EFER_LME, 0).get_paging_mode() ==
+        paging_mode::PHYS);
+  CHECK(paging_state(RFLAGS_RSVD, CR0_PG, 0, 0, EFER_LME, 0).get_paging_mode() ==
+        paging_mode::PM32);
+  CHECK(paging_state(RFLAGS_RSVD, CR0_PG, 0, CR4_PAE, 0, 0).get_paging_mode() ==
+        paging_mode::PM32_PAE);
+  CHECK(paging_state(RFLAGS_RSVD, CR0_PG, 0, CR4_PAE, EFER_LME, 0).get_paging_mode() ==
+        paging_mode::PM64_4LEVEL);
+}
+
+TEST_CASE("Paging state setters report changes", "[paging_state]")
+{
+  paging_state s {RFLAGS_RSVD, 0, 0x1000, CR4_PAE, 0, 0};
+
+  SECTION("Mode changes are reported")
+  {
+    CHECK(s.set_efer(EFER_LME) == 0);
+    CHECK(s.get_paging_mode() == paging_mode::PHYS);
+
+    CHECK(s.set_cr0(CR0_PG) == paging_state::CHANGE_MODE);
+    CHECK(s.get_paging_mode() == paging_mode::PM64_4LEVEL);
+
+    CHECK(s.set_cr4(0) == paging_state::CHANGE_MODE);
+    CHECK(s.get_paging_mode() == paging_mode::PM32);
+  }
+
+  SECTION("Writing the same value changes nothing")
+  {
+    CHECK(s.set_cr0(0) == 0);
+    CHECK(s.set_cr3(0x1000) == 0);
+    CHECK(s.set_cr4(CR4_PAE) == 0);
+    CHECK(s.set_efer(0) == 0);
+  }
+
+  SECTION("Bits that don't affect paging are ignored")
+  {
+    CHECK(s.set_cr0(uint64_t(1) << 0) == 0);
+    CHECK(s.set_cr3(0x1000 | CR3_NOFLUSH) == 0);
+    CHECK(s.set_cr4(CR4_PAE | CR4_PKE) == 0);
+  }
+
+  SECTION("CR3 changes are reported")
+  {
+    CHECK(s.set_cr3(0x2000) == paging_state::CHANGE_CR3);
+    CHECK(s.get_cr3() == 0x2000);
+  }
+
+  SECTION("Access right changes are reported")
+  {
+    CHECK(s.set_cr0(CR0_WP) == paging_state::CHANGE_ACCESS_RIGHTS);
+    CHECK(s.set_cr4(CR4_PAE | CR4_SMEP) == paging_state::CHANGE_ACCESS_RIGHTS);
+    CHECK(s.set_cr4(CR4_PAE | CR4_SMEP | CR4_SMAP) == paging_state::CHANGE_ACCESS_RIGHTS);
+    CHECK(s.set_efer(EFER_NXE) == paging_state::CHANGE_ACCESS_RIGHTS);
+  }
+
+  SECTION("Translation changes are reported")
+  {
+    CHECK(s.set_cr4(CR4_PAE | CR4_PSE) == paging_state::CHANGE_TRANSLATION);
+    CHECK(s.set_cr4(CR4_PAE | CR4_PSE | CR4_PGE) == paging_state::CHANGE_TRANSLATION);
+    CHECK(s.set_cr4(CR4_PAE | CR4_PSE | CR4_PGE | CR4_PCIDE) == paging_state::CHANGE_TRANSLATION);
+  }
+
+  SECTION("Combined changes are reported together")
+  {
+    CHECK(s.set_cr0(CR0_PG | CR0_WP) ==
+          (paging_state::CHANGE_MODE | paging_state::CHANGE_ACCESS_RIGHTS));
+  }
+}
+
+TEST_CASE("Paging state updates match construction", "[paging_state]")
+{
+  paging_state s {RFLAGS_RSVD, 0, 0, 0, 0, 0};
+
+  // Go through all combinations of control bits in an order that toggles
+  // different bits in each step.
+  for (unsigned i = 0; i < 1024; i++) {
+    unsigned const controls = (i * 167) % 1024;
+    auto bit = [controls](unsigned b, uint64_t value) { return (controls >> b) & 1 ? value : 0; };
+
+    uint64_t const rflags = RFLAGS_RSVD | bit(0, RFLAGS_AC);
+    uint64_t const cr0 = bit(1, CR0_PG) | bit(2, CR0_WP);
+    uint64_t const cr4 = bit(3, CR4_PAE) | bit(4, CR4_SMEP) | bit(5, CR4_SMAP) | bit(6, CR4_PSE);
+    uint64_t const efer = bit(7, EFER_LME) | bit(8, EFER_NXE);
+    unsigned const cpl = (controls >> 9) & 1 ? 0 : 3;
+
+    s.set_cr4(cr4);
+    s.set_efer(efer);
+    s.set_cr0(cr0);
+    s.set_rflags(rflags);
+    s.set_cpl(cpl);
+
+    INFO("controls " << controls);
+    require_same_state(s, paging_state {rflags, cr0, 0, cr4, efer, cpl});
+  }
+}
+
+TEST_CASE("CPL and RFLAGS.AC select access rights", "[paging_state]")
+{
+  using access_type = linear_memory_op::access_type;
+
+  paging_state s {RFLAGS_RSVD, CR0_PG, 0, CR4_SMAP, 0, 0};
+
+  tlb_entry const user_page {0, 0, 12, {false, true, false, true}};
+  tlb_entry const supervisor_page {0x1000, 0, 12, {false, false, false, true}};
+
+  linear_memory_op const user_read {0, access_type::READ};
+  linear_memory_op const supervisor_read {0x1000, access_type::READ};
+
+  CHECK_FALSE(user_page.allows(user_read, s));
+  CHECK(supervisor_page.allows(supervisor_read, s));
+
+  // STAC
+  s.set_rflags(RFLAGS_RSVD | RFLAGS_AC);
+  CHECK(user_page.allows(user_read, s));
+
+  // CLAC
+  s.set_rflags(RFLAGS_RSVD);
+  CHECK_FALSE(user_page.allows(user_read, s));
+
+  s.set_cpl(3);
+  CHECK(user_page.allows(user_read, s));
+  CHECK_FALSE(supervisor_page.allows(supervisor_read, s));
+}
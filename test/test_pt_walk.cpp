@@ -1,76 +1,11 @@
 #include <catch2/catch.hpp>
+#include <vector>
 #include <vmmu/vmmu.hpp>
 
-#include "memory.hpp"
+#include "test_memory.hpp"
 
 using namespace vmmu;
 
-namespace
-{
-// Default implementations for abstract methods that just abort.
-class test_memory_base : public abstract_memory
-{
-public:
-  uint32_t read(uint64_t phys_addr, uint32_t) override { __builtin_trap(); }
-  uint64_t read(uint64_t phys_addr, uint64_t) override { __builtin_trap(); }
-
-  bool cmpxchg(uint64_t phys_addr, uint64_t expected, uint64_t new_value) override
-  {
-    __builtin_trap();
-  }
-  bool cmpxchg(uint64_t phys_addr, uint32_t expected, uint32_t new_value) override
-  {
-    __builtin_trap();
-  }
-};
-
-template <typename WORD>
-class test_memory final : public test_memory_base
-{
-  memory<WORD> mem;
-
-public:
-  WORD read(uint64_t phys_addr, WORD) override { return mem.read(phys_addr); }
-
-  WORD reads(uint64_t phys_addr) { return read(phys_addr, WORD()); }
-
-  void write(uint64_t phys_addr, WORD value) { mem.write(phys_addr, value); }
-
-  bool cmpxchg(uint64_t phys_addr, WORD expected, WORD new_value) override
-  {
-    if (reads(phys_addr) == expected) {
-      write(phys_addr, new_value);
-      return true;
-    } else {
-      return false;
-    }
-  }
-
-  using operation_type = typename memory<WORD>::operation_type;
-
-  template <typename H>
-  void execute_after(operation_type op_type, uint64_t address, H &&async_handler)
-  {
-    mem.execute_after(op_type, address, std::forward<H>(async_handler));
-  }
-
-  size_t count_operations(operation_type op_type, uint64_t address) const
-  {
-    return mem.count_operations(op_type, address);
-  }
-};
-
-using test_memory_32 = test_memory<uint32_t>;
-
-// A helper function, because catch2 doesn't understand & as operator.
-template <typename WORD, typename WORD2>
-static bool is_bit_set(WORD v, WORD2 bit)
-{
-  return v & bit;
-}
-
-}  // namespace
-
 TEST_CASE("Disabled paging works", "[translate]")
 {
   paging_state const s {RFLAGS_RSVD, 0, 0, 0, 0, 0};
@@ -267,6 +202,400 @@ TEST_CASE("Dirty bit is set correctly")
   }
 }
 
+TEST_CASE("Global bit is recorded in leaf entries", "[translate]")
+{
+  test_memory_32 mem;
+
+  auto const translate_global = [&mem](uint64_t cr4) {
+    paging_state const s {RFLAGS_RSVD, CR0_PG, 0, cr4, 0, 0};
+
+    auto res = translate({0, linear_memory_op::access_type::READ}, s, &mem);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    return std::get<tlb_entry>(res).attr().is_g();
+  };
+
+  SECTION("Global leaf entries are recognized with CR4.PGE")
+  {
+    mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A));
+    mem.write(0x1000, uint32_t(PTE_P | PTE_A | PTE_G));
+
+    CHECK(translate_global(CR4_PGE));
+  }
+
+  SECTION("Global bit is ignored without CR4.PGE")
+  {
+    mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A));
+    mem.write(0x1000, uint32_t(PTE_P | PTE_A | PTE_G));
+
+    CHECK_FALSE(translate_global(0));
+  }
+
+  SECTION("Global bit in non-leaf entries is ignored")
+  {
+    mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A | PTE_G));
+    mem.write(0x1000, uint32_t(PTE_P | PTE_A));
+
+    CHECK_FALSE(translate_global(CR4_PGE));
+  }
+}
+
+namespace
+{
+// A backend that only hands out host pointers into a flat array. The read and
+// cmpxchg methods inherited from test_memory_base trap.
+class pointer_memory final : public test_memory_base
+{
+public:
+  std::array<uint32_t, 0x1000> words {};
+
+  uint32_t *entry_pointer(uint64_t phys_addr, uint32_t) override
+  {
+    return &words.at(phys_addr / sizeof(uint32_t));
+  }
+};
+}  // namespace
+
+TEST_CASE("Page table entries are accessed via host pointers", "[translate]")
+{
+  paging_state const s {RFLAGS_RSVD, CR0_PG | CR0_WP, 0, 0, 0, 0};
+  pointer_memory mem;
+
+  mem.words[0] = 0x1000 | uint32_t(PTE_P | PTE_W);
+  mem.words[0x1000 / 4 + 1] = 0xA000 | uint32_t(PTE_P | PTE_W);
+
+  auto res = translate({0x1234, linear_memory_op::access_type::WRITE}, s, &mem);
+  REQUIRE(std::holds_alternative<tlb_entry>(res));
+  CHECK(std::get<tlb_entry>(res).phys_addr() == 0xA000);
+
+  CHECK(mem.words[0] == (0x1000 | uint32_t(PTE_P | PTE_W | PTE_A)));
+  CHECK(mem.words[0x1000 / 4 + 1] == (0xA000 | uint32_t(PTE_P | PTE_W | PTE_A | PTE_D)));
+}
+
+namespace
+{
+// A memory backend that is not derived from abstract_memory and can only be
+// used with the templated translate.
+struct array_memory {
+  std::array<uint64_t, 0x1000> words {};
+
+  uint64_t read(uint64_t phys_addr, uint64_t) { return words.at(phys_addr / sizeof(uint64_t)); }
+
+  bool cmpxchg(uint64_t phys_addr, uint64_t expected, uint64_t new_value)
+  {
+    uint64_t &word = words.at(phys_addr / sizeof(uint64_t));
+
+    if (word != expected)
+      return false;
+
+    word = new_value;
+    return true;
+  }
+
+  // 32-bit accesses are needed to instantiate 32-bit paging, but never used
+  // in this test.
+  uint32_t read(uint64_t, uint32_t) { __builtin_trap(); }
+  bool cmpxchg(uint64_t, uint32_t, uint32_t) { __builtin_trap(); }
+};
+}  // namespace
+
+TEST_CASE("Memory backends don't need to derive from abstract_memory", "[translate]")
+{
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0x1000, CR4_PAE, EFER_LME, 0};
+  array_memory mem;
+
+  mem.words[0x1000 / 8] = 0x2000 | PTE_P | PTE_W;
+  mem.words[0x2000 / 8] = 0x3000 | PTE_P | PTE_W;
+  mem.words[0x3000 / 8] = 0x4000 | PTE_P | PTE_W;
+  mem.words[0x4000 / 8 + 1] = 0xA000 | PTE_P | PTE_W;
+
+  auto res = translate({0x1234, linear_memory_op::access_type::WRITE}, s, &mem);
+  REQUIRE(std::holds_alternative<tlb_entry>(res));
+  CHECK(std::get<tlb_entry>(res).phys_addr() == 0xA000);
+
+  CHECK(mem.words[0x1000 / 8] == (0x2000 | PTE_P | PTE_W | PTE_A));
+  CHECK(mem.words[0x4000 / 8 + 1] == (0xA000 | PTE_P | PTE_W | PTE_A | PTE_D));
+
+  SECTION("TLBs accept the same backends")
+  {
+    set_assoc_tlb<4, 2> tlb;
+
+    res = tlb.translate({0x1234, linear_memory_op::access_type::READ}, s, &mem);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK(std::get<tlb_entry>(res).phys_addr() == 0xA000);
+  }
+}
+
+TEST_CASE("The virtual and templated translate agree", "[translate]")
+{
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0, 0, 0, 0};
+  test_memory_32 mem;
+
+  mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A));
+  mem.write(0x1004, 0xA000 | uint32_t(PTE_P | PTE_A));
+  mem.write(0x1008, 0);
+
+  abstract_memory *virtual_mem = &mem;
+
+  for (uint64_t la : {0x1234, 0x2234}) {
+    auto const direct = translate({la, linear_memory_op::access_type::READ}, s, &mem);
+    auto const indirect = translate({la, linear_memory_op::access_type::READ}, s, virtual_mem);
+
+    REQUIRE(direct.index() == indirect.index());
+
+    if (std::holds_alternative<tlb_entry>(direct))
+      CHECK(std::get<tlb_entry>(direct).phys_addr() == std::get<tlb_entry>(indirect).phys_addr());
+    else
+      CHECK(std::get<page_fault_info>(direct).error_code ==
+            std::get<page_fault_info>(indirect).error_code);
+  }
+}
+
 // TODO Test ignored bits in CR3.
 // TODO Test reserved bits in page table entries (even those that depend on PS bit).
 // TODO Test setting A/D bits, D bits should only be set if translation succeeds
+
+TEST_CASE("Paging-structure caches skip upper levels", "[translate]")
+{
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0x1000, CR4_PAE, EFER_LME, 0};
+  test_memory<uint64_t> mem;
+  paging_structure_cache psc;
+
+  using operation_type = test_memory<uint64_t>::operation_type;
+
+  // Two page directories below a single PDPT. Accessed bits are already set,
+  // so the walker doesn't write to the upper levels.
+  mem.write(0x1000, 0x2000 | PTE_P | PTE_A);
+  mem.write(0x2000, 0x3000 | PTE_P | PTE_A);
+  mem.write(0x2008, 0x5000 | PTE_P | PTE_A);
+  mem.write(0x3000, 0x4000 | PTE_P | PTE_A);
+  mem.write(0x5000, 0x6000 | PTE_P | PTE_A);
+
+  for (uint64_t pte = 0; pte < 16; pte++) {
+    mem.write(0x4000 + pte * 8, (0x100 + pte) << 12 | PTE_P | PTE_A);
+    mem.write(0x6000 + pte * 8, (0x200 + pte) << 12 | PTE_P | PTE_A);
+  }
+
+  auto const translate_page = [&](uint64_t la) {
+    auto res = translate({la, linear_memory_op::access_type::READ}, s, &mem, &psc);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    return std::get<tlb_entry>(res).phys_addr();
+  };
+
+  SECTION("Pages below the same page directory only read their PTE")
+  {
+    for (uint64_t pte = 0; pte < 16; pte++) {
+      CHECK(translate_page(pte << 12) == (0x100 + pte) << 12);
+      CHECK(mem.count_operations(operation_type::READ, 0x4000 + pte * 8) == 1);
+    }
+
+    CHECK(mem.count_operations(operation_type::READ, 0x1000) == 1);
+    CHECK(mem.count_operations(operation_type::READ, 0x2000) == 1);
+    CHECK(mem.count_operations(operation_type::READ, 0x3000) == 1);
+  }
+
+  SECTION("Walks start at the lowest cached level")
+  {
+    CHECK(translate_page(0) == 0x100000);
+    CHECK(translate_page(1 << 30) == 0x200000);
+
+    CHECK(mem.count_operations(operation_type::READ, 0x1000) == 1);
+    CHECK(mem.count_operations(operation_type::READ, 0x2008) == 1);
+  }
+
+  SECTION("Cleared caches result in full walks")
+  {
+    translate_page(0);
+    psc.clear();
+    translate_page(0);
+
+    CHECK(mem.count_operations(operation_type::READ, 0x1000) == 2);
+  }
+
+  SECTION("Permissions of cached levels are combined with the leaf")
+  {
+    mem.write(0x1000, 0x2000 | PTE_P | PTE_A | PTE_W | PTE_U);
+    mem.write(0x2000, 0x3000 | PTE_P | PTE_A | PTE_W);
+    mem.write(0x3000, 0x4000 | PTE_P | PTE_A | PTE_W | PTE_U);
+    mem.write(0x4008, 0x101000 | PTE_P | PTE_A | PTE_W | PTE_U);
+
+    paging_state const user {RFLAGS_RSVD, CR0_PG, 0x1000, CR4_PAE, EFER_LME, 3};
+
+    translate_page(0);
+
+    auto res = translate({0x1000, linear_memory_op::access_type::READ}, user, &mem, &psc);
+    CHECK(std::holds_alternative<page_fault_info>(res));
+  }
+}
+
+TEST_CASE("Batches of operations are translated together", "[translate]")
+{
+  paging_state const s {RFLAGS_RSVD, CR0_PG | CR0_WP, 0x1000, CR4_PAE, EFER_LME, 0};
+  test_memory<uint64_t> mem;
+
+  using access_type = linear_memory_op::access_type;
+  using operation_type = test_memory<uint64_t>::operation_type;
+
+  mem.write(0x1000, 0x2000 | PTE_P | PTE_W | PTE_A);
+  mem.write(0x2000, 0x3000 | PTE_P | PTE_W | PTE_A);
+  mem.write(0x3000, 0x4000 | PTE_P | PTE_W | PTE_A);
+  mem.write(0x4000, 0x10000 | PTE_P | PTE_W | PTE_A);
+  mem.write(0x4008, 0x11000 | PTE_P | PTE_W | PTE_A);
+  mem.write(0x4010, 0);
+  mem.write(0x4018, 0x13000 | PTE_P | PTE_A | PTE_D);
+
+  std::vector<linear_memory_op> const ops {
+      {0x1000, access_type::READ},  {0x1008, access_type::READ}, {0x2000, access_type::READ},
+      {0x3000, access_type::READ},  {0x3008, access_type::WRITE}, {0x0, access_type::READ},
+      {0x0010, access_type::WRITE}, {0x0018, access_type::READ},
+  };
+
+  std::vector<translate_result> results(ops.size());
+  translate_batch(ops.data(), ops.size(), s, &mem, results.data());
+
+  auto const phys_addr = [&results](size_t i) {
+    REQUIRE(std::holds_alternative<tlb_entry>(results[i]));
+    return std::get<tlb_entry>(results[i]).phys_addr();
+  };
+
+  SECTION("Results match individual translations")
+  {
+    CHECK(phys_addr(0) == 0x11000);
+    CHECK(phys_addr(1) == 0x11000);
+    CHECK(phys_addr(5) == 0x10000);
+    CHECK(phys_addr(6) == 0x10000);
+    CHECK(phys_addr(7) == 0x10000);
+
+    REQUIRE(std::holds_alternative<page_fault_info>(results[2]));
+    CHECK(std::get<page_fault_info>(results[2]).error_code == 0);
+
+    REQUIRE(std::holds_alternative<page_fault_info>(results[4]));
+    CHECK(std::get<page_fault_info>(results[4]).error_code == (EC_P | EC_W));
+  }
+
+  SECTION("Operations on the same page share a walk")
+  {
+    CHECK(mem.count_operations(operation_type::READ, 0x4008) == 1);
+  }
+
+  SECTION("Upper levels are only read once")
+  {
+    CHECK(mem.count_operations(operation_type::READ, 0x1000) == 1);
+    CHECK(mem.count_operations(operation_type::READ, 0x2000) == 1);
+    CHECK(mem.count_operations(operation_type::READ, 0x3000) == 1);
+  }
+
+  SECTION("Writes to clean pages still set the dirty bit")
+  {
+    CHECK(is_bit_set(mem.reads(0x4000), PTE_D));
+    CHECK(std::get<tlb_entry>(results[6]).attr().is_d());
+  }
+}
+
+TEST_CASE("Linear memory ranges are translated to physical segments", "[translate]")
+{
+  paging_state const s {RFLAGS_RSVD, CR0_PG | CR0_WP, 0, CR4_PSE, 0, 0};
+  test_memory_32 mem;
+
+  using access_type = linear_memory_op::access_type;
+
+  // Pages 0 and 1 are physically contiguous, page 2 is not and page 3 is not
+  // present. The 4MB page at 4MB follows the page table.
+  mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_W | PTE_A));
+  mem.write(4, 0x800000 | uint32_t(PTE_P | PTE_W | PTE_A | PTE_PS));
+  mem.write(0x1000, 0x10000 | uint32_t(PTE_P | PTE_W | PTE_A));
+  mem.write(0x1004, 0x11000 | uint32_t(PTE_P | PTE_W | PTE_A));
+  mem.write(0x1008, 0x20000 | uint32_t(PTE_P | PTE_A));
+  mem.write(0x100c, 0);
+  mem.write(0x1ffc, 0x30000 | uint32_t(PTE_P | PTE_W | PTE_A));
+
+  auto const segments = [&](uint64_t la, uint64_t length, access_type type) {
+    std::vector<phys_segment> seg {{0xdead, 1}};
+    REQUIRE_FALSE(translate_range({la, type}, length, s, &mem, seg));
+    return seg;
+  };
+
+  SECTION("Empty ranges have no segments")
+  {
+    CHECK(segments(0x123, 0, access_type::READ).empty());
+  }
+
+  SECTION("Ranges within a page have a single segment")
+  {
+    auto const seg = segments(0x123, 0x10, access_type::READ);
+
+    REQUIRE(seg.size() == 1);
+    CHECK(seg[0].phys_addr == 0x10123);
+    CHECK(seg[0].length == 0x10);
+  }
+
+  SECTION("Physically contiguous pages are merged")
+  {
+    auto const seg = segments(0x800, 0x2000, access_type::READ);
+
+    REQUIRE(seg.size() == 2);
+    CHECK(seg[0].phys_addr == 0x10800);
+    CHECK(seg[0].length == 0x1800);
+    CHECK(seg[1].phys_addr == 0x20000);
+    CHECK(seg[1].length == 0x800);
+  }
+
+  SECTION("Large pages are covered by one segment")
+  {
+    auto const seg = segments(0x3ff000, 0x201000, access_type::READ);
+
+    REQUIRE(seg.size() == 2);
+    CHECK(seg[0].phys_addr == 0x30000);
+    CHECK(seg[0].length == 0x1000);
+    CHECK(seg[1].phys_addr == 0x800000);
+    CHECK(seg[1].length == 0x200000);
+  }
+
+  SECTION("The first fault is reported")
+  {
+    std::vector<phys_segment> seg;
+    auto const pf = translate_range({0x1ff0, access_type::WRITE}, 0x2000, s, &mem, seg);
+
+    REQUIRE(pf);
+    CHECK(pf->cr2 == 0x2000);
+    CHECK(pf->error_code == (EC_P | EC_W));
+
+    // The segments cover the range up to the fault.
+    REQUIRE(seg.size() == 1);
+    CHECK(seg[0].phys_addr == 0x11ff0);
+    CHECK(seg[0].length == 0x10);
+  }
+
+  SECTION("Faults behind the range don't matter")
+  {
+    CHECK(segments(0x2000, 0x1000, access_type::READ).size() == 1);
+  }
+}
+
+TEST_CASE("Linear memory ranges without paging cover the whole address space", "[translate]")
+{
+  paging_state const s {RFLAGS_RSVD, 0, 0, 0, 0, 0};
+  test_memory_32 mem;
+  std::vector<phys_segment> seg;
+
+  using access_type = linear_memory_op::access_type;
+
+  SECTION("Ranges cross the middle of the address space")
+  {
+    uint64_t const la = (uint64_t(1) << 63) - 0x1000;
+
+    REQUIRE_FALSE(translate_range({la, access_type::READ}, 0x2000, s, &mem, seg));
+    REQUIRE(seg.size() == 1);
+    CHECK(seg[0].phys_addr == la);
+    CHECK(seg[0].length == 0x2000);
+  }
+
+  SECTION("Ranges end at the top of the address space")
+  {
+    uint64_t const la = ~uint64_t(0xfff);
+
+    REQUIRE_FALSE(translate_range({la, access_type::READ}, 0x2000, s, &mem, seg));
+    REQUIRE(seg.size() == 1);
+    CHECK(seg[0].phys_addr == la);
+    CHECK(seg[0].length == 0x1000);
+  }
+}
@@ -0,0 +1,344 @@
+#include <catch2/catch.hpp>
+#include <set>
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+#include <vmmu/shadow.hpp>
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+
+constexpr uint64_t GUEST_SIZE = 0x400000;
+
+// Guest-physical memory is backed by host-physical memory at HOST_BASE. Shadow
+// page tables are allocated from a pool at POOL_BASE.
+constexpr uint64_t HOST_BASE = 0x40000000;
+constexpr uint64_t POOL_BASE = 0x80000000;
+constexpr size_t POOL_PAGES = 64;
+
+// An in-memory stand-in for the embedder.
+class test_hooks final : public shadow_hooks
+{
+  std::vector<bool> allocated_ = std::vector<bool>(POOL_PAGES);
+
+public:
+  std::vector<uint64_t> pool = std::vector<uint64_t>(POOL_PAGES * 512);
+
+  std::set<uint64_t> protected_pages;
+  size_t tables = 0;
+  size_t flushes = 0;
+
+  shadow_table_page allocate_table() override
+  {
+    auto const it = std::find(allocated_.begin(), allocated_.end(), false);
+    size_t const index = it - allocated_.begin();
+
+    REQUIRE(index < POOL_PAGES);
+
+    allocated_[index] = true;
+    tables++;
+
+    uint64_t *entries = &pool[index * 512];
+    std::fill_n(entries, 512, 0);
+
+    return {entries, POOL_BASE + index * 0x1000};
+  }
+
+  void free_table(shadow_table_page const &page) override
+  {
+    allocated_[(page.phys_addr - POOL_BASE) / 0x1000] = false;
+    tables--;
+  }
+
+  std::optional<uint64_t> guest_to_host(uint64_t guest_page) override
+  {
+    if (guest_page >= GUEST_SIZE)
+      return {};
+
+    return HOST_BASE + guest_page;
+  }
+
+  void write_protect(uint64_t guest_page) override { protected_pages.insert(guest_page); }
+  void write_unprotect(uint64_t guest_page) override { protected_pages.erase(guest_page); }
+
+  void flush_host_tlb() override { flushes++; }
+};
+
+// A guest with 4-level page tables at CR3 0x1000. The page table at 0x4000
+// maps linear page i to guest-physical page 0x100 + i for i below 8. Pages are
+// writable, but clean. Linear page 8 maps the page table itself.
+struct shadow_setup {
+  std::vector<uint64_t> ram = std::vector<uint64_t>(GUEST_SIZE / sizeof(uint64_t));
+  flat_memory guest_memory {{{0, GUEST_SIZE, ram.data()}}};
+
+  test_hooks hooks;
+  shadow_paging shadow {&guest_memory, &hooks};
+
+  // The host view of guest memory and shadow page tables.
+  flat_memory host_memory {{{HOST_BASE, GUEST_SIZE, ram.data()},
+                            {POOL_BASE, POOL_PAGES * 0x1000, hooks.pool.data()}}};
+
+  paging_state const state {RFLAGS_RSVD, CR0_PG | CR0_WP, 0x1000, CR4_PAE, EFER_LME, 0};
+
+  uint64_t &guest(uint64_t gpa) { return ram[gpa / sizeof(uint64_t)]; }
+
+  shadow_setup()
+  {
+    guest(0x1000) = 0x2000 | PTE_P | PTE_W | PTE_U | PTE_A;
+    guest(0x2000) = 0x3000 | PTE_P | PTE_W | PTE_U | PTE_A;
+    guest(0x3000) = 0x4000 | PTE_P | PTE_W | PTE_U | PTE_A;
+
+    for (uint64_t page = 0; page < 8; page++)
+      guest(0x4000 + page * 8) = ((0x100 + page) << 12) | PTE_P | PTE_W | PTE_U | PTE_A;
+
+    guest(0x4000 + 8 * 8) = 0x4000 | PTE_P | PTE_W | PTE_A;
+  }
+
+  // Let the host MMU translate an access through the shadow page table.
+  translate_result host_translate(uint64_t linear_addr, access_type type)
+  {
+    paging_state const host {
+        RFLAGS_RSVD, CR0_PG | CR0_WP, shadow.root(state), CR4_PAE, EFER_LME | EFER_NXE, 0};
+
+    return translate(linear_memory_op {linear_addr, type}, host, &host_memory);
+  }
+
+  std::optional<uint64_t> host_phys_addr(uint64_t linear_addr, access_type type)
+  {
+    auto const res = host_translate(linear_addr, type);
+
+    if (auto const *entry = std::get_if<tlb_entry>(&res))
+      return entry->translate(linear_addr);
+
+    return {};
+  }
+
+  shadow_fault_result fault(uint64_t linear_addr, access_type type)
+  {
+    return shadow.handle_fault({linear_addr, type}, state);
+  }
+
+  // Emulate a guest write to a write-protected page table.
+  void guest_write(uint64_t gpa, uint64_t value)
+  {
+    guest(gpa) = value;
+    shadow.guest_write(gpa, sizeof(value));
+  }
+};
+
+}  // namespace
+
+TEST_CASE("Shadow page tables map guest translations", "[shadow]")
+{
+  shadow_setup s;
+
+  CHECK_FALSE(s.host_phys_addr(0x1234, access_type::READ));
+
+  SECTION("Reads map clean pages read-only")
+  {
+    CHECK(std::holds_alternative<shadow_mapped>(s.fault(0x1234, access_type::READ)));
+
+    CHECK(s.host_phys_addr(0x1234, access_type::READ) == HOST_BASE + 0x101234);
+    CHECK_FALSE(s.host_phys_addr(0x1234, access_type::WRITE));
+
+    CHECK(std::holds_alternative<shadow_mapped>(s.fault(0x1234, access_type::WRITE)));
+
+    CHECK(s.host_phys_addr(0x1234, access_type::WRITE) == HOST_BASE + 0x101234);
+    CHECK(s.guest(0x4008) & PTE_D);
+  }
+
+  SECTION("Guest page faults are reported")
+  {
+    auto const res = s.fault(0x200000, access_type::READ);
+
+    REQUIRE(std::holds_alternative<page_fault_info>(res));
+    CHECK(std::get<page_fault_info>(res).cr2 == 0x200000);
+  }
+
+  SECTION("Guest access rights are kept")
+  {
+    CHECK(std::holds_alternative<shadow_mapped>(s.fault(0x8000, access_type::READ)));
+
+    auto const res = s.host_translate(0x8000, access_type::READ);
+
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK_FALSE(std::get<tlb_entry>(res).attr().is_u());
+  }
+
+  SECTION("Memory without host backing is emulated")
+  {
+    s.guest(0x4000) = (GUEST_SIZE + 0x1000) | PTE_P | PTE_W | PTE_A;
+
+    CHECK(std::holds_alternative<tlb_entry>(s.fault(0x0, access_type::READ)));
+  }
+
+  SECTION("Address spaces have separate shadow page tables")
+  {
+    paging_state const other {RFLAGS_RSVD, CR0_PG | CR0_WP, 0x5000, CR4_PAE, EFER_LME, 0};
+
+    CHECK(s.shadow.root(other) != s.shadow.root(s.state));
+  }
+}
+
+TEST_CASE("Guest page tables are write-protected", "[shadow]")
+{
+  shadow_setup s;
+
+  REQUIRE(std::holds_alternative<shadow_mapped>(s.fault(0x1000, access_type::WRITE)));
+
+  for (uint64_t page = 0x1000; page <= 0x4000; page += 0x1000) {
+    CHECK(s.shadow.is_write_protected(page));
+    CHECK(s.hooks.protected_pages.count(page) == 1);
+  }
+
+  SECTION("Writes to guest page tables are emulated")
+  {
+    auto const res = s.fault(0x8000, access_type::WRITE);
+
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK(*std::get<tlb_entry>(res).translate(0x8010) == 0x4010);
+    CHECK(s.host_phys_addr(0x8010, access_type::READ) == HOST_BASE + 0x4010);
+    CHECK_FALSE(s.host_phys_addr(0x8010, access_type::WRITE));
+  }
+
+  SECTION("Pages lose write access when they become page tables")
+  {
+    // Linear page 1 maps guest-physical page 0x101. Turn it into the page
+    // table for the second 2MB of linear memory.
+    s.guest(0x101000) = 0x105000 | PTE_P | PTE_W | PTE_A | PTE_D;
+    s.guest_write(0x3008, 0x101000 | PTE_P | PTE_W | PTE_A);
+
+    size_t const flushes = s.hooks.flushes;
+
+    CHECK(std::holds_alternative<shadow_mapped>(s.fault(0x200000, access_type::READ)));
+    CHECK(s.host_phys_addr(0x200000, access_type::READ) == HOST_BASE + 0x105000);
+
+    CHECK(s.shadow.is_write_protected(0x101000));
+    CHECK_FALSE(s.host_phys_addr(0x1000, access_type::WRITE));
+    CHECK(s.host_phys_addr(0x1000, access_type::READ) == HOST_BASE + 0x101000);
+    CHECK(s.hooks.flushes > flushes);
+  }
+
+  SECTION("Writes to upper levels remove the derived shadow entries")
+  {
+    REQUIRE(s.host_phys_addr(0x1000, access_type::READ));
+
+    s.guest_write(0x3000, 0);
+
+    CHECK_FALSE(s.host_phys_addr(0x1000, access_type::READ));
+    CHECK(std::holds_alternative<page_fault_info>(s.fault(0x1000, access_type::READ)));
+
+    // The page tables below are not needed anymore, but they stay protected,
+    // because they may still be used elsewhere.
+    CHECK(s.shadow.is_write_protected(0x4000));
+  }
+
+  SECTION("Other entries in the same table are kept")
+  {
+    s.guest_write(0x3008, 0);
+
+    CHECK(s.host_phys_addr(0x1000, access_type::WRITE) == HOST_BASE + 0x101000);
+  }
+}
+
+TEST_CASE("Last-level guest page tables go out of sync", "[shadow]")
+{
+  shadow_setup s;
+
+  REQUIRE(std::holds_alternative<shadow_mapped>(s.fault(0x1000, access_type::READ)));
+  REQUIRE(std::holds_alternative<shadow_mapped>(s.fault(0x2000, access_type::READ)));
+
+  s.guest_write(0x4008, (0x106 << 12) | PTE_P | PTE_W | PTE_A);
+
+  CHECK_FALSE(s.shadow.is_write_protected(0x4000));
+  CHECK(s.hooks.protected_pages.count(0x4000) == 0);
+
+  // Upper levels stay in sync.
+  CHECK(s.shadow.is_write_protected(0x3000));
+
+  // The shadow entry is stale until the guest invalidates its TLB.
+  CHECK(s.host_phys_addr(0x1000, access_type::READ) == HOST_BASE + 0x101000);
+
+  SECTION("The guest can write the table directly")
+  {
+    CHECK(std::holds_alternative<shadow_mapped>(s.fault(0x8000, access_type::WRITE)));
+    CHECK(s.host_phys_addr(0x8000, access_type::WRITE) == HOST_BASE + 0x4000);
+  }
+
+  SECTION("INVLPG removes stale entries")
+  {
+    s.shadow.invlpg(0x1000);
+
+    CHECK_FALSE(s.host_phys_addr(0x1000, access_type::READ));
+    CHECK(s.host_phys_addr(0x2000, access_type::READ) == HOST_BASE + 0x102000);
+
+    CHECK(std::holds_alternative<shadow_mapped>(s.fault(0x1000, access_type::READ)));
+    CHECK(s.host_phys_addr(0x1000, access_type::READ) == HOST_BASE + 0x106000);
+  }
+
+  SECTION("MOV to CR3 brings tables back in sync")
+  {
+    REQUIRE(std::holds_alternative<shadow_mapped>(s.fault(0x8000, access_type::WRITE)));
+
+    s.shadow.mov_to_cr3(s.state);
+
+    CHECK(s.shadow.is_write_protected(0x4000));
+    CHECK(s.hooks.protected_pages.count(0x4000) == 1);
+    CHECK_FALSE(s.host_phys_addr(0x1000, access_type::READ));
+    CHECK_FALSE(s.host_phys_addr(0x8000, access_type::WRITE));
+  }
+}
+
+TEST_CASE("32-bit guests use shadow page tables", "[shadow]")
+{
+  shadow_setup s;
+  paging_state const state {RFLAGS_RSVD, CR0_PG | CR0_WP, 0x10000, 0, 0, 0};
+
+  auto const guest32 = [&](uint64_t gpa) -> uint32_t & {
+    return reinterpret_cast<uint32_t *>(s.ram.data())[gpa / sizeof(uint32_t)];
+  };
+
+  guest32(0x10004) = 0x11000 | PTE_P | PTE_W | PTE_A;
+  guest32(0x11008) = 0x123000 | PTE_P | PTE_W | PTE_A | PTE_D;
+
+  REQUIRE(std::holds_alternative<shadow_mapped>(
+      s.shadow.handle_fault({0x402000, access_type::WRITE}, state)));
+
+  CHECK(s.shadow.is_write_protected(0x10000));
+  CHECK(s.shadow.is_write_protected(0x11000));
+
+  paging_state const host {
+      RFLAGS_RSVD, CR0_PG | CR0_WP, s.shadow.root(state), CR4_PAE, EFER_LME, 0};
+  auto const host_phys_addr = [&](uint64_t linear_addr) -> std::optional<uint64_t> {
+    auto const res = translate({linear_addr, access_type::WRITE}, host, &s.host_memory);
+
+    if (auto const *entry = std::get_if<tlb_entry>(&res))
+      return entry->translate(linear_addr);
+
+    return {};
+  };
+
+  CHECK(host_phys_addr(0x402000) == HOST_BASE + 0x123000);
+
+  // Page directory entries are 4 bytes and cover 4MB each.
+  guest32(0x10004) = 0;
+  s.shadow.guest_write(0x10004, sizeof(uint32_t));
+
+  CHECK_FALSE(host_phys_addr(0x402000));
+}
+
+TEST_CASE("Clearing shadow page tables releases everything", "[shadow]")
+{
+  shadow_setup s;
+
+  REQUIRE(std::holds_alternative<shadow_mapped>(s.fault(0x1000, access_type::READ)));
+  REQUIRE(s.hooks.tables == 4);
+
+  s.shadow.clear();
+
+  CHECK(s.hooks.tables == 0);
+  CHECK(s.hooks.protected_pages.empty());
+  CHECK_FALSE(s.shadow.is_write_protected(0x1000));
+}
@@ -0,0 +1,272 @@
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <thread>
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+#include <vmmu/shared_tlb.hpp>
+
+#include "test_memory.hpp"
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+using operation_type = test_memory<uint64_t>::operation_type;
+
+// Create 4-level page tables at base that map linear page 0 to phys_page and
+// page 1 to phys_page + 1 as a global page.
+void populate(test_memory<uint64_t> &mem, uint64_t base, uint64_t phys_page)
+{
+  mem.write(base, (base + 0x1000) | PTE_P | PTE_A);
+  mem.write(base + 0x1000, (base + 0x2000) | PTE_P | PTE_A);
+  mem.write(base + 0x2000, (base + 0x3000) | PTE_P | PTE_A);
+  mem.write(base + 0x3000, (phys_page << 12) | PTE_P | PTE_A);
+  mem.write(base + 0x3008, ((phys_page + 1) << 12) | PTE_P | PTE_A | PTE_G);
+}
+
+// Forwards to flat memory, but gives other threads a chance to run in the
+// middle of page table walks, so walks race with concurrent page table updates
+// even on a single CPU.
+class yielding_memory
+{
+  flat_memory &mem_;
+
+public:
+  template <typename WORD>
+  WORD read(uint64_t phys_addr, WORD dummy)
+  {
+    WORD const value = mem_.read(phys_addr, dummy);
+
+    std::this_thread::yield();
+    return value;
+  }
+
+  template <typename WORD>
+  bool cmpxchg(uint64_t phys_addr, WORD expected, WORD new_value)
+  {
+    return mem_.cmpxchg(phys_addr, expected, new_value);
+  }
+
+  explicit yielding_memory(flat_memory &mem) : mem_(mem) {}
+};
+
+paging_state state_for(uint64_t cr3, unsigned cpl = 0)
+{
+  return {RFLAGS_RSVD, CR0_PG, cr3, CR4_PAE | CR4_PGE, EFER_LME, cpl};
+}
+
+}  // namespace
+
+TEST_CASE("Shared TLB caches translations per address space", "[shared_tlb]")
+{
+  test_memory<uint64_t> mem;
+  populate(mem, 0x1000, 0x100);
+  populate(mem, 0x8000, 0x800);
+
+  shared_tlb<16, 2> tlb;
+
+  auto const phys_addr = [&](uint64_t la, paging_state const &s) {
+    auto res = tlb.translate({la, access_type::READ}, s, &mem);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    return std::get<tlb_entry>(res).phys_addr();
+  };
+
+  auto const leaf_reads = [&mem](uint64_t base, uint64_t page) {
+    return mem.count_operations(operation_type::READ, base + 0x3000 + page * 8);
+  };
+
+  // Different vCPUs with their own paging state, but the same address space.
+  paging_state const cpu0 = state_for(0x1000);
+  paging_state const cpu1 = state_for(0x1000 | 0x18);
+  paging_state const other = state_for(0x8000);
+
+  CHECK(phys_addr(0, cpu0) == 0x100000);
+
+  SECTION("Translations are shared within an address space")
+  {
+    CHECK(phys_addr(0, cpu1) == 0x100000);
+    CHECK(leaf_reads(0x1000, 0) == 1);
+  }
+
+  SECTION("Translations are not shared across address spaces")
+  {
+    CHECK(phys_addr(0, other) == 0x800000);
+    CHECK(phys_addr(0, cpu0) == 0x100000);
+  }
+
+  SECTION("Global translations are shared across address spaces")
+  {
+    CHECK(phys_addr(0x1000, cpu0) == 0x101000);
+    CHECK(phys_addr(0x1000, other) == 0x101000);
+    CHECK(leaf_reads(0x8000, 1) == 0);
+  }
+
+  SECTION("MOV to CR3 only drops the translations of that address space")
+  {
+    phys_addr(0, other);
+    phys_addr(0x1000, cpu0);
+
+    tlb.mov_to_cr3(0x1000, cpu0);
+
+    phys_addr(0, cpu0);
+    phys_addr(0, other);
+    phys_addr(0x1000, cpu0);
+
+    CHECK(leaf_reads(0x1000, 0) == 2);
+    CHECK(leaf_reads(0x8000, 0) == 1);
+    CHECK(leaf_reads(0x1000, 1) == 1);
+  }
+
+  SECTION("INVLPG drops the page in all address spaces")
+  {
+    phys_addr(0, other);
+
+    tlb.invlpg(0, cpu0);
+
+    phys_addr(0, cpu0);
+    phys_addr(0, other);
+
+    CHECK(leaf_reads(0x1000, 0) == 2);
+    CHECK(leaf_reads(0x8000, 0) == 2);
+  }
+
+  SECTION("Clearing drops everything")
+  {
+    phys_addr(0x1000, cpu0);
+
+    tlb.clear();
+
+    phys_addr(0, cpu0);
+    phys_addr(0x1000, cpu0);
+
+    CHECK(leaf_reads(0x1000, 0) == 2);
+    CHECK(leaf_reads(0x1000, 1) == 2);
+  }
+}
+
+TEST_CASE("Shared TLB invalidates large pages by any address", "[shared_tlb]")
+{
+  test_memory<uint64_t> mem;
+  paging_state const s = state_for(0x1000);
+
+  mem.write(0x1000, 0x2000 | PTE_P | PTE_A);
+  mem.write(0x2000, 0x3000 | PTE_P | PTE_A);
+  mem.write(0x3000, (uint64_t(1) << 30) | PTE_P | PTE_PS | PTE_A);
+
+  shared_tlb<16, 2> tlb;
+
+  // Cache the 2MB page through several of its 4KB pages.
+  for (uint64_t page = 0; page < 8; page++)
+    REQUIRE(std::holds_alternative<tlb_entry>(
+        tlb.translate({page << 12, access_type::READ}, s, &mem)));
+
+  size_t const reads = mem.count_operations(operation_type::READ, 0x3000);
+
+  tlb.invlpg(0x1ff000, s);
+
+  for (uint64_t page = 0; page < 8; page++)
+    tlb.translate({page << 12, access_type::READ}, s, &mem);
+
+  CHECK(mem.count_operations(operation_type::READ, 0x3000) == reads + 1);
+}
+
+TEST_CASE("Shared TLB caches a large page once", "[shared_tlb]")
+{
+  test_memory<uint64_t> mem;
+  paging_state const s = state_for(0x1000);
+
+  // A 1GB page at linear address 0 and a 2MB page at 1GB.
+  mem.write(0x1000, 0x2000 | PTE_P | PTE_A);
+  mem.write(0x2000, (uint64_t(1) << 31) | PTE_P | PTE_PS | PTE_A);
+  mem.write(0x2008, 0x3000 | PTE_P | PTE_A);
+  mem.write(0x3000, (uint64_t(1) << 30) | PTE_P | PTE_PS | PTE_A);
+
+  shared_tlb<16, 2> tlb;
+
+  // Touch 4KB pages all over both large pages, many more than the TLB has
+  // slots.
+  for (uint64_t i = 0; i < 256; i++) {
+    uint64_t const offset = i * 0x3f3000;
+
+    auto const gb = tlb.translate({offset % (uint64_t(1) << 30), access_type::READ}, s, &mem);
+    auto const mb = tlb.translate({(uint64_t(1) << 30) + offset % (uint64_t(1) << 21),
+                                   access_type::READ},
+                                  s, &mem);
+
+    REQUIRE(std::get<tlb_entry>(gb).size() == uint64_t(1) << 30);
+    REQUIRE(std::get<tlb_entry>(mb).size() == uint64_t(1) << 21);
+  }
+
+  CHECK(mem.count_operations(operation_type::READ, 0x2000) == 1);
+  CHECK(mem.count_operations(operation_type::READ, 0x3000) == 1);
+}
+
+TEST_CASE("Shared TLB never returns translations older than an invalidation", "[shared_tlb]")
+{
+  // 4-level page tables that map 64 pages. A writer thread keeps remapping
+  // page 0 and invalidates it after each change.
+  std::vector<uint64_t> ram(4 * 512);
+  flat_memory flat {{{0x1000, ram.size() * sizeof(uint64_t), ram.data()}}};
+  yielding_memory mem {flat};
+
+  auto const entry = [&ram](uint64_t phys_addr) -> uint64_t & {
+    return ram[(phys_addr - 0x1000) / sizeof(uint64_t)];
+  };
+
+  uint64_t const flags = PTE_P | PTE_W | PTE_A | PTE_D;
+
+  entry(0x1000) = 0x2000 | flags;
+  entry(0x2000) = 0x3000 | flags;
+  entry(0x3000) = 0x4000 | flags;
+
+  for (uint64_t page = 0; page < 64; page++)
+    entry(0x4000 + page * 8) = ((0x1000 + page) << 12) | flags;
+
+  shared_tlb<8, 2> tlb;
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0x1000, CR4_PAE, EFER_LME, 0};
+
+  // The number of the last mapping of page 0 whose invalidation completed.
+  std::atomic<uint64_t> published {0};
+  std::atomic<bool> done {false};
+  std::atomic<size_t> errors {0};
+
+  std::vector<std::thread> readers;
+
+  for (unsigned t = 0; t < 4; t++)
+    readers.emplace_back([&, t]() {
+      uint64_t rng = t + 1;
+
+      while (not done.load()) {
+        rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+
+        uint64_t const page = (rng >> 40) % 64;
+        uint64_t const oldest = published.load();
+
+        auto const res = tlb.translate({page << 12, access_type::READ}, s, &mem);
+        auto const *e = std::get_if<tlb_entry>(&res);
+
+        if (not e)
+          errors++;
+        else if (page != 0 and e->phys_addr() != (0x1000 + page) << 12)
+          errors++;
+        else if (page == 0 and (e->phys_addr() >> 12) < 0x1000 + oldest)
+          errors++;
+      }
+    });
+
+  for (uint64_t mapping = 1; mapping < 20000; mapping++) {
+    __atomic_store_n(&entry(0x4000), ((0x1000 + mapping) << 12) | flags, __ATOMIC_RELEASE);
+    tlb.invlpg(0, s);
+    published.store(mapping);
+
+    std::this_thread::yield();
+  }
+
+  done.store(true);
+
+  for (auto &r : readers)
+    r.join();
+
+  CHECK(errors.load() == 0);
+}
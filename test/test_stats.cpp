@@ -0,0 +1,181 @@
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <thread>
+#include <vmmu/flat_memory.hpp>
+#include <vmmu/stats.hpp>
+
+#include "flat_page_tables.hpp"
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+using internal::paging_mode;
+
+constexpr size_t M64 = size_t(paging_mode::PM64_4LEVEL);
+constexpr size_t READ = size_t(access_type::READ);
+constexpr size_t WRITE = size_t(access_type::WRITE);
+
+// Forwards to flat memory, but lets the first compare-exchange fail as if
+// another CPU changed the entry.
+struct racy_memory {
+  flat_memory *memory;
+  bool raced = false;
+
+  template <typename WORD>
+  WORD read(uint64_t phys_addr, WORD dummy)
+  {
+    return memory->read(phys_addr, dummy);
+  }
+
+  template <typename WORD>
+  bool cmpxchg(uint64_t phys_addr, WORD expected, WORD new_value)
+  {
+    if (not raced) {
+      raced = true;
+      return false;
+    }
+
+    return memory->cmpxchg(phys_addr, expected, new_value);
+  }
+};
+
+}  // namespace
+
+TEST_CASE("Translation statistics count page table accesses", "[stats]")
+{
+  flat_page_tables s;
+  translation_stats stats;
+
+  SECTION("Walks read one entry per level")
+  {
+    REQUIRE(std::holds_alternative<tlb_entry>(
+        translate({0x10, access_type::READ}, s.state, &s.memory, nullptr, &stats)));
+
+    auto const c = stats.snapshot();
+
+    CHECK(c.translations[M64][READ] == 1);
+    CHECK(c.page_faults[M64][READ] == 0);
+
+    for (unsigned level = 1; level <= 4; level++)
+      CHECK(c.entry_reads[M64][level] == 1);
+
+    CHECK(c.walk_depths[M64][4] == 1);
+
+    // Only the leaf needed its accessed flag.
+    CHECK(c.ad_updates[M64][1] == 1);
+    CHECK(translation_counters::total(c.ad_updates) == 1);
+  }
+
+  SECTION("Page faults are counted by access type")
+  {
+    s.entry(0x3000) = 0;
+
+    REQUIRE(std::holds_alternative<page_fault_info>(
+        translate({0x10, access_type::WRITE}, s.state, &s.memory, nullptr, &stats)));
+
+    auto const c = stats.snapshot();
+
+    CHECK(c.translations[M64][WRITE] == 1);
+    CHECK(c.page_faults[M64][WRITE] == 1);
+    CHECK(c.walk_depths[M64][3] == 1);
+  }
+
+  SECTION("Failed accessed flag updates are retried")
+  {
+    racy_memory memory {&s.memory};
+
+    REQUIRE(std::holds_alternative<tlb_entry>(
+        translate({0x10, access_type::READ}, s.state, &memory, nullptr, &stats)));
+
+    auto const c = stats.snapshot();
+
+    CHECK(c.translations[M64][READ] == 1);
+    CHECK(c.ad_retries[M64][1] == 1);
+    CHECK(c.ad_updates[M64][1] == 1);
+    CHECK(c.entry_reads[M64][4] == 2);
+  }
+
+  SECTION("Paging-structure cache hits shorten walks")
+  {
+    paging_structure_cache psc;
+
+    translate({0x10, access_type::READ}, s.state, &s.memory, &psc, &stats);
+    translate({0x1010, access_type::READ}, s.state, &s.memory, &psc, &stats);
+
+    auto const c = stats.snapshot();
+
+    CHECK(c.walk_depths[M64][4] == 1);
+    CHECK(c.walk_depths[M64][1] == 1);
+  }
+}
+
+TEST_CASE("TLBs report hits and misses", "[stats]")
+{
+  flat_page_tables s;
+  tlb<4, translation_stats> tlb;
+
+  tlb.translate({0x10, access_type::READ}, s.state, &s.memory);
+  tlb.translate({0x20, access_type::READ}, s.state, &s.memory);
+  tlb.translate({0x30, access_type::WRITE}, s.state, &s.memory);
+
+  auto const c = tlb.observer().snapshot();
+
+  CHECK(c.tlb_hits[M64][READ] == 1);
+  CHECK(c.tlb_misses[M64][READ] == 1);
+
+  // The entry is clean, so the write walks to set the dirty flag.
+  CHECK(c.tlb_misses[M64][WRITE] == 1);
+  CHECK(translation_counters::total(c.translations) == 2);
+}
+
+TEST_CASE("Translation statistics can be reset", "[stats]")
+{
+  flat_page_tables s;
+  translation_stats stats;
+
+  translate({0x10, access_type::READ}, s.state, &s.memory, nullptr, &stats);
+  stats.reset();
+
+  CHECK(translation_counters::total(stats.snapshot().translations) == 0);
+
+  translate({0x10, access_type::READ}, s.state, &s.memory, nullptr, &stats);
+
+  auto const c = stats.snapshot();
+
+  CHECK(c.translations[M64][READ] == 1);
+  CHECK(c.entry_reads[M64][1] == 1);
+  CHECK(translation_counters::total(c.ad_updates) == 0);
+}
+
+TEST_CASE("Snapshots don't underflow while other threads reset", "[stats]")
+{
+  flat_page_tables s;
+  translation_stats stats;
+
+  constexpr uint64_t TRANSLATIONS = 100000;
+
+  std::atomic<bool> done {false};
+  std::atomic<size_t> errors {0};
+
+  std::thread resetter([&] {
+    while (not done.load())
+      stats.reset();
+  });
+
+  std::thread reader([&] {
+    while (not done.load())
+      if (translation_counters::total(stats.snapshot().translations) > TRANSLATIONS)
+        errors++;
+  });
+
+  for (uint64_t i = 0; i < TRANSLATIONS; i++)
+    translate({0x10, access_type::READ}, s.state, &s.memory, nullptr, &stats);
+
+  done.store(true);
+  resetter.join();
+  reader.join();
+
+  CHECK(errors.load() == 0);
+}
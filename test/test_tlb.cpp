@@ -0,0 +1,684 @@
+#include <catch2/catch.hpp>
+#include <vector>
+#include <vmmu/shared_tlb.hpp>
+#include <vmmu/simd_tlb.hpp>
+#include <vmmu/vmmu.hpp>
+
+#include "test_memory.hpp"
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+using operation_type = test_memory_32::operation_type;
+
+// Compare two translation results. TLB entries are equal, if they translate
+// the same region with the same attributes.
+bool same_result(translate_result const &a, translate_result const &b)
+{
+  if (a.index() != b.index())
+    return false;
+
+  if (auto const *ea = std::get_if<tlb_entry>(&a)) {
+    auto const &eb = std::get<tlb_entry>(b);
+
+    return ea->linear_addr() == eb.linear_addr() and ea->phys_addr() == eb.phys_addr() and
+           ea->size() == eb.size() and ea->attr().is_w() == eb.attr().is_w() and
+           ea->attr().is_u() == eb.attr().is_u() and ea->attr().is_xd() == eb.attr().is_xd() and
+           ea->attr().is_d() == eb.attr().is_d();
+  }
+
+  if (auto const *pa = std::get_if<page_fault_info>(&a)) {
+    auto const &pb = std::get<page_fault_info>(b);
+
+    return pa->cr2 == pb.cr2 and pa->error_code == pb.error_code;
+  }
+
+  return true;
+}
+
+// Populate 32-bit page tables with a mix of 4MB pages, 4KB pages and
+// non-present entries. Page table i covers the 4MB region i.
+void populate_pm32(test_memory_32 &mem)
+{
+  for (uint32_t pde = 0; pde < 8; pde++) {
+    uint32_t const perm = (pde & 2 ? uint32_t(PTE_U) : 0) | (pde & 4 ? uint32_t(PTE_W) : 0);
+
+    if (pde % 2 == 0) {
+      mem.write(pde * 4, (pde + 16) << 22 | perm | uint32_t(PTE_P | PTE_PS));
+      continue;
+    }
+
+    uint32_t const table = 0x10000 + pde * 0x1000;
+
+    mem.write(pde * 4, table | uint32_t(PTE_P | PTE_U | PTE_W));
+
+    for (uint32_t pte = 0; pte < 16; pte++)
+      mem.write(table + pte * 4,
+                (0x100 + pde * 16 + pte) << 12 | perm | (pte % 5 ? uint32_t(PTE_P) : 0));
+  }
+}
+
+// Populate 4-level page tables with a mix of 1GB, 2MB and 4KB pages below the
+// first PML4 entry.
+void populate_pm64(test_memory<uint64_t> &mem)
+{
+  mem.write(0x1000, 0x2000 | PTE_P | PTE_W | PTE_U);
+
+  for (uint64_t pdpte = 0; pdpte < 4; pdpte++) {
+    uint64_t const dir = 0x10000 + pdpte * 0x10000;
+
+    if (pdpte == 0) {
+      mem.write(0x2000, (uint64_t(1) << 32) | PTE_P | PTE_PS | PTE_W);
+      continue;
+    }
+
+    mem.write(0x2000 + pdpte * 8, dir | PTE_P | PTE_U | (pdpte & 1 ? uint64_t(PTE_W) : 0));
+
+    for (uint64_t pde = 0; pde < 8; pde++) {
+      uint64_t const perm = (pde & 2 ? uint64_t(PTE_U) : 0) | (pde & 4 ? uint64_t(PTE_W) : 0);
+      uint64_t const table = dir + 0x1000 + pde * 0x1000;
+
+      if (pde % 2 == 0) {
+        mem.write(dir + pde * 8, (pdpte * 8 + pde + 16) << 21 | perm | PTE_P | PTE_PS);
+        continue;
+      }
+
+      mem.write(dir + pde * 8, table | PTE_P | PTE_U | PTE_W);
+
+      for (uint64_t pte = 0; pte < 16; pte++)
+        mem.write(table + pte * 8, (0x1000 + pdpte * 256 + pde * 16 + pte) << 12 | perm |
+                                       (pte % 5 ? uint64_t(PTE_P) : 0));
+    }
+  }
+}
+
+// Translate random addresses with the TLB and without and compare the results.
+template <typename TLB, typename MEMORY>
+void compare_random_translations(MEMORY &mem,
+                                 paging_state const &supervisor,
+                                 paging_state const &user,
+                                 uint64_t (*random_address)(uint64_t))
+{
+  TLB tlb;
+  uint64_t rng = 1;
+
+  for (int i = 0; i < 2000; i++) {
+    rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    uint64_t const la = random_address(rng);
+    auto const type = access_type((rng >> 50) % 3);
+    auto const &state = (rng >> 60) % 2 ? user : supervisor;
+
+    auto const cached = tlb.translate({la, type}, state, &mem);
+    auto const uncached = translate({la, type}, state, &mem);
+
+    INFO("Linear address " << la << " access type " << int(type));
+    REQUIRE(same_result(cached, uncached));
+  }
+}
+
+}  // namespace
+
+TEMPLATE_TEST_CASE("TLBs return the same results as translate",
+                   "[tlb]",
+                   (set_assoc_tlb<4, 2>),
+                   (split_tlb<4, 2, 2, 2>),
+                   (simd_tlb<8>),
+                   (simd_tlb<72>))
+{
+  SECTION("32-bit paging")
+  {
+    test_memory_32 mem;
+    populate_pm32(mem);
+
+    compare_random_translations<TestType>(
+        mem, {RFLAGS_RSVD, CR0_PG | CR0_WP, 0, CR4_PSE, 0, 0},
+        {RFLAGS_RSVD, CR0_PG | CR0_WP, 0, CR4_PSE, 0, 3}, [](uint64_t rng) -> uint64_t {
+          return (rng >> 40) % 8 << 22 | (rng >> 30) % 16 << 12 | (rng >> 20) % 4096;
+        });
+  }
+
+  SECTION("4-level paging")
+  {
+    test_memory<uint64_t> mem;
+    populate_pm64(mem);
+
+    compare_random_translations<TestType>(
+        mem, {RFLAGS_RSVD, CR0_PG | CR0_WP, 0x1000, CR4_PAE, EFER_LME | EFER_NXE, 0},
+        {RFLAGS_RSVD, CR0_PG | CR0_WP, 0x1000, CR4_PAE, EFER_LME | EFER_NXE, 3},
+        [](uint64_t rng) -> uint64_t {
+          return (rng >> 40) % 4 << 30 | (rng >> 30) % 8 << 21 | (rng >> 24) % 16 << 12 |
+                 (rng >> 12) % 4096;
+        });
+  }
+}
+
+TEST_CASE("Fully associative TLB caches translations", "[tlb]")
+{
+  test_memory_32 mem;
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0, 0, 0, 0};
+
+  mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A));
+  mem.write(0x1000, 0x10000 | uint32_t(PTE_P | PTE_A));
+
+  tlb<2> tlb;
+
+  tlb.translate({0, access_type::READ}, s, &mem);
+  tlb.translate({0, access_type::READ}, s, &mem);
+
+  CHECK(mem.count_operations(operation_type::READ, 0x1000) == 1);
+
+  SECTION("Cleared entries are not used anymore")
+  {
+    tlb.clear();
+
+    auto const res = tlb.translate({0, access_type::READ}, s, &mem);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK(std::get<tlb_entry>(res).phys_addr() == 0x10000);
+    CHECK(mem.count_operations(operation_type::READ, 0x1000) == 2);
+  }
+}
+
+TEST_CASE("Set-associative TLB caches translations", "[tlb]")
+{
+  test_memory_32 mem;
+  paging_state const s {RFLAGS_RSVD, CR0_PG | CR0_WP, 0, 0, 0, 0};
+
+  mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_W | PTE_A));
+
+  for (uint32_t pte = 0; pte < 8; pte++)
+    mem.write(0x1000 + pte * 4, (0x10 + pte) << 12 | uint32_t(PTE_P | PTE_W | PTE_A));
+
+  set_assoc_tlb<1, 4> tlb;
+
+  auto const reads_of_pte = [&mem](uint32_t pte) {
+    return mem.count_operations(operation_type::READ, 0x1000 + pte * 4);
+  };
+
+  SECTION("Hits don't touch memory")
+  {
+    REQUIRE(std::holds_alternative<tlb_entry>(tlb.translate({0x10, access_type::READ}, s, &mem)));
+    REQUIRE(reads_of_pte(0) == 1);
+
+    auto const res = tlb.translate({0x20, access_type::READ}, s, &mem);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK(std::get<tlb_entry>(res).phys_addr() == 0x10000);
+    CHECK(reads_of_pte(0) == 1);
+  }
+
+  SECTION("Writes to clean entries walk the page table to set the dirty bit")
+  {
+    REQUIRE(std::holds_alternative<tlb_entry>(tlb.translate({0, access_type::READ}, s, &mem)));
+    REQUIRE(std::holds_alternative<tlb_entry>(tlb.translate({0, access_type::WRITE}, s, &mem)));
+
+    CHECK(reads_of_pte(0) >= 2);
+    CHECK(is_bit_set(mem.reads(0x1000), PTE_D));
+  }
+
+  SECTION("Recently used entries survive eviction")
+  {
+    for (uint32_t pte = 0; pte < 4; pte++)
+      tlb.translate({pte << 12, access_type::READ}, s, &mem);
+
+    tlb.translate({0, access_type::READ}, s, &mem);
+    tlb.translate({4 << 12, access_type::READ}, s, &mem);
+    tlb.translate({0, access_type::READ}, s, &mem);
+
+    CHECK(reads_of_pte(0) == 1);
+    CHECK(reads_of_pte(4) == 1);
+  }
+
+  SECTION("Clearing the TLB forces new page table walks")
+  {
+    tlb.translate({0, access_type::READ}, s, &mem);
+    tlb.clear();
+    tlb.translate({0, access_type::READ}, s, &mem);
+
+    CHECK(reads_of_pte(0) == 2);
+  }
+
+  SECTION("Entries inserted after a flush are used")
+  {
+    tlb.clear();
+    tlb.translate({0, access_type::READ}, s, &mem);
+    tlb.invalidate_non_global();
+    tlb.translate({0, access_type::READ}, s, &mem);
+    tlb.translate({0, access_type::READ}, s, &mem);
+
+    CHECK(reads_of_pte(0) == 2);
+  }
+}
+
+TEST_CASE("Split TLB keeps page sizes apart", "[tlb]")
+{
+  test_memory_32 mem;
+  populate_pm32(mem);
+
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0, CR4_PSE, 0, 0};
+  split_tlb<1, 1, 1, 1> tlb;
+
+  uint64_t const small_page = 1 << 22 | 1 << 12;
+  uint64_t const large_page = 0;
+
+  tlb.translate({small_page, access_type::READ}, s, &mem);
+  tlb.translate({large_page, access_type::READ}, s, &mem);
+
+  size_t const reads = mem.count_operations(operation_type::READ, 0) +
+                       mem.count_operations(operation_type::READ, 4);
+
+  SECTION("Large pages don't evict small pages")
+  {
+    auto const res = tlb.translate({small_page, access_type::READ}, s, &mem);
+
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK(std::get<tlb_entry>(res).size() == 4096);
+  }
+
+  SECTION("Large pages hit anywhere in the page")
+  {
+    auto const res = tlb.translate({large_page + 0x3ff000, access_type::READ}, s, &mem);
+
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    CHECK(std::get<tlb_entry>(res).size() == (4 << 20));
+  }
+
+  CHECK(mem.count_operations(operation_type::READ, 0) +
+            mem.count_operations(operation_type::READ, 4) ==
+        reads);
+}
+
+TEMPLATE_TEST_CASE("TLB entries are tagged with the PCID",
+                   "[tlb]",
+                   (set_assoc_tlb<4, 2>),
+                   (split_tlb<4, 2>))
+{
+  test_memory<uint64_t> mem;
+
+  // Two address spaces that map linear address 0 to different pages.
+  for (uint64_t base : {0x1000, 0x8000}) {
+    mem.write(base, (base + 0x1000) | PTE_P | PTE_A);
+    mem.write(base + 0x1000, (base + 0x2000) | PTE_P | PTE_A);
+    mem.write(base + 0x2000, (base + 0x3000) | PTE_P | PTE_A);
+    mem.write(base + 0x3000, (base << 8) | PTE_P | PTE_A);
+  }
+
+  auto const state = [](uint64_t cr3) {
+    return paging_state {RFLAGS_RSVD, CR0_PG, cr3, CR4_PAE | CR4_PCIDE, EFER_LME, 0};
+  };
+
+  paging_state const first = state(0x1000 | 1);
+  paging_state const second = state(0x8000 | 2);
+
+  TestType tlb;
+
+  auto const phys_addr = [&tlb, &mem](paging_state const &s) {
+    auto res = tlb.translate({0, access_type::READ}, s, &mem);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    return std::get<tlb_entry>(res).phys_addr();
+  };
+
+  auto const leaf_reads = [&mem](uint64_t base) {
+    return mem.count_operations(test_memory<uint64_t>::operation_type::READ, base + 0x3000);
+  };
+
+  CHECK(phys_addr(first) == 0x100000);
+
+  SECTION("Lookups only match the current PCID")
+  {
+    tlb.mov_to_cr3(second.get_cr3() | CR3_NOFLUSH, first);
+    CHECK(phys_addr(second) == 0x800000);
+  }
+
+  SECTION("MOV to CR3 with bit 63 set keeps all entries")
+  {
+    tlb.mov_to_cr3(second.get_cr3() | CR3_NOFLUSH, first);
+    phys_addr(second);
+    tlb.mov_to_cr3(first.get_cr3() | CR3_NOFLUSH, second);
+
+    CHECK(phys_addr(first) == 0x100000);
+    CHECK(leaf_reads(0x1000) == 1);
+  }
+
+  SECTION("MOV to CR3 with bit 63 clear only drops entries of the new PCID")
+  {
+    phys_addr(second);
+    tlb.mov_to_cr3(first.get_cr3(), second);
+
+    CHECK(phys_addr(first) == 0x100000);
+    CHECK(phys_addr(second) == 0x800000);
+    CHECK(leaf_reads(0x1000) == 2);
+    CHECK(leaf_reads(0x8000) == 1);
+  }
+
+  SECTION("MOV to CR3 without PCIDs drops all entries")
+  {
+    paging_state const no_pcid {RFLAGS_RSVD, CR0_PG, 0x1000, CR4_PAE, EFER_LME, 0};
+
+    phys_addr(no_pcid);
+    tlb.mov_to_cr3(0x1000 | CR3_NOFLUSH, no_pcid);
+    phys_addr(no_pcid);
+
+    CHECK(leaf_reads(0x1000) == 3);
+  }
+}
+
+TEMPLATE_TEST_CASE("Global TLB entries survive non-global flushes",
+                   "[tlb]",
+                   (set_assoc_tlb<4, 2>),
+                   (split_tlb<4, 2>))
+{
+  test_memory_32 mem;
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0, CR4_PGE, 0, 0};
+
+  // Page 0 is a global mapping, page 1 is not.
+  mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A));
+  mem.write(0x1000, 0x10000 | uint32_t(PTE_P | PTE_A | PTE_G));
+  mem.write(0x1004, 0x11000 | uint32_t(PTE_P | PTE_A));
+
+  TestType tlb;
+
+  auto const translate_page = [&](uint64_t page) {
+    REQUIRE(std::holds_alternative<tlb_entry>(
+        tlb.translate({page << 12, access_type::READ}, s, &mem)));
+  };
+
+  auto const reads_of_pte = [&mem](uint64_t page) {
+    return mem.count_operations(operation_type::READ, 0x1000 + page * 4);
+  };
+
+  translate_page(0);
+  translate_page(1);
+
+  SECTION("MOV to CR3 keeps global entries")
+  {
+    tlb.mov_to_cr3(0, s);
+  }
+
+  SECTION("Non-global invalidation keeps global entries")
+  {
+    tlb.invalidate_non_global();
+  }
+
+  translate_page(0);
+  translate_page(1);
+
+  CHECK(reads_of_pte(0) == 1);
+  CHECK(reads_of_pte(1) == 2);
+}
+
+TEST_CASE("Global TLB entries match any PCID", "[tlb]")
+{
+  test_memory<uint64_t> mem;
+
+  mem.write(0x1000, 0x2000 | PTE_P | PTE_A);
+  mem.write(0x2000, 0x3000 | PTE_P | PTE_A);
+  mem.write(0x3000, 0x4000 | PTE_P | PTE_A);
+  mem.write(0x4000, 0x10000 | PTE_P | PTE_A | PTE_G);
+
+  auto const state = [](uint64_t pcid) {
+    return paging_state {RFLAGS_RSVD, CR0_PG, 0x1000 | pcid, CR4_PAE | CR4_PCIDE | CR4_PGE,
+                         EFER_LME, 0};
+  };
+
+  set_assoc_tlb<4, 2> tlb;
+
+  REQUIRE(std::holds_alternative<tlb_entry>(tlb.translate({0, access_type::READ}, state(1), &mem)));
+  REQUIRE(std::holds_alternative<tlb_entry>(tlb.translate({0, access_type::READ}, state(2), &mem)));
+
+  CHECK(mem.count_operations(test_memory<uint64_t>::operation_type::READ, 0x4000) == 1);
+}
+
+TEMPLATE_TEST_CASE("TLB entries can be invalidated selectively",
+                   "[tlb]",
+                   (set_assoc_tlb<4, 2>),
+                   (split_tlb<4, 2>))
+{
+  test_memory_32 mem;
+  populate_pm32(mem);
+
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0, CR4_PSE, 0, 0};
+  TestType tlb;
+
+  // A 4MB page and three 4KB pages in the region after it.
+  uint64_t const large = 0x123000;
+  uint64_t const small[] = {1 << 22 | 1 << 12, 1 << 22 | 2 << 12, 1 << 22 | 3 << 12};
+
+  auto const walks = [&mem]() {
+    size_t reads = 0;
+
+    for (uint64_t addr : {0x0, 0x4, 0x11004, 0x11008, 0x1100c})
+      reads += mem.count_operations(operation_type::READ, addr);
+
+    return reads;
+  };
+
+  auto const translate_all = [&]() {
+    tlb.translate({large, access_type::READ}, s, &mem);
+
+    for (auto la : small)
+      tlb.translate({la, access_type::READ}, s, &mem);
+  };
+
+  translate_all();
+  size_t const initial_reads = walks();
+
+  // Returns the number of page table reads needed to refill the TLB.
+  auto const refill = [&]() {
+    size_t const before = walks();
+    translate_all();
+    return walks() - before;
+  };
+
+  // Each refilled 4KB page needs two reads, large pages only one.
+  REQUIRE(refill() == 0);
+  REQUIRE(initial_reads > 0);
+
+  SECTION("INVLPG removes the page containing the address")
+  {
+    tlb.invlpg(small[1] + 0x234, s);
+    CHECK(refill() == 2);
+  }
+
+  SECTION("INVLPG removes large pages")
+  {
+    tlb.invlpg(0x3ff000, s);
+    CHECK(refill() == 1);
+  }
+
+  SECTION("Range invalidation removes all pages in the range")
+  {
+    tlb.invalidate_range(small[0] + 0xfff, 2, s);
+    CHECK(refill() == 4);
+  }
+
+  SECTION("Empty ranges don't invalidate anything")
+  {
+    tlb.invalidate_range(small[0], 0, s);
+    CHECK(refill() == 0);
+  }
+
+  SECTION("Ranges at the end of the address space don't wrap")
+  {
+    tlb.invalidate_range(~uint64_t(0) - 0xfff, 0x10000, s);
+    CHECK(refill() == 0);
+  }
+
+  SECTION("INVPCID individual address invalidation only affects the given PCID")
+  {
+    tlb.invpcid(invpcid_type::INDIVIDUAL_ADDRESS, 1, small[0]);
+    CHECK(refill() == 0);
+
+    tlb.invpcid(invpcid_type::INDIVIDUAL_ADDRESS, 0, small[0]);
+    CHECK(refill() == 2);
+  }
+
+  SECTION("INVPCID single-context invalidation removes everything of the PCID")
+  {
+    tlb.invpcid(invpcid_type::SINGLE_CONTEXT, 0);
+    CHECK(refill() == 7);
+  }
+
+  SECTION("INVPCID all-context invalidation removes everything")
+  {
+    tlb.invpcid(invpcid_type::ALL_CONTEXT, 0);
+    CHECK(refill() == 7);
+  }
+}
+
+TEMPLATE_TEST_CASE("TLBs translate batches like single operations",
+                   "[tlb]",
+                   (tlb<4>),
+                   (set_assoc_tlb<4, 2>),
+                   (split_tlb<4, 2>),
+                   (simd_tlb<16>),
+                   (shared_tlb<4, 2>))
+{
+  // Batched and single translations set accessed and dirty bits in their own
+  // copy of the page tables.
+  test_memory_32 mem, batch_mem;
+  populate_pm32(mem);
+  populate_pm32(batch_mem);
+
+  paging_state const s {RFLAGS_RSVD, CR0_PG | CR0_WP, 0, CR4_PSE, 0, 3};
+
+  std::vector<linear_memory_op> ops;
+  uint64_t rng = 1;
+
+  for (int i = 0; i < 256; i++) {
+    rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    ops.push_back({(rng >> 40) % 8 << 22 | (rng >> 30) % 4 << 12 | (rng >> 20) % 4096,
+                   access_type((rng >> 50) % 3)});
+  }
+
+  TestType tlb;
+  std::vector<translate_result> results(ops.size());
+
+  tlb.translate_batch(ops.data(), ops.size(), s, &batch_mem, results.data());
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    INFO("Operation " << i);
+    CHECK(same_result(results[i], translate(ops[i], s, &mem)));
+  }
+}
+
+TEST_CASE("SIMD tag matching agrees with the scalar implementation", "[tlb]")
+{
+  using internal::tag_match_fn;
+
+  alignas(64) std::array<uint64_t, 64> tags, masks;
+  uint64_t rng = 1;
+
+  // Tags are drawn from a small set of pages, so many of them match.
+  for (size_t i = 0; i < tags.size(); i++) {
+    rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    masks[i] = ~uint64_t(0) << (rng >> 62 ? 12 : 21);
+    tags[i] = (rng >> 20) % 4 << 12 & masks[i];
+
+    if ((rng >> 40) % 8 == 0)
+      tags[i] |= 1;
+  }
+
+  std::vector<tag_match_fn> kernels {internal::match_tags.load()};
+
+#if defined(__x86_64__)
+  kernels.push_back(internal::match_tags_sse2);
+
+  if (__builtin_cpu_supports("avx2"))
+    kernels.push_back(internal::match_tags_avx2);
+
+  if (__builtin_cpu_supports("avx512f"))
+    kernels.push_back(internal::match_tags_avx512);
+#endif
+
+  for (auto kernel : kernels)
+    for (size_t count : {8, 16, 64})
+      for (uint64_t la : {0x0, 0x1234, 0x2fff, 0x3000, 0x4000, 0x200000}) {
+        INFO("Count " << count << " linear address " << la);
+        CHECK(kernel(tags.data(), masks.data(), count, la) ==
+              internal::match_tags_scalar(tags.data(), masks.data(), count, la));
+      }
+}
+
+TEST_CASE("SIMD TLB caches translations", "[tlb]")
+{
+  test_memory_32 mem;
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0, 0, 0, 0};
+
+  mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A));
+
+  for (uint32_t pte = 0; pte < 16; pte++)
+    mem.write(0x1000 + pte * 4, (0x10 + pte) << 12 | uint32_t(PTE_P | PTE_A));
+
+  simd_tlb<8> tlb;
+
+  auto const reads_of_pte = [&mem](uint32_t pte) {
+    return mem.count_operations(operation_type::READ, 0x1000 + pte * 4);
+  };
+
+  for (uint32_t pte = 0; pte < 8; pte++)
+    tlb.translate({pte << 12, access_type::READ}, s, &mem);
+
+  SECTION("All entries are used")
+  {
+    for (uint32_t pte = 0; pte < 8; pte++) {
+      auto const res = tlb.translate({pte << 12 | 0x123, access_type::READ}, s, &mem);
+
+      REQUIRE(std::holds_alternative<tlb_entry>(res));
+      CHECK(std::get<tlb_entry>(res).phys_addr() == (0x10 + pte) << 12);
+      CHECK(reads_of_pte(pte) == 1);
+    }
+  }
+
+  SECTION("The oldest entry is replaced")
+  {
+    tlb.translate({8 << 12, access_type::READ}, s, &mem);
+    tlb.translate({1 << 12, access_type::READ}, s, &mem);
+    tlb.translate({0, access_type::READ}, s, &mem);
+
+    CHECK(reads_of_pte(0) == 2);
+    CHECK(reads_of_pte(1) == 1);
+  }
+
+  SECTION("Clearing the TLB forces new page table walks")
+  {
+    tlb.clear();
+    tlb.translate({0, access_type::READ}, s, &mem);
+
+    CHECK(reads_of_pte(0) == 2);
+  }
+}
+
+TEMPLATE_TEST_CASE("TLBs translate linear memory ranges",
+                   "[tlb]",
+                   (tlb<4>),
+                   (set_assoc_tlb<4, 2>),
+                   (split_tlb<4, 2>),
+                   (simd_tlb<8>),
+                   (shared_tlb<4, 2>))
+{
+  test_memory_32 mem;
+  populate_pm32(mem);
+
+  paging_state const s {RFLAGS_RSVD, CR0_PG | CR0_WP, 0, CR4_PSE, 0, 0};
+  TestType tlb;
+
+  // The 4KB pages 1 to 4 of the second 4MB region are physically contiguous.
+  // Page 5 is not present.
+  linear_memory_op const op {(1 << 22) + 0x1800, access_type::READ};
+
+  std::vector<phys_segment> seg;
+
+  for (int i = 0; i < 2; i++) {
+    REQUIRE_FALSE(tlb.translate_range(op, 0x3800, s, &mem, seg));
+    REQUIRE(seg.size() == 1);
+    CHECK(seg[0].phys_addr == 0x111800);
+    CHECK(seg[0].length == 0x3800);
+  }
+
+  auto const pf = tlb.translate_range(op, 0x3801, s, &mem, seg);
+  REQUIRE(pf);
+  CHECK(pf->cr2 == (1 << 22) + 0x5000);
+}
@@ -13,6 +13,7 @@ TEST_CASE("TLB attributes", "[tlb_attr]")
     CHECK(attr.is_u());
     CHECK_FALSE(attr.is_xd());
     CHECK_FALSE(attr.is_d());
+    CHECK_FALSE(attr.is_g());
   }
 
   SECTION("Attribute construction works")
@@ -33,6 +34,7 @@ TEST_CASE("TLB entry combining", "[tlb_attr]")
   tlb_attr const attr_u {0, 1, 0, 0};
   tlb_attr const attr_xd {0, 0, 1, 0};
   tlb_attr const attr_d {0, 0, 0, 1};
+  tlb_attr const attr_g {0, 0, 0, 0, 1};
 
   SECTION("User bits combine correctly")
   {
@@ -57,4 +59,11 @@ TEST_CASE("TLB entry combining", "[tlb_attr]")
     CHECK(tlb_attr::combine(attr_d, attr_d).is_d());
     CHECK(tlb_attr::combine(attr_nothing, attr_d).is_d());
   }
+
+  SECTION("Global bits combine correctly")
+  {
+    CHECK(tlb_attr::combine(attr_g, attr_g).is_g());
+    CHECK(tlb_attr::combine(attr_nothing, attr_g).is_g());
+    CHECK_FALSE(tlb_attr::combine(attr_nothing, attr_nothing).is_g());
+  }
 }
@@ -1,4 +1,5 @@
 #include <catch2/catch.hpp>
+#include <vmmu/internal/allows_reference.hpp>
 #include <vmmu/vmmu.hpp>
 
 using namespace vmmu;
@@ -23,4 +24,46 @@ TEST_CASE("TLB entries match correctly", "[tlb_entry]")
   }
 }
 
-// TODO Test tlb_entry::allows()
+TEST_CASE("TLB entry permissions match the reference implementation", "[tlb_entry]")
+{
+  using access_type = linear_memory_op::access_type;
+  using supervisor_type = linear_memory_op::supervisor_type;
+
+  size_t checked = 0;
+
+  // Go through all combinations of control bits that influence access rights.
+  for (unsigned controls = 0; controls < 256; controls++) {
+    auto bit = [controls](unsigned i, uint64_t value) { return (controls >> i) & 1 ? value : 0; };
+
+    uint64_t const rflags = RFLAGS_RSVD | bit(0, RFLAGS_AC);
+    uint64_t const cr0 = bit(1, CR0_PG) | bit(2, CR0_WP);
+    uint64_t const cr4 = bit(3, CR4_PAE) | bit(4, CR4_SMEP) | bit(5, CR4_SMAP);
+    uint64_t const efer = bit(6, EFER_LME) | bit(7, EFER_NXE);
+
+    for (unsigned cpl : {0U, 3U}) {
+      paging_state const state {rflags, cr0, 0, cr4, efer, cpl};
+
+      for (unsigned attr_bits = 0; attr_bits < 8; attr_bits++) {
+        tlb_attr const attr {bool(attr_bits & 1), bool(attr_bits & 2), bool(attr_bits & 4), true};
+        tlb_entry const entry {0, 0, 12, attr};
+
+        for (auto type : {access_type::READ, access_type::WRITE, access_type::EXECUTE}) {
+          for (auto sv_type : {supervisor_type::IMPLICIT, supervisor_type::EXPLICIT}) {
+            // There are no implicit instruction fetches.
+            if (type == access_type::EXECUTE and sv_type == supervisor_type::IMPLICIT)
+              continue;
+
+            linear_memory_op const op {0, type, sv_type};
+
+            INFO("controls " << controls << " cpl " << cpl << " attr " << attr_bits << " type "
+                             << int(type) << " sv_type " << int(sv_type));
+            REQUIRE(entry.allows(op, state) == internal::allows_reference(attr, op, state));
+            checked++;
+          }
+        }
+      }
+    }
+  }
+
+  REQUIRE(checked == 256 * 2 * 8 * 5);
+}
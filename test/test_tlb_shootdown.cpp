@@ -0,0 +1,257 @@
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <thread>
+#include <vector>
+#include <vmmu/tlb_shootdown.hpp>
+
+#include "test_memory.hpp"
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+using kind = tlb_invalidation::kind;
+
+// Records the invalidations it receives.
+struct recording_tlb {
+  std::vector<tlb_invalidation> invalidations;
+
+  void clear() { invalidations.push_back(tlb_invalidation::all()); }
+  void invalidate_pcid(uint16_t pcid) { invalidations.push_back(tlb_invalidation::of_pcid(pcid)); }
+  void invalidate_non_global() { invalidations.push_back(tlb_invalidation::non_global()); }
+
+  void invalidate_addresses(uint64_t first, uint64_t last, uint16_t pcid, bool include_global)
+  {
+    invalidations.push_back(tlb_invalidation::addresses(first, last, pcid, include_global));
+  }
+};
+
+// A TLB that can only be cleared.
+struct clear_only_tlb {
+  size_t clears = 0;
+
+  void clear() { clears++; }
+};
+
+}  // namespace
+
+TEST_CASE("TLB shootdowns are applied by their targets", "[tlb_shootdown]")
+{
+  tlb_shootdown sd {3};
+  recording_tlb tlbs[3];
+
+  auto const apply_all = [&]() {
+    for (size_t i = 0; i < 3; i++)
+      sd.apply(i, &tlbs[i]);
+  };
+
+  SECTION("Nothing is applied without shootdowns")
+  {
+    apply_all();
+
+    for (auto const &tlb : tlbs)
+      CHECK(tlb.invalidations.empty());
+  }
+
+  SECTION("Shootdowns reach all vCPUs but the initiator")
+  {
+    sd.shoot_all(tlb_invalidation::addresses(0x1000, 0x1fff, 1, false), 0);
+
+    CHECK_FALSE(sd.is_pending(0));
+    CHECK(sd.is_pending(1));
+    CHECK(sd.is_pending(2));
+
+    apply_all();
+
+    CHECK(tlbs[0].invalidations.empty());
+
+    for (size_t i = 1; i < 3; i++) {
+      REQUIRE(tlbs[i].invalidations.size() == 1);
+      CHECK(tlbs[i].invalidations[0].type == kind::ADDRESSES);
+      CHECK(tlbs[i].invalidations[0].first == 0x1000);
+      CHECK(tlbs[i].invalidations[0].last == 0x1fff);
+      CHECK(tlbs[i].invalidations[0].pcid == 1);
+      CHECK_FALSE(sd.is_pending(i));
+    }
+  }
+
+  SECTION("Single shootdowns only reach their target")
+  {
+    sd.shoot(2, tlb_invalidation::of_pcid(5));
+    apply_all();
+
+    CHECK(tlbs[0].invalidations.empty());
+    CHECK(tlbs[1].invalidations.empty());
+    REQUIRE(tlbs[2].invalidations.size() == 1);
+    CHECK(tlbs[2].invalidations[0].type == kind::PCID);
+  }
+
+  SECTION("Each shootdown is applied only once")
+  {
+    sd.shoot(1, tlb_invalidation::non_global());
+    apply_all();
+    apply_all();
+
+    CHECK(tlbs[1].invalidations.size() == 1);
+  }
+}
+
+TEST_CASE("Repeated TLB shootdowns collapse", "[tlb_shootdown]")
+{
+  tlb_shootdown sd {1};
+  recording_tlb tlb;
+
+  SECTION("Identical shootdowns are queued once")
+  {
+    for (int i = 0; i < 100; i++)
+      sd.shoot(0, tlb_invalidation::addresses(0x1000, 0x1fff, 0, true));
+
+    CHECK(sd.pending_invalidations(0) == 1);
+  }
+
+  SECTION("Adjacent address ranges are merged")
+  {
+    for (uint64_t page = 0; page < 100; page++)
+      sd.shoot(0, tlb_invalidation::addresses(page << 12, (page << 12) + 0xfff, 0, false));
+
+    sd.apply(0, &tlb);
+
+    REQUIRE(tlb.invalidations.size() == 1);
+    CHECK(tlb.invalidations[0].first == 0);
+    CHECK(tlb.invalidations[0].last == (100 << 12) - 1);
+  }
+
+  SECTION("Broader invalidations cover narrower ones")
+  {
+    sd.shoot(0, tlb_invalidation::non_global());
+    sd.shoot(0, tlb_invalidation::of_pcid(3));
+    sd.shoot(0, tlb_invalidation::addresses(0, 0xfff, 3, false));
+
+    CHECK(sd.pending_invalidations(0) == 1);
+
+    // Global translations are not covered by a non-global invalidation.
+    sd.shoot(0, tlb_invalidation::addresses(0, 0xfff, 3, true));
+
+    CHECK(sd.pending_invalidations(0) == 2);
+  }
+
+  SECTION("Full queues collapse into a full flush")
+  {
+    for (uint64_t page = 0; page < 100; page++)
+      sd.shoot(0, tlb_invalidation::addresses(page << 16, page << 16, 0, false));
+
+    sd.apply(0, &tlb);
+
+    REQUIRE_FALSE(tlb.invalidations.empty());
+    CHECK(tlb.invalidations.back().type == kind::ALL);
+    CHECK(tlb.invalidations.size() <= 16);
+  }
+}
+
+TEST_CASE("TLBs without selective invalidation are cleared", "[tlb_shootdown]")
+{
+  tlb_shootdown sd {1};
+  clear_only_tlb tlb;
+
+  sd.shoot(0, tlb_invalidation::addresses(0, 0xfff, 0, false));
+  sd.shoot(0, tlb_invalidation::of_pcid(1));
+  sd.apply(0, &tlb);
+
+  CHECK(tlb.clears == 2);
+}
+
+TEST_CASE("TLB shootdowns invalidate real TLBs", "[tlb_shootdown]")
+{
+  test_memory_32 mem;
+  paging_state const s {RFLAGS_RSVD, CR0_PG, 0, 0, 0, 0};
+
+  mem.write(0, 0x1000 | uint32_t(PTE_P | PTE_A));
+  mem.write(0x1000, 0x10000 | uint32_t(PTE_P | PTE_A));
+
+  tlb_shootdown sd {2};
+  set_assoc_tlb<4, 2> tlbs[2];
+
+  auto const phys_addr = [&](size_t vcpu) {
+    sd.apply(vcpu, &tlbs[vcpu]);
+
+    auto const res = tlbs[vcpu].translate({0, access_type::READ}, s, &mem);
+    REQUIRE(std::holds_alternative<tlb_entry>(res));
+    return std::get<tlb_entry>(res).phys_addr();
+  };
+
+  CHECK(phys_addr(0) == 0x10000);
+  CHECK(phys_addr(1) == 0x10000);
+
+  // vCPU 0 remaps the page and invalidates it locally and remotely.
+  mem.write(0x1000, 0x20000 | uint32_t(PTE_P | PTE_A));
+  tlbs[0].invlpg(0, s);
+  sd.shoot_all(tlb_invalidation::addresses(0, 0, 0, true), 0);
+
+  CHECK(phys_addr(0) == 0x20000);
+  CHECK(phys_addr(1) == 0x20000);
+}
+
+TEST_CASE("TLB shootdown initiators can wait for acknowledgement", "[tlb_shootdown]")
+{
+  size_t const vcpus = 4;
+
+  tlb_shootdown sd {vcpus};
+  std::atomic<bool> done {false};
+  std::atomic<size_t> applied {0};
+
+  std::vector<std::thread> targets;
+
+  for (size_t v = 1; v < vcpus; v++)
+    targets.emplace_back([&, v]() {
+      clear_only_tlb tlb;
+
+      while (not done.load()) {
+        sd.apply(v, &tlb);
+        std::this_thread::yield();
+      }
+
+      applied += tlb.clears;
+    });
+
+  uint64_t last = 0;
+
+  for (int i = 0; i < 1000; i++) {
+    last = sd.shoot_all(tlb_invalidation::all(), 0);
+
+    if (i % 10 == 0) {
+      sd.wait(last, 0);
+
+      for (size_t v = 1; v < vcpus; v++)
+        CHECK_FALSE(sd.is_pending(v));
+    }
+  }
+
+  sd.wait(last, 0);
+  CHECK(sd.is_complete(last, 0));
+
+  done.store(true);
+
+  for (auto &t : targets)
+    t.join();
+
+  // Shootdowns that were issued before the target got to apply them are
+  // collapsed.
+  CHECK(applied.load() >= 100 * (vcpus - 1));
+  CHECK(applied.load() <= 1000 * (vcpus - 1));
+}
+
+TEST_CASE("TLB shootdowns are incomplete until acknowledged", "[tlb_shootdown]")
+{
+  tlb_shootdown sd {2};
+  clear_only_tlb tlb;
+
+  uint64_t const ticket = sd.shoot(1, tlb_invalidation::all());
+
+  CHECK_FALSE(sd.is_complete(ticket));
+  CHECK(sd.is_complete(ticket, 1));
+
+  sd.apply(1, &tlb);
+
+  CHECK(sd.is_complete(ticket));
+}
@@ -0,0 +1,146 @@
+#include <catch2/catch.hpp>
+#include <string>
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+#include <vmmu/stats.hpp>
+#include <vmmu/trace.hpp>
+
+#include "flat_page_tables.hpp"
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+using internal::paging_mode;
+
+// Records the events it receives as strings.
+struct recording_sink final : public trace_sink {
+  std::vector<std::string> events;
+
+  void walk_start(linear_memory_op const &, paging_state const &) override
+  {
+    events.push_back("start");
+  }
+
+  void level_visit(linear_memory_op const &,
+                   paging_state const &,
+                   unsigned level,
+                   uint64_t) override
+  {
+    events.push_back("level " + std::to_string(level));
+  }
+
+  void ad_update(linear_memory_op const &, paging_state const &, unsigned level, bool) override
+  {
+    events.push_back("ad " + std::to_string(level));
+  }
+
+  void fault(linear_memory_op const &, paging_state const &, page_fault_info const &) override
+  {
+    events.push_back("fault");
+  }
+
+  void tlb_fill(linear_memory_op const &, paging_state const &, tlb_entry const &) override
+  {
+    events.push_back("fill");
+  }
+};
+
+}  // namespace
+
+TEST_CASE("Histograms have power-of-2 buckets", "[trace]")
+{
+  CHECK(log2_histogram::bucket_of(0) == 0);
+  CHECK(log2_histogram::bucket_of(1) == 0);
+  CHECK(log2_histogram::bucket_of(2) == 1);
+  CHECK(log2_histogram::bucket_of(3) == 1);
+  CHECK(log2_histogram::bucket_of(1024) == 10);
+  CHECK(log2_histogram::bucket_of(~uint64_t(0)) == 63);
+
+  log2_histogram h;
+
+  h.record(5);
+  h.record(6);
+  h.record(100);
+
+  CHECK(h.bucket(2) == 2);
+  CHECK(h.bucket(6) == 1);
+  CHECK(h.count() == 3);
+
+  h.clear();
+
+  CHECK(h.count() == 0);
+}
+
+TEST_CASE("Walk latencies are recorded per mode and level", "[trace]")
+{
+  flat_page_tables s;
+  walk_latency latency;
+
+  REQUIRE(std::holds_alternative<tlb_entry>(
+      translate({0x10, access_type::READ}, s.state, &s.memory, nullptr, &latency)));
+
+  auto const mode = paging_mode::PM64_4LEVEL;
+
+  CHECK(latency.translation_cycles(mode).count() == 1);
+  CHECK(latency.translation_cycles(paging_mode::PM32).count() == 0);
+
+  for (unsigned level = 1; level <= 4; level++)
+    CHECK(latency.read_cycles(mode, level).count() == 1);
+
+  CHECK(latency.ad_update_cycles(mode, 1).count() == 1);
+  CHECK(latency.ad_update_cycles(mode, 2).count() == 0);
+
+  latency.clear();
+
+  CHECK(latency.translation_cycles(mode).count() == 0);
+}
+
+TEST_CASE("Tracers forward events to an attached sink", "[trace]")
+{
+  flat_page_tables s;
+  recording_sink sink;
+  tlb<4, walk_tracer> tlb;
+
+  SECTION("Nothing is sent without a sink")
+  {
+    tlb.translate({0x10, access_type::READ}, s.state, &s.memory);
+
+    CHECK(sink.events.empty());
+  }
+
+  SECTION("Walks and fills are traced")
+  {
+    tlb.observer().attach(&sink);
+    tlb.translate({0x10, access_type::READ}, s.state, &s.memory);
+
+    CHECK(sink.events == std::vector<std::string> {"start", "level 4", "level 3", "level 2",
+                                                   "level 1", "ad 1", "fill"});
+  }
+
+  SECTION("Faults are traced")
+  {
+    s.entry(0x3000) = 0;
+
+    tlb.observer().attach(&sink);
+    tlb.translate({0x10, access_type::READ}, s.state, &s.memory);
+
+    CHECK(sink.events ==
+          std::vector<std::string> {"start", "level 4", "level 3", "level 2", "fault"});
+  }
+}
+
+TEST_CASE("Observer lists call all observers", "[trace]")
+{
+  flat_page_tables s;
+  recording_sink sink;
+  observer_list<translation_stats, walk_tracer> observers;
+
+  observers.get<1>().attach(&sink);
+
+  translate({0x10, access_type::READ}, s.state, &s.memory, nullptr, &observers);
+
+  CHECK(translation_counters::total(observers.get<0>().snapshot().translations) == 1);
+  CHECK(sink.events.size() == 6);
+}
@@ -0,0 +1,256 @@
+#include <catch2/catch.hpp>
+#include <vector>
+#include <vmmu/flat_memory.hpp>
+#include <vmmu/translation_trace.hpp>
+
+#include "flat_page_tables.hpp"
+
+using namespace vmmu;
+
+namespace
+{
+using access_type = linear_memory_op::access_type;
+using supervisor_type = linear_memory_op::supervisor_type;
+
+// Linear page 1 is mapped to 0x456000 in addition.
+struct trace_setup : flat_page_tables {
+  trace_setup() { entry(0x4008) = 0x456000 | PTE_P | PTE_A; }
+};
+
+std::vector<trace_event> decode(std::vector<uint8_t> const &trace)
+{
+  trace_reader reader {trace.data(), trace.size()};
+  std::vector<trace_event> events;
+
+  while (auto event = reader.next())
+    events.push_back(*event);
+
+  CHECK_FALSE(reader.error());
+  return events;
+}
+
+}  // namespace
+
+TEST_CASE("Traces encode accesses and state changes", "[translation_trace]")
+{
+  paging_state state {RFLAGS_RSVD | RFLAGS_AC,
+                      CR0_PG | CR0_WP,
+                      0x1000,
+                      CR4_PAE | CR4_SMAP,
+                      EFER_LME | EFER_NXE,
+                      3};
+  std::vector<linear_memory_op> const ops {
+      {0x1000, access_type::READ},
+      {0x1008, access_type::WRITE},
+      {0x10, access_type::EXECUTE},
+      {~uint64_t(0xfff), access_type::READ, supervisor_type::IMPLICIT},
+      {0, access_type::WRITE, supervisor_type::IMPLICIT},
+  };
+
+  trace_recorder recorder;
+
+  for (auto const &op : ops)
+    recorder.record_access(op, state);
+
+  state.set_cr3(0x2000);
+  recorder.record_access(ops[0], state);
+
+  auto const events = decode(recorder.buffer());
+
+  REQUIRE(events.size() == ops.size() + 3);
+  REQUIRE(std::holds_alternative<trace_state>(events[0]));
+  CHECK(std::get<trace_state>(events[0]).to_paging_state().get_cr3() == 0x1000);
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    auto const &op = std::get<linear_memory_op>(events[i + 1]);
+
+    CHECK(op.linear_addr == ops[i].linear_addr);
+    CHECK(op.type == ops[i].type);
+    CHECK(op.sv_type == ops[i].sv_type);
+  }
+
+  auto const &changed = std::get<trace_state>(events[ops.size() + 1]);
+
+  CHECK(changed == trace_state::of(state));
+  CHECK(std::get<linear_memory_op>(events.back()).linear_addr == 0x1000);
+
+  SECTION("Recorded states recreate the paging state")
+  {
+    paging_state const replayed = changed.to_paging_state();
+
+    CHECK(trace_state::of(replayed) == changed);
+    CHECK(replayed.get_paging_mode() == internal::paging_mode::PM64_4LEVEL);
+    CHECK(replayed.get_rflags_ac());
+    CHECK_FALSE(replayed.is_supervisor());
+  }
+
+  SECTION("Applying a state reports what changed")
+  {
+    paging_state replayed = std::get<trace_state>(events[0]).to_paging_state();
+
+    CHECK(changed.apply(&replayed) == paging_state::CHANGE_CR3);
+    CHECK(changed.apply(&replayed) == 0);
+  }
+}
+
+TEST_CASE("Traces only record page table entries when they change", "[translation_trace]")
+{
+  trace_recorder recorder;
+
+  recorder.record_entry(0x2000, 0x3003);
+  recorder.record_entry(0x1000, 0x2003);
+  recorder.record_entry(0x2000, 0x3003);
+  recorder.entry_updated(0x1000, 0x2023);
+  recorder.record_entry(0x1000, 0x2023);
+  recorder.record_entry(0x1000, 0x2003);
+
+  auto const events = decode(recorder.buffer());
+
+  REQUIRE(events.size() == 3);
+  CHECK(std::get<trace_entry>(events[0]).phys_addr == 0x2000);
+  CHECK(std::get<trace_entry>(events[1]).phys_addr == 0x1000);
+  CHECK(std::get<trace_entry>(events[1]).value == 0x2003);
+  CHECK(std::get<trace_entry>(events[2]).phys_addr == 0x1000);
+  CHECK(std::get<trace_entry>(events[2]).value == 0x2003);
+}
+
+TEST_CASE("Traces keep CR3_NOFLUSH of CR3 writes", "[translation_trace]")
+{
+  paging_state state {RFLAGS_RSVD, CR0_PG, 0x1000 | 1, CR4_PAE | CR4_PCIDE, EFER_LME, 0};
+  trace_recorder recorder;
+
+  // CR3 writes before the first access have nothing to flush.
+  recorder.record_cr3_write(0x1000 | 1);
+  recorder.record_access({0x10, access_type::READ}, state);
+
+  uint64_t const value = 0x2000 | 2 | CR3_NOFLUSH;
+
+  recorder.record_cr3_write(value);
+  state.set_cr3(value);
+  recorder.record_access({0x10, access_type::READ}, state);
+
+  auto const events = decode(recorder.buffer());
+
+  REQUIRE(events.size() == 4);
+  REQUIRE(std::holds_alternative<trace_cr3_write>(events[2]));
+  CHECK(std::get<trace_cr3_write>(events[2]).value == value);
+
+  // The state didn't change apart from the recorded CR3 write.
+  CHECK(std::holds_alternative<linear_memory_op>(events[3]));
+}
+
+TEST_CASE("Recorded translations replay with the same results", "[translation_trace]")
+{
+  trace_setup setup;
+  trace_recorder recorder;
+  tlb<4> recording_tlb;
+
+  std::vector<linear_memory_op> const ops {
+      {0x10, access_type::READ},  {0x20, access_type::WRITE}, {0x1010, access_type::READ},
+      {0x1010, access_type::WRITE}, {0x2000, access_type::READ}, {0x30, access_type::READ},
+  };
+  std::vector<translate_result> recorded;
+
+  for (auto const &op : ops)
+    recorded.push_back(recorder.translate(&recording_tlb, op, setup.state, &setup.memory));
+
+  // The walks set accessed and dirty flags in the original page table.
+  CHECK(setup.entry(0x4000) & PTE_D);
+
+  trace_memory memory;
+  trace_reader reader {recorder.buffer().data(), recorder.buffer().size()};
+  std::optional<paging_state> state;
+  std::vector<translate_result> replayed;
+
+  while (auto const event = reader.next()) {
+    if (auto const *op = std::get_if<linear_memory_op>(&*event))
+      replayed.push_back(translate(*op, *state, &memory));
+    else if (auto const *regs = std::get_if<trace_state>(&*event))
+      state = regs->to_paging_state();
+    else
+      memory.apply(std::get<trace_entry>(*event));
+  }
+
+  CHECK_FALSE(reader.error());
+  REQUIRE(replayed.size() == recorded.size());
+
+  for (size_t i = 0; i < recorded.size(); i++) {
+    CHECK(replayed[i].index() == recorded[i].index());
+
+    if (auto const *entry = std::get_if<tlb_entry>(&recorded[i]))
+      CHECK(std::get<tlb_entry>(replayed[i]).phys_addr() == entry->phys_addr());
+  }
+
+  // The replayed walks set the dirty flag in their copy of the page table.
+  CHECK(memory.read(0x4000, uint64_t {}) == setup.entry(0x4000));
+}
+
+TEST_CASE("Recording with a warm TLB replays without page faults", "[translation_trace]")
+{
+  trace_setup setup;
+  tlb<4> warm_tlb;
+
+  // Cache both pages before recording starts.
+  for (uint64_t la : {0x10, 0x1010})
+    REQUIRE(std::holds_alternative<tlb_entry>(
+        warm_tlb.translate({la, access_type::READ}, setup.state, &setup.memory)));
+
+  trace_recorder recorder;
+
+  for (uint64_t la : {0x20, 0x1020})
+    recorder.translate(&warm_tlb, {la, access_type::READ}, setup.state, &setup.memory);
+
+  trace_memory memory;
+  trace_reader reader {recorder.buffer().data(), recorder.buffer().size()};
+  std::optional<paging_state> state;
+  size_t translations = 0;
+
+  while (auto const event = reader.next()) {
+    if (auto const *op = std::get_if<linear_memory_op>(&*event)) {
+      CHECK(std::holds_alternative<tlb_entry>(translate(*op, *state, &memory)));
+      translations++;
+    } else if (auto const *regs = std::get_if<trace_state>(&*event)) {
+      state = regs->to_paging_state();
+    } else {
+      memory.apply(std::get<trace_entry>(*event));
+    }
+  }
+
+  CHECK(translations == 2);
+}
+
+TEST_CASE("Invalid traces are detected", "[translation_trace]")
+{
+  trace_recorder recorder;
+
+  recorder.record_access({0x123456789, access_type::READ}, {RFLAGS_RSVD, 0, 0, 0, 0, 0});
+
+  std::vector<uint8_t> trace = recorder.buffer();
+
+  SECTION("Traces without header")
+  {
+    trace[0] = 'X';
+
+    trace_reader reader {trace.data(), trace.size()};
+
+    CHECK_FALSE(reader.next());
+    CHECK(reader.error());
+  }
+
+  SECTION("Truncated traces")
+  {
+    trace_reader reader {trace.data(), trace.size() - 1};
+
+    CHECK(reader.next());
+    CHECK_FALSE(reader.next());
+    CHECK(reader.error());
+  }
+
+  SECTION("Empty traces are valid")
+  {
+    trace_reader reader {trace.data(), TRACE_MAGIC.size()};
+
+    CHECK_FALSE(reader.next());
+    CHECK_FALSE(reader.error());
+  }
+}